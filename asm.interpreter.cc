@@ -1,483 +1,181 @@
-#include "machine.h"
+#include "assembler.h"
+#include "optimizer.h"
+#include "translator.h"
+#include "bytecode.h"
+#include "machine.differential.h"
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
-#include <vector>
-#include <string_view>
-#include <charconv>
+#include <string>
+#include <algorithm>
+#include <thread>
 
-using std::FILE;
-using std::fopen;
 using std::string;
 using std::puts;
-using std::fgetc;
-using std::feof;
-using std::ferror;
-using std::vector;
-using std::string_view;
 using std::strcmp;
-using std::stoull;
-using std::fwrite;
-using std::stoll;
-using std::stoull;
-using std::stod;
+using std::strncmp;
 
-using Label = pair<string, size_t>;
-using Labels = std::unordered_map<string, size_t>;
-
-constexpr uint32_t kMaxJumpArg = 0x3FFFFFF;
-
-bool ReadInst(vector<string> &dest, FILE *fp) {
-  bool result = true;
-  
-  dest.clear();
-  unsigned char c;
-  string buf;
-
-  // TODO:comments
-  while (true) {
-    c = static_cast<unsigned char>(fgetc(fp));
-    
-    if (feof(fp)) {
-      result = false;
-      break;
-    }
-
-    if (ferror(fp)) {
-      puts("Stream error occurred while reading file");
-      result = false;
-      break;
-    }
-
-    if (c == '\r' || c == '\n') {
-      if (!buf.empty()) {
-        dest.push_back(buf);
-      }
-      break;
-    }
-    else if (c == ' ' || c == '\t') {
-      if (!buf.empty()) {
-        dest.push_back(buf);
-        buf.clear();
-      }
-    }
-    else {
-      buf.append(1, c);
-    }
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    puts("Invalid arguments");
+    return 0;
   }
 
-  return result;
-}
-
-bool GetInst(uint32_t &dest, string_view str) {
-  bool result = false;  
-  
-  for (size_t idx = 0, size = kInstStrings.size(); 
-      idx < size; idx += 1) {
-    if (strcmp(str.data(), kInstStrings[idx]) == 0) {
-      dest = static_cast<uint32_t>(idx);
-      result = true;
-      break;
+  // options after run/compile/translate/difftest
+  MachineOptions options;
+  int opt_level = 0;
+  // large sources are assembled on all cores by default
+  size_t asm_threads = std::max(1u, std::thread::hardware_concurrency());
+#ifdef CANVAS_PROFILE_PAIRS
+  const char *pair_profile = nullptr;
+#endif
+#ifdef CANVAS_PROFILE
+  const char *profile = nullptr;
+#endif
+  for (int idx = 3; idx < argc; idx += 1) {
+    if (ParseMachineOption(options, argv[idx])) {
+      continue;
     }
-  }
-
-  return result;
-}
-
-inline bool IsUnsignedInst(Inst inst) {
-  return inst == Inst::AddU
-    || inst == Inst::SubU
-    || inst == Inst::MulU
-    || inst == Inst::DivU
-    || inst == Inst::ModU
-    || inst == Inst::PushHalfWordImm
-    || inst == Inst::PushHalfWordImmSL16
-    || inst == Inst::Jump
-    || inst == Inst::Branch;
-}
-
-inline bool IsJumpInst(Inst inst) {
-  return inst == Inst::Jump
-    || inst == Inst::Branch
-    || inst == Inst::FarJump
-    || inst == Inst::FarBranch;
-}
 
-inline bool IsAlpha(char c) {
-  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
-}
-
-inline bool IsNumber(char c) {
-  return (c >= '0' && c <= '9');
-}
-
-inline bool IsLabelString(string_view src) {
-  if (src.size() < 2) {
-    return false;
-  }
-  
-  if (src[src.size() - 1] != ':') {
-    return false;
-  }
-
-  for (size_t i = 0; i < src.size() - 1; i += 1) {
-    if (!IsAlpha(src[i]) && !IsNumber(src[i])) {
-      return false;
+    if (strncmp(argv[idx], "--asm-threads=", 14) == 0) {
+      asm_threads = size_t(std::max(1, atoi(argv[idx] + 14)));
+      continue;
     }
-  }
 
-  return true;
-}
-
-inline bool IsSegmentUnit(string_view src) {
-  if (src.size() < 2) {
-    return false;
-  }
-
-  if (src[0] != '.') {
-    return false;
-  }
-
-  for (size_t i = 1; i < src.size(); i += 1) {
-    if (!IsAlpha(src[i]) && !IsNumber(src[i])) {
-      return false;
+#ifdef CANVAS_PROFILE_PAIRS
+    if (strncmp(argv[idx], "--pair-profile=", 15) == 0) {
+      pair_profile = argv[idx] + 15;
+      continue;
     }
-  }
-
-  return true;
-}
-
-int GetIntLiteralBase(string_view str) {
-  if (str.size() == 1) {
-    return 10;
-  }
-
-  auto prefix = str.substr(0, 2);
-
-  if (prefix[0] == '+' || prefix[0] == '-') {
-    return 10;
-  }
-
-  if (prefix == "0x" || prefix == "0X") {
-    return 16;
-  }
-
-  if (prefix == "0b" || prefix == "0B") {
-    return 2;
-  }
+#endif
 
-  if (prefix[0] == '0') {
-    return 8;
-  }
-
-  return 10;
-}
-
-bool TryExpandMacro(vector<string> &assembly, Program &prog) {
-  if (assembly.size() < 2) {
-    return false;
-  }
-
-  bool result = true;
-  int base = 10;
-
-#define IS_MACRO(_str) (strcmp(assembly[0].data(), _str) == 0)
-  if (IS_MACRO("pushimm")) {
-    base = GetIntLiteralBase(assembly[1]);
-    if (base == 2) {
-      assembly[1] = assembly[1].substr(2, assembly[1].size() - 2);
+#ifdef CANVAS_PROFILE
+    if (strncmp(argv[idx], "--profile=", 10) == 0) {
+      profile = argv[idx] + 10;
+      continue;
     }
-    int64_t value = stoll(assembly[1], nullptr, base);
-    auto view = reinterpret_cast<uint64_t *>(&value);
+#endif
 
-    if (*view > UINT16_MAX && *view <= UINT32_MAX) {
-      uint32_t hi = *view >> 16;
-      uint32_t lo = *view & UINT16_MAX;
-      prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-      prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-      prog.push_back(Code(Inst::AddU));
-    }
-    else if (*view > UINT32_MAX) {
-      uint32_t hi32 = *view >> 32;
-      uint32_t lo32 = *view & UINT32_MAX;
-      // load hi32
-      uint32_t hi = hi32 >> 16;
-      uint32_t lo = hi32 & UINT16_MAX;
-      prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-      prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-      prog.push_back(Code(Inst::AddU));
-      prog.push_back((32u << 7) + Code(Inst::ShiftLeftImm));
-      // load lo32
-      hi = lo32 >> 16;
-      lo = lo32 & UINT16_MAX;
-      prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-      prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-      prog.push_back(Code(Inst::AddU));
-      // final combination
-      prog.push_back(Code(Inst::AddU));
-    }
-    else {
-      Code arg = (*view) << 7;
-      prog.push_back(arg + Code(Inst::PushHalfWordImm));
+    // -O0 ... -O3
+    if (argv[idx][0] == '-' && argv[idx][1] == 'O' 
+      && argv[idx][2] >= '0' && argv[idx][2] <= '0' + kMaxOptimizeLevel
+      && argv[idx][3] == '\0') {
+      opt_level = argv[idx][2] - '0';
+      continue;
     }
-    prog.push_back(Code(Inst::SpawnSignedInt));
-  }
-  else if (IS_MACRO("pushuimm")) {
-    base = GetIntLiteralBase(assembly[1]);
-    if (base == 2) {
-      assembly[1] = assembly[1].substr(2, assembly[1].size() - 2);
-    }
-    uint64_t value = stoull(assembly[1], nullptr, base);
-    if (value > UINT16_MAX && value <= UINT32_MAX) {
-      uint32_t hi = value >> 16;
-      uint32_t lo = value & UINT16_MAX;
-      prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-      prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-      prog.push_back(Code(Inst::AddU));
-    }
-    else if (value > UINT32_MAX) {
-      uint32_t hi32 = value >> 32;
-      uint32_t lo32 = value & UINT32_MAX;
-      // load hi32
-      uint32_t hi = hi32 >> 16;
-      uint32_t lo = hi32 & UINT16_MAX;
-      prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-      prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-      prog.push_back(Code(Inst::AddU));
-      prog.push_back((32u << 7) + Code(Inst::ShiftLeftImm));
-      // load lo32
-      hi = lo32 >> 16;
-      lo = lo32 & UINT16_MAX;
-      prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-      prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-      prog.push_back(Code(Inst::AddU));
-      // final combination
-      prog.push_back(Code(Inst::AddU));
-    }
-    else {
-      Code arg = value << 7;
-      prog.push_back((arg << 7) + Code(Inst::PushHalfWordImm));
-    }
-  }
-  else if (IS_MACRO("pushfp")) {
-    double value = stod(assembly[1]);
-    auto view = reinterpret_cast<uint64_t *>(&value);
-    uint64_t hi32 = *view >> 32;
-    uint64_t lo32 = *view & UINT32_MAX;
-    // load hi32
-    uint32_t hi = hi32 >> 16;
-    uint32_t lo = hi32 & UINT16_MAX;
-    prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-    prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-    prog.push_back(Code(Inst::AddU));
-    prog.push_back((32u << 7) + Code(Inst::ShiftLeftImm));
-    // load lo32
-    hi = lo32 >> 16;
-    lo = lo32 & UINT16_MAX;
-    prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-    prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-    prog.push_back(Code(Inst::AddU));
-    // final combination
-    prog.push_back(Code(Inst::AddU));
-    prog.push_back(Code(Inst::SpawnFP));
-  }
-  else {
-    result = false;
-  }
-#undef IS_MACRO
 
-  return result;
-}
-
-bool TryExpandJumpInsn(vector<string> &assembly, Program &prog, Labels &labels) {
-  if (assembly.size() < 2) {
-    return false;
-  }
-
-  bool result = true;
-
-  auto it = labels.find(assembly[1]);
-
-  if (it == labels.end()) {
-    result = false;
-  }
-  else {
-    size_t offset = it->second;
-
-#define IS_INSN(_str) (strcmp(assembly[0].data(), _str) == 0)
-    // if offset's binary length large than 25bit, use FarJump/FarBranch instead.
-    if (offset > kMaxJumpArg) {
-      if (offset <= UINT32_MAX) {
-        uint32_t hi = offset >> 16;
-        uint32_t lo = offset & UINT16_MAX;
-        prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-        prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-        prog.push_back(Code(Inst::AddU));
-      }
-      else if (offset > UINT32_MAX) {
-        uint32_t hi32 = offset >> 32;
-        uint32_t lo32 = offset & UINT32_MAX;
-        // load hi32
-        uint32_t hi = hi32 >> 16;
-        uint32_t lo = hi32 & UINT16_MAX;
-        prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-        prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-        prog.push_back(Code(Inst::AddU));
-        prog.push_back((32u << 7) + Code(Inst::ShiftLeftImm));
-        // load lo32
-        hi = lo32 >> 16;
-        lo = lo32 & UINT16_MAX;
-        prog.push_back((hi << 7) + Code(Inst::PushHalfWordImmSL16));
-        prog.push_back((lo << 7) + Code(Inst::PushHalfWordImm));
-        prog.push_back(Code(Inst::AddU));
-        // final combination
-        prog.push_back(Code(Inst::AddU));
-      }
-
-      if (IS_INSN("jmp") || IS_INSN("farjmp")) {
-        prog.push_back(Code(Inst::FarJump));
-      }
-      else if (IS_INSN("branch") || IS_INSN("farbranch")) {
-        prog.push_back(Code(Inst::FarBranch));
-      }
-    }
-    else {
-      Code insn = offset << 7;
-
-      if (IS_INSN("jmp") || IS_INSN("farjmp")) {
-        insn += Code(Inst::Jump);
-      }
-      else if (IS_INSN("branch") || IS_INSN("farbranch")) {
-        insn += Code(Inst::Branch);
-      }
-
-      prog.push_back(insn);
-    }
-#undef IS_INSN
-  }
-
-  return result;
-}
-
-bool ExpandSegementContents(vector<string> &assembly, Program &prog, Labels &labels) {
-  bool result = true;
-
-
-  return result;
-}
-
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    puts("Invalid arguments");
+    printf("Invalid option: %s\n", argv[idx]);
     return 0;
   }
-  //open asm file
-  auto fp = fopen(argv[1], "r");
+
   Program prog;
   Labels labels;
-  uint32_t inst, args;
-  int base;
-  // Record offset without label line
-  size_t asm_offset = 0;
-  bool fine = true;
-
-  if (fp != nullptr) {
-    vector<string> assembly;
-
-    while (ReadInst(assembly, fp)) {
-      if (assembly.empty()) {
-        continue;
-      }
-
-      if (IsLabelString(assembly[0])) {
-        auto substr = assembly[0].substr(0, assembly[0].size() - 1);
-        //printf("Found label %s\n", substr.data()); 
-        labels.insert(Label(substr.data(), asm_offset));
-        continue;
-      }
-
-      asm_offset += 1;
+  AsmLines lines;
+  AsmLines *track_lines = nullptr;
+#ifdef CANVAS_PROFILE
+  // pcs map back to the source only while the optimizer leaves them be
+  if (profile != nullptr && opt_level == 0) {
+    track_lines = &lines;
+  }
+#endif
 
-      if (TryExpandMacro(assembly, prog)) {
-        continue;
+  if (AssembleFile(argv[1], prog, labels, asm_threads, track_lines)) {
+    if (opt_level > 0) {
+      auto report = OptimizeProgram(prog, opt_level);
+      if (report.skipped) {
+        fprintf(stderr, "Optimizer: skipped, jump targets could not be resolved or moved\n");
       }
-
-      if (!GetInst(inst, assembly[0])) {
-        printf("Invalid instruction: %s %lu\n", assembly[0].data(), assembly.size());
-        fine = false;
-
-        break;
+      else {
+        fprintf(stderr, "Optimizer: removed %zu of %zu instructions (%zu -> %zu words)\n",
+          report.insts_before - report.insts_after, report.insts_before,
+          report.words_before, report.words_after);
       }
+    }
 
-      if (IsJumpInst(static_cast<Inst>(inst))) {
-        if (!TryExpandJumpInsn(assembly, prog, labels)) {
-          puts("Warning: failed to expand jump insn"); 
+    if (!prog.empty()) {
+      if (argc == 2 || strcmp(argv[2], "run") == 0) {
+        Machine machine(options);
+#ifdef CANVAS_PROFILE
+        machine.EnableProfile(profile != nullptr);
+#endif
+        RunWithOptions(machine, prog, options);
+        if (options.gc_stats) {
+          PrintHeapStats(stderr, machine.GetHeap().GetStats());
         }
-        continue;
-      }
-
-      //generate actual inst 
-      if (assembly.size() == 2) {
-        if (IsUnsignedInst(static_cast<Inst>(inst))) {
-          if (assembly[1][0] == '+' || assembly[1][0] == '-') {
-            puts("Invalid literal for unsigned instruction");
-            fine = false;
-          }
-          else {
-            base = GetIntLiteralBase(assembly[1]);
-            if (base == 2) {
-              assembly[1] = assembly[1].substr(2, assembly[1].size() - 2);
-            }
-            args = stoull(assembly[1], nullptr, base);
+#ifdef CANVAS_PROFILE_PAIRS
+        if (pair_profile != nullptr) {
+          auto profile_fp = fopen(pair_profile, "a");
+          if (profile_fp != nullptr) {
+            machine.DumpPairProfile(profile_fp);
+            fclose(profile_fp);
           }
         }
-        else {
-          base = GetIntLiteralBase(assembly[1]);
-          if (base == 2) {
-            assembly[1] = assembly[1].substr(2, assembly[1].size() - 2);
+#endif
+#ifdef CANVAS_PROFILE
+        if (profile != nullptr) {
+          ProfileSource source;
+          source.path = argv[1];
+          if (opt_level == 0) {
+            for (auto &label : labels) {
+              source.labels.emplace_back(label.second, label.first);
+            }
+            std::sort(source.labels.begin(), source.labels.end());
+            source.lines.assign(lines.begin(), lines.end());
           }
 
-          int32_t signed_val = stoll(assembly[1], nullptr, base);
-          args = *reinterpret_cast<uint32_t *>(&signed_val);
+          auto profile_fp = fopen(profile, "w");
+          if (profile_fp != nullptr) {
+            machine.DumpProfile(profile_fp, source);
+            fclose(profile_fp);
+          }
+          else {
+            printf("Cannot write profile to %s\n", profile);
+          }
         }
+#endif
       }
+      else if (strcmp(argv[2], "compile") == 0) {
+        string out(argv[1]);
+        out.append(".bc");
 
-      if (!fine) break;
-
-      Code output = args << 7;
-      output += inst;
-      prog.push_back(output);
-    }
+        BytecodeSections sections;
+        // label offsets are stale once the optimizer moved code
+        if (opt_level == 0) {
+          for (auto &label : labels) {
+            sections.symbols.push_back(BytecodeSymbol{ label.first, label.second });
+          }
+          // same file whatever order the labels were hashed in
+          std::sort(sections.symbols.begin(), sections.symbols.end(),
+            [](const BytecodeSymbol &lhs, const BytecodeSymbol &rhs) {
+              return lhs.value != rhs.value ? lhs.value < rhs.value : lhs.name < rhs.name;
+            });
+        }
 
-    fclose(fp);
-    
-    if (fine && !prog.empty()) {
-      if (argc == 2 || strcmp(argv[2], "run") == 0) {
-        Machine machine;
-        machine.Run(prog);
+        WriteBytecodeFile(out.data(), prog, sections);
       }
-      else if (strcmp(argv[2], "compile") == 0) {
+      else if (strcmp(argv[2], "translate") == 0) {
         string out(argv[1]);
-        out.append(".bc");
-        fp = fopen(out.data(), "wb");
-        
+        out.append(".cc");
+        auto fp = fopen(out.data(), "w");
+
         if (fp != nullptr) {
-          for (auto &code : prog) {
-            fwrite(&code, sizeof(Code), 1, fp);
-            if (ferror(fp)) {
-              puts("Error occurred while writing bytecodes");
-              break;
-            }
+          auto report = TranslateProgram(fp, prog, options, argv[1]);
+          fclose(fp);
+
+          if (!report.fine) {
+            printf("Cannot translate %s at %zu\n", report.error, report.bad_target);
+            remove(out.data());
           }
         }
-
-        fclose(fp);
+        else {
+          puts("Cannot open output file");
+        }
+      }
+      else if (strcmp(argv[2], "difftest") == 0) {
+        return DiffDispatchModes(prog, options, argv[1]) ? 0 : 1;
       }
     }
   }
-  else {
-    puts("Invalid assembly file");
-  }
   
   return 0;
 }
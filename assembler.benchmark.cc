@@ -0,0 +1,220 @@
+#include "assembler.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <thread>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using std::string;
+
+// Assembly throughput on a generated source of several megabytes.
+// "fgetc" is the old front end, one fgetc per character, a std::string
+// per token and a strcmp scan of kInstStrings per mnemonic, kept here as
+// the baseline. "lexer" does the same work, tokens and mnemonic lookup,
+// with AsmLexer and GetInst(). "assemble" and "file" are the whole
+// assembler on the buffer and on the mapped file, the rows after them
+// FeedParallel() on more and more threads.
+
+// 10 lines each
+constexpr size_t kLoopCount = 200000;
+constexpr int kRounds = 3;
+
+// countdown loops like the bench kernels, with macros and every plain
+// mnemonic in between, and a jump to a loop anywhere in the file
+string MakeSource() {
+  string source;
+  uint64_t seed = 0x2545F4914F6CDD1D;
+  auto next = [&seed]() {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+  };
+
+  vector<const char *> plain;
+  for (size_t idx = 0; idx < kInstStrings.size(); idx += 1) {
+    auto inst = static_cast<Inst>(idx);
+    if (GetInstLength(inst) == 1 && inst != Inst::Jump && inst != Inst::Branch
+      && inst != Inst::FarJump && inst != Inst::FarBranch) {
+      plain.push_back(kInstStrings[idx]);
+    }
+  }
+
+  char line[64];
+  for (size_t idx = 0; idx < kLoopCount; idx += 1) {
+    snprintf(line, sizeof(line), "pushhwi %u\nloop%zu:\n", unsigned(next() % 100000), idx);
+    source += line;
+    snprintf(line, sizeof(line), "pushimm %lld\n", (long long)(next() >> 20) - (1ll << 43));
+    source += line;
+    snprintf(line, sizeof(line), "pushfp %.6f\n", double(next() % 1000000) / 64.0);
+    source += line;
+    snprintf(line, sizeof(line), "\t%s\n", plain[next() % plain.size()]);
+    source += line;
+    snprintf(line, sizeof(line), "  %s\npushhwi 1\nsubu\n", plain[next() % plain.size()]);
+    source += line;
+    snprintf(line, sizeof(line), "branch loop%zu\njmp loop%zu\n", idx, next() % kLoopCount);
+    source += line;
+  }
+
+  return source;
+}
+
+// tokens and mnemonic lookups of the old ReadInst()/GetInst()
+uint64_t LexLegacy(FILE *fp) {
+  uint64_t checksum = 0;
+  vector<string> dest;
+  string buf;
+  bool more = true;
+
+  while (more) {
+    dest.clear();
+    buf.clear();
+    while (true) {
+      auto c = static_cast<unsigned char>(fgetc(fp));
+      if (feof(fp) || ferror(fp)) {
+        more = false;
+        break;
+      }
+
+      if (c == '\r' || c == '\n') {
+        if (!buf.empty()) dest.push_back(buf);
+        break;
+      }
+      else if (c == ' ' || c == '\t') {
+        if (!buf.empty()) {
+          dest.push_back(buf);
+          buf.clear();
+        }
+      }
+      else {
+        buf.append(1, c);
+      }
+    }
+
+    if (dest.empty()) continue;
+    checksum += dest.size();
+    for (size_t idx = 0, size = kInstStrings.size(); idx < size; idx += 1) {
+      if (strcmp(dest[0].data(), kInstStrings[idx]) == 0) {
+        checksum += idx;
+        break;
+      }
+    }
+  }
+
+  return checksum;
+}
+
+uint64_t Lex(string_view source) {
+  uint64_t checksum = 0;
+  vector<string_view> tokens;
+  AsmLexer lexer(source);
+  uint32_t inst;
+
+  while (lexer.NextLine(tokens)) {
+    if (tokens.empty()) continue;
+    checksum += tokens.size();
+    if (GetInst(inst, tokens[0])) {
+      checksum += inst;
+    }
+  }
+
+  return checksum;
+}
+
+template <typename Fn>
+double Best(Fn fn) {
+  double best = 1e30;
+  for (int round = 0; round < kRounds; round += 1) {
+    auto begin = steady_clock::now();
+    fn();
+    duration<double> elapsed = steady_clock::now() - begin;
+    best = std::min(best, elapsed.count());
+  }
+
+  return best;
+}
+
+// usage: bench-asm [max threads] [scratch file]
+// one thread per hardware thread and bin/bench-asm.csrc by default
+int main(int argc, char **argv) {
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (argc > 1) {
+    max_threads = std::max(1, atoi(argv[1]));
+  }
+  const char *path = argc > 2 ? argv[2] : "bin/bench-asm.csrc";
+  auto source = MakeSource();
+  double megabytes = source.size() / 1e6;
+
+  auto fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    printf("Cannot write %s\n", path);
+    return 1;
+  }
+  fwrite(source.data(), 1, source.size(), fp);
+  fclose(fp);
+  printf("%.1f MB, %zu lines\n", megabytes, kLoopCount * 10);
+
+  bool fine = true;
+  auto report = [&fine, megabytes](const char *name, double seconds, bool checked) {
+    printf("%-10s %8.1f MB/s%s\n", name, megabytes / seconds, checked ? "" : "  MISMATCH");
+    fine = fine && checked;
+  };
+
+  uint64_t expected = Lex(source);
+  uint64_t legacy = 0;
+  double seconds = Best([&]() {
+    auto in = fopen(path, "rb");
+    if (in == nullptr) return;
+    legacy = LexLegacy(in);
+    fclose(in);
+  });
+  report("fgetc", seconds, legacy == expected);
+
+  uint64_t checksum = 0;
+  seconds = Best([&]() { checksum = Lex(source); });
+  report("lexer", seconds, checksum == expected);
+
+  Program prog;
+  seconds = Best([&]() {
+    prog.clear();
+    Assembler assembler(prog);
+    assembler.Feed(source);
+    assembler.Finish();
+  });
+  report("assemble", seconds, !prog.empty());
+
+  Program from_file;
+  Labels labels;
+  seconds = Best([&]() {
+    from_file.clear();
+    AssembleFile(path, from_file, labels);
+  });
+  report("file", seconds, from_file == prog && labels.size() == kLoopCount);
+
+  vector<size_t> thread_counts;
+  for (size_t count = 1; count <= max_threads; count *= 2) {
+    thread_counts.push_back(count);
+  }
+  if (thread_counts.back() != max_threads) thread_counts.push_back(max_threads);
+
+  char name[32];
+  for (auto threads : thread_counts) {
+    Program parallel;
+    Labels parallel_labels;
+    seconds = Best([&]() {
+      parallel.clear();
+      Assembler assembler(parallel);
+      assembler.FeedParallel(source, threads);
+      assembler.Finish();
+      parallel_labels = assembler.GetLabels();
+    });
+    snprintf(name, sizeof(name), "%zu threads", threads);
+    report(name, seconds, parallel == prog && parallel_labels == labels);
+  }
+
+  remove(path);
+  return fine ? 0 : 1;
+}
@@ -0,0 +1,698 @@
+#include "assembler.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <charconv>
+#include <algorithm>
+#include <bit>
+#include <atomic>
+#include <thread>
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// read size when the file cannot be mapped
+constexpr size_t kAsmChunkSize = size_t(1) << 20;
+
+#define INIT_INSTSTR
+constexpr string_view kInstNames[] = {
+#include "instruction.h"
+};
+#undef INIT_INSTSTR
+
+constexpr size_t kInstCount = std::size(kInstNames);
+constexpr uint8_t kNoInst = 0xFF;
+static_assert(kInstCount < kNoInst);
+
+// At least n^2/8 slots, so a random seed is collision free with a
+// chance of about e^-4 and the search below ends quickly.
+constexpr size_t kMnemonicSlots = std::bit_ceil(kInstCount * kInstCount / 8);
+constexpr int kMnemonicBits = std::countr_zero(kMnemonicSlots);
+
+// FNV-1a with the seed as offset basis. Without the final mix nearby
+// seeds move every slot by about the same distance.
+constexpr size_t HashMnemonic(string_view str, uint64_t seed) {
+  uint64_t hash = seed;
+  for (char c : str) {
+    hash = (hash ^ uint8_t(c)) * 0x100000001B3;
+  }
+
+  hash = (hash ^ (hash >> 32)) * 0xD6E8FEB86659FD93;
+  return size_t(hash >> (64 - kMnemonicBits));
+}
+
+struct MnemonicTable {
+  uint64_t seed;
+  bool found;
+  uint8_t slots[kMnemonicSlots];
+};
+
+constexpr MnemonicTable MakeMnemonicTable() {
+  MnemonicTable table{};
+
+  for (uint64_t seed = 0xCBF29CE484222325; !table.found && seed < 0xCBF29CE484222325 + 0x1000; seed += 1) {
+    for (auto &slot : table.slots) {
+      slot = kNoInst;
+    }
+
+    table.seed = seed;
+    table.found = true;
+    for (size_t idx = 0; table.found && idx < kInstCount; idx += 1) {
+      auto &slot = table.slots[HashMnemonic(kInstNames[idx], seed)];
+      table.found = slot == kNoInst;
+      slot = uint8_t(idx);
+    }
+  }
+
+  return table;
+}
+
+constexpr auto kMnemonicTable = MakeMnemonicTable();
+static_assert(kMnemonicTable.found, "no perfect hash for the mnemonics, are there duplicates?");
+
+bool GetInst(uint32_t &dest, string_view str) {
+  auto idx = kMnemonicTable.slots[HashMnemonic(str, kMnemonicTable.seed)];
+  if (idx == kNoInst || kInstNames[idx] != str) {
+    return false;
+  }
+
+  dest = idx;
+  return true;
+}
+
+bool AsmLexer::NextLine(vector<string_view> &tokens, bool last) {
+  tokens.clear();
+
+  // TODO:comments
+  const char *token = nullptr;
+  for (auto pos = pos_; pos != end_; pos += 1) {
+    char c = *pos;
+
+    if (c == '\r' || c == '\n') {
+      if (token != nullptr) {
+        tokens.emplace_back(token, pos - token);
+      }
+      newlines_ += c == '\n';
+      pos_ = pos + 1;
+      return true;
+    }
+    else if (c == ' ' || c == '\t') {
+      if (token != nullptr) {
+        tokens.emplace_back(token, pos - token);
+        token = nullptr;
+      }
+    }
+    else if (token == nullptr) {
+      token = pos;
+    }
+  }
+
+  // no line break before the end
+  if (!last || pos_ == end_) {
+    tokens.clear();
+    return false;
+  }
+
+  if (token != nullptr) {
+    tokens.emplace_back(token, end_ - token);
+  }
+  pos_ = end_;
+  return true;
+}
+
+inline bool IsUnsignedInst(Inst inst) {
+  return inst == Inst::AddU
+    || inst == Inst::SubU
+    || inst == Inst::MulU
+    || inst == Inst::DivU
+    || inst == Inst::ModU
+    || inst == Inst::PushHalfWordImm
+    || inst == Inst::PushHalfWordImmSL16
+    || inst == Inst::Jump
+    || inst == Inst::Branch;
+}
+
+inline bool IsJumpInst(Inst inst) {
+  return inst == Inst::Jump
+    || inst == Inst::Branch
+    || inst == Inst::FarJump
+    || inst == Inst::FarBranch;
+}
+
+inline bool IsAlpha(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+inline bool IsNumber(char c) {
+  return (c >= '0' && c <= '9');
+}
+
+inline bool IsLabelString(string_view src) {
+  if (src.size() < 2) {
+    return false;
+  }
+
+  if (src[src.size() - 1] != ':') {
+    return false;
+  }
+
+  for (size_t i = 0; i < src.size() - 1; i += 1) {
+    if (!IsAlpha(src[i]) && !IsNumber(src[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int GetIntLiteralBase(string_view str) {
+  if (str.size() == 1) {
+    return 10;
+  }
+
+  auto prefix = str.substr(0, 2);
+
+  if (prefix[0] == '+' || prefix[0] == '-') {
+    return 10;
+  }
+
+  if (prefix == "0x" || prefix == "0X") {
+    return 16;
+  }
+
+  if (prefix == "0b" || prefix == "0B") {
+    return 2;
+  }
+
+  if (prefix[0] == '0') {
+    return 8;
+  }
+
+  return 10;
+}
+
+// Two's complement bits of an integer literal, like stoll/stoull with
+// the base from GetIntLiteralBase(). Signed literals have to fit int64_t,
+// unsigned ones wrap around when negated like stoull does.
+bool ParseIntLiteral(string_view str, uint64_t &dest, bool is_signed) {
+  int base = GetIntLiteralBase(str);
+  bool negative = false;
+
+  if (!str.empty() && (str[0] == '+' || str[0] == '-')) {
+    negative = str[0] == '-';
+    str.remove_prefix(1);
+  }
+  else if (base == 16 || base == 2) {
+    str.remove_prefix(2);
+  }
+
+  uint64_t value = 0;
+  auto end = str.data() + str.size();
+  auto [ptr, error] = std::from_chars(str.data(), end, value, base);
+  if (str.empty() || error != std::errc() || ptr != end) {
+    return false;
+  }
+
+  if (is_signed && value > (negative ? uint64_t(1) << 63 : uint64_t(INT64_MAX))) {
+    return false;
+  }
+
+  dest = negative ? 0 - value : value;
+  return true;
+}
+
+bool ParseFPLiteral(string_view str, double &dest) {
+  if (!str.empty() && str[0] == '+') {
+    str.remove_prefix(1);
+  }
+
+  auto end = str.data() + str.size();
+  auto [ptr, error] = std::from_chars(str.data(), end, dest);
+  return !str.empty() && error == std::errc() && ptr == end;
+}
+
+// pushimm/pushuimm/pushfp <literal>, the value is not known until
+// parsed so these expand to the shortest immediate sequence
+bool TryExpandMacro(vector<string_view> &assembly, Program &prog, bool &valid) {
+  if (assembly.size() < 2) {
+    return false;
+  }
+
+  bool result = true;
+  uint64_t value = 0;
+  double fp = 0;
+
+  if (assembly[0] == "pushimm") {
+    valid = ParseIntLiteral(assembly[1], value, true);
+    if (valid) EmitImmediate(prog, value, UnitType::Int);
+  }
+  else if (assembly[0] == "pushuimm") {
+    valid = ParseIntLiteral(assembly[1], value, false);
+    if (valid) EmitImmediate(prog, value, UnitType::UInt);
+  }
+  else if (assembly[0] == "pushfp") {
+    valid = ParseFPLiteral(assembly[1], fp);
+    if (valid) EmitImmediate(prog, std::bit_cast<uint64_t>(fp), UnitType::FP);
+  }
+  else {
+    result = false;
+  }
+
+  return result;
+}
+
+// Words of a jump to target, a far branch dups the condition first
+// since FarBranch pops it and Branch does not.
+// far: pushwi/pushdwi target; farjmp
+//      dup; pushwi/pushdwi target; farbranch
+size_t GetJumpLength(Inst inst, size_t target) {
+  if (target <= kMaxArgs) {
+    return 1;
+  }
+
+  size_t length = target <= UINT32_MAX ? 3 : 4;
+  return inst == Inst::Branch ? length + 1 : length;
+}
+
+void EmitJump(Program &prog, Inst inst, size_t target) {
+  if (target <= kMaxArgs) {
+    prog.push_back((Code(target) << 7) + Code(inst));
+    return;
+  }
+
+  if (inst == Inst::Branch) {
+    prog.push_back(Code(Inst::Dup));
+  }
+  EmitImmediate(prog, target, UnitType::UInt);
+  prog.push_back(Code(inst == Inst::Branch ? Inst::FarBranch : Inst::FarJump));
+}
+
+void Assembler::AssembleLine(vector<string_view> &assembly) {
+  if (assembly.empty()) {
+    return;
+  }
+
+  if (IsLabelString(assembly[0])) {
+    auto name = assembly[0].substr(0, assembly[0].size() - 1);
+    labels_.insert(Label(name, prog_.size()));
+    return;
+  }
+
+  bool valid = true;
+  if (TryExpandMacro(assembly, prog_, valid)) {
+    if (!valid) {
+      Fail("Invalid literal: %.*s", int(assembly[1].size()), assembly[1].data());
+    }
+    return;
+  }
+
+  uint32_t inst;
+  if (!GetInst(inst, assembly[0])) {
+    Fail("Invalid instruction: %.*s %zu", int(assembly[0].size()), assembly[0].data(),
+      assembly.size());
+    return;
+  }
+
+  // jmp/farjmp label and branch/farbranch label pick the encoding by
+  // distance, farjmp/farbranch alone take the target from the stack
+  if (IsJumpInst(static_cast<Inst>(inst))) {
+    bool is_jump = inst == uint32_t(Inst::Jump) || inst == uint32_t(Inst::FarJump);
+
+    if (assembly.size() >= 2) {
+      fixups_.push_back(AsmFixup{ prog_.size(), std::string(assembly[1]),
+        is_jump ? Inst::Jump : Inst::Branch, 0, 0, 1 });
+      prog_.push_back(0);
+    }
+    else if (inst == uint32_t(Inst::FarJump) || inst == uint32_t(Inst::FarBranch)) {
+      prog_.push_back(Code(inst));
+    }
+    else {
+      Fail("Missing label for %.*s", int(assembly[0].size()), assembly[0].data());
+    }
+    return;
+  }
+
+  // literal words are only generated by the push macros
+  if (GetInstLength(static_cast<Inst>(inst)) > 1) {
+    Fail("Use pushimm/pushuimm/pushfp instead of %.*s", int(assembly[0].size()),
+      assembly[0].data());
+    return;
+  }
+
+  //generate actual inst
+  uint32_t args = 0;
+  if (assembly.size() == 2) {
+    uint64_t value = 0;
+    bool is_unsigned = IsUnsignedInst(static_cast<Inst>(inst));
+
+    if (is_unsigned && (assembly[1][0] == '+' || assembly[1][0] == '-')) {
+      Fail("Invalid literal for unsigned instruction");
+      return;
+    }
+
+    if (!ParseIntLiteral(assembly[1], value, !is_unsigned)) {
+      Fail("Invalid literal: %.*s", int(assembly[1].size()), assembly[1].data());
+      return;
+    }
+
+    // signed arguments keep the low bits of their int32_t
+    args = is_unsigned ? uint32_t(value) : uint32_t(int32_t(int64_t(value)));
+  }
+
+  Code output = args << 7;
+  output += inst;
+  prog_.push_back(output);
+}
+
+string_view Assembler::AssembleLines(string_view chunk, bool last) {
+  AsmLexer lexer(chunk);
+
+  if (!track_lines_) {
+    while (fine_ && lexer.NextLine(tokens_, last)) {
+      AssembleLine(tokens_);
+    }
+  }
+  else {
+    while (fine_) {
+      size_t line = line_ + lexer.GetNewlines() + 1;
+      size_t pc = prog_.size();
+      if (!lexer.NextLine(tokens_, last)) break;
+      AssembleLine(tokens_);
+      if (prog_.size() != pc) {
+        lines_.emplace_back(pc, line);
+      }
+    }
+  }
+
+  line_ += lexer.GetNewlines();
+  return lexer.Rest();
+}
+
+bool Assembler::Feed(string_view chunk) {
+  if (!fine_) {
+    return false;
+  }
+
+  // complete the line left over from the previous chunk first
+  if (!carry_.empty()) {
+    auto brk = chunk.find_first_of("\r\n");
+    if (brk == string_view::npos) {
+      carry_.append(chunk);
+      return fine_;
+    }
+
+    carry_.append(chunk.substr(0, brk + 1));
+    chunk.remove_prefix(brk + 1);
+    AssembleLines(carry_, true);
+    carry_.clear();
+  }
+
+  auto rest = AssembleLines(chunk, false);
+  if (fine_) {
+    carry_.assign(rest);
+  }
+
+  return fine_;
+}
+
+// fixups in front of pc
+size_t CountFixupsBefore(const vector<AsmFixup> &fixups, size_t pc) {
+  auto it = std::lower_bound(fixups.begin(), fixups.end(), pc,
+    [](const AsmFixup &fixup, size_t value) { return fixup.pos < value; });
+  return size_t(it - fixups.begin());
+}
+
+void Assembler::ResolveFixups() {
+  for (auto &fixup : fixups_) {
+    auto it = labels_.find(fixup.label);
+    if (it == labels_.end()) {
+      Fail("Undefined label: %s", fixup.label.data());
+      return;
+    }
+
+    fixup.target = it->second;
+  }
+
+  // far jumps are at most 4 words longer, when even that keeps every pc
+  // in reach no jump grows
+  if (prog_.size() + 4 * fixups_.size() <= kMaxArgs) {
+    for (auto &fixup : fixups_) {
+      prog_[fixup.pos] = (Code(fixup.target) << 7) + Code(fixup.inst);
+    }
+
+    fixups_.clear();
+    return;
+  }
+
+  for (auto &fixup : fixups_) {
+    fixup.target_fixups = CountFixupsBefore(fixups_, fixup.target);
+  }
+
+  // growth[idx] is how many words the fixups in front of fixup idx
+  // added, a jump only grows when its target moved past kMaxArgs so
+  // this ends after a few rounds
+  vector<size_t> growth(fixups_.size() + 1, 0);
+  bool changed = !fixups_.empty();
+  while (changed) {
+    changed = false;
+    for (size_t idx = 0; idx < fixups_.size(); idx += 1) {
+      growth[idx + 1] = growth[idx] + fixups_[idx].length - 1;
+    }
+
+    for (auto &fixup : fixups_) {
+      auto length = GetJumpLength(fixup.inst, fixup.target + growth[fixup.target_fixups]);
+      if (length > fixup.length) {
+        fixup.length = length;
+        changed = true;
+      }
+    }
+  }
+
+  if (growth.back() == 0) {
+    for (auto &fixup : fixups_) {
+      prog_[fixup.pos] = (Code(fixup.target) << 7) + Code(fixup.inst);
+    }
+  }
+  else {
+    Program code;
+    code.reserve(prog_.size() + growth.back());
+    size_t from = 0;
+
+    for (auto &fixup : fixups_) {
+      code.insert(code.end(), prog_.begin() + from, prog_.begin() + fixup.pos);
+      EmitJump(code, fixup.inst, fixup.target + growth[fixup.target_fixups]);
+      from = fixup.pos + 1;
+    }
+    code.insert(code.end(), prog_.begin() + from, prog_.end());
+    prog_.swap(code);
+
+    for (auto &label : labels_) {
+      label.second += growth[CountFixupsBefore(fixups_, label.second)];
+    }
+    for (auto &line : lines_) {
+      line.first += growth[CountFixupsBefore(fixups_, line.first)];
+    }
+  }
+
+  fixups_.clear();
+}
+
+bool Assembler::FeedParallel(string_view chunk, size_t threads) {
+  // a few pieces per thread, so one slow piece does not hold up the rest
+  size_t piece_size = std::max(kAsmChunkSize, chunk.size() / (std::max<size_t>(threads, 1) * 4));
+  if (threads <= 1 || chunk.size() <= piece_size || !fine_) {
+    return Feed(chunk);
+  }
+
+  // the pieces have to start on a line of their own
+  if (!carry_.empty()) {
+    auto brk = chunk.find_first_of("\r\n");
+    if (brk == string_view::npos) {
+      return Feed(chunk);
+    }
+
+    Feed(chunk.substr(0, brk + 1));
+    chunk.remove_prefix(brk + 1);
+  }
+
+  // each piece ends right after a line break, except maybe the last
+  vector<string_view> pieces;
+  while (!chunk.empty()) {
+    size_t length = chunk.size();
+    if (length > piece_size) {
+      auto brk = chunk.find_first_of("\r\n", piece_size - 1);
+      length = brk == string_view::npos ? length : brk + 1;
+    }
+
+    pieces.push_back(chunk.substr(0, length));
+    chunk.remove_prefix(length);
+  }
+
+  vector<Program> codes(pieces.size());
+  vector<Assembler> fragments;
+  fragments.reserve(pieces.size());
+  for (auto &code : codes) {
+    fragments.emplace_back(code, track_lines_);
+  }
+
+  std::atomic<size_t> next(0);
+  auto work = [&pieces, &fragments, &next]() {
+    for (size_t idx = next.fetch_add(1); idx < pieces.size(); idx = next.fetch_add(1)) {
+      fragments[idx].Feed(pieces[idx]);
+    }
+  };
+
+  vector<std::thread> pool;
+  for (size_t idx = 1; idx < std::min(threads, pieces.size()); idx += 1) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+
+  for (auto &fragment : fragments) {
+    Append(fragment);
+  }
+
+  return fine_;
+}
+
+void Assembler::Append(Assembler &fragment) {
+  if (!fine_) {
+    return;
+  }
+
+  if (!fragment.fine_) {
+    fine_ = false;
+    error_ = std::move(fragment.error_);
+    return;
+  }
+
+  size_t base = prog_.size();
+  prog_.insert(prog_.end(), fragment.prog_.begin(), fragment.prog_.end());
+
+  // a label defined in both keeps our pc, like insert() does
+  for (auto &label : fragment.labels_) {
+    label.second += base;
+  }
+  labels_.merge(fragment.labels_);
+
+  for (auto &fixup : fragment.fixups_) {
+    fixup.pos += base;
+    fixups_.push_back(std::move(fixup));
+  }
+
+  for (auto &line : fragment.lines_) {
+    lines_.emplace_back(line.first + base, line.second + line_);
+  }
+  line_ += fragment.line_;
+
+  carry_ = std::move(fragment.carry_);
+}
+
+void Assembler::Fail(const char *format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  error_ = buffer;
+  fine_ = false;
+}
+
+bool Assembler::Finish() {
+  if (fine_ && !carry_.empty()) {
+    AssembleLines(carry_, true);
+    carry_.clear();
+  }
+
+  if (fine_) {
+    ResolveFixups();
+  }
+
+  return fine_;
+}
+
+bool AssembleFile(const char *path, Program &prog, Labels &labels, size_t threads,
+  AsmLines *lines) {
+  bool result = true;
+  Assembler assembler(prog, lines != nullptr);
+  bool done = false;
+
+#ifdef __unix__
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    puts("Invalid assembly file");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == 0) {
+    size_t size = size_t(info.st_size);
+    void *mapping = size != 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+    if (size == 0) {
+      done = true;
+    }
+    else if (mapping != MAP_FAILED) {
+      // read once front to back, or all at once by the threads
+      madvise(mapping, size, threads > 1 ? MADV_WILLNEED : MADV_SEQUENTIAL);
+      assembler.FeedParallel(string_view(static_cast<const char *>(mapping), size), threads);
+      munmap(mapping, size);
+      done = true;
+    }
+  }
+
+  close(fd);
+#endif
+
+  if (!done) {
+    auto fp = fopen(path, "rb");
+    if (fp == nullptr) {
+      puts("Invalid assembly file");
+      return false;
+    }
+
+    vector<char> buffer;
+    size_t length;
+    if (threads > 1) {
+      // the threads cut their pieces from one buffer
+      fseek(fp, 0, SEEK_END);
+      long file_size = ftell(fp);
+      fseek(fp, 0, SEEK_SET);
+
+      buffer.resize(file_size > 0 ? size_t(file_size) : 0);
+      length = fread(buffer.data(), 1, buffer.size(), fp);
+      assembler.FeedParallel(string_view(buffer.data(), length), threads);
+    }
+    else {
+      buffer.resize(kAsmChunkSize);
+      while (assembler.IsFine() && (length = fread(buffer.data(), 1, buffer.size(), fp)) != 0) {
+        assembler.Feed(string_view(buffer.data(), length));
+      }
+    }
+
+    if (ferror(fp)) {
+      puts("Stream error occurred while reading file");
+      result = false;
+    }
+
+    fclose(fp);
+  }
+
+  if (!assembler.Finish()) {
+    puts(assembler.GetError().data());
+    result = false;
+  }
+
+  labels = assembler.GetLabels();
+  if (lines != nullptr) {
+    *lines = assembler.GetLines();
+  }
+  return result;
+}
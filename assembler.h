@@ -0,0 +1,121 @@
+#pragma once
+#include "machine.h"
+#include <string_view>
+#include <functional>
+
+using std::string_view;
+
+// Canvas assembly (.csrc) to Program.
+// One instruction, macro or label per line, tokens separated by spaces
+// and tabs. The source is lexed in place: tokens are string_views into
+// the mapped file or the chunk being assembled, nothing is copied per
+// token or per line.
+
+// label names are looked up by string_view
+struct LabelHash {
+  using is_transparent = void;
+  size_t operator()(string_view str) const { return std::hash<string_view>()(str); }
+};
+
+using Label = pair<std::string, size_t>;
+using Labels = std::unordered_map<std::string, size_t, LabelHash, std::equal_to<>>;
+// first pc of every source line that emitted code and its line number,
+// sorted by pc
+using AsmLines = vector<pair<size_t, size_t>>;
+
+// Mnemonic to opcode through a perfect hash built at compile time from
+// the DEF_INST table, false for anything that is not a mnemonic.
+bool GetInst(uint32_t &dest, string_view str);
+
+// Splits a chunk into lines of tokens.
+class AsmLexer {
+  protected:
+  const char *pos_;
+  const char *end_;
+  size_t newlines_;
+
+  public:
+  AsmLexer(string_view chunk) :
+    pos_(chunk.data()), end_(chunk.data() + chunk.size()), newlines_(0) {}
+
+  // Tokens of the next line, empty for a blank one. A last line without
+  // line break counts only if last is set, otherwise it is left over for
+  // Rest(). false once there is no line left.
+  bool NextLine(vector<string_view> &tokens, bool last = true);
+  // what NextLine() has not consumed yet
+  string_view Rest() const { return string_view(pos_, end_ - pos_); }
+  // '\n' consumed so far, "\r\n" counts as one source line
+  size_t GetNewlines() const { return newlines_; }
+};
+
+// A jump to a label, emitted as a one word placeholder and patched by
+// Finish() once every label is known.
+struct AsmFixup {
+  size_t pos; //of the placeholder in prog
+  std::string label;
+  Inst inst; //Jump or Branch
+  // filled in by Finish()
+  size_t target; //pc of the label before relaxation
+  size_t target_fixups; //fixups in front of the label
+  size_t length; //words of the encoding
+};
+
+// Feed() the source in chunks of any size, then Finish().
+// FeedParallel() assembles a large chunk on several threads: it is cut
+// at line breaks into pieces, each piece goes to an assembler of its own
+// and the fragments are appended in order, so labels, code and the
+// first error come out as if fed on one thread.
+// Labels name the pc of the next emitted word. Jumps may refer to labels
+// further down, they are resolved after the pass: every jump starts out
+// as a single Jump/Branch word and grows into the FarJump/FarBranch
+// sequence while its target does not fit the 25 bit argument, until no
+// more jumps have to grow.
+// After the first error the rest is ignored, GetError() tells what it
+// was.
+class Assembler {
+  protected:
+  Program &prog_;
+  Labels labels_;
+  vector<AsmFixup> fixups_;
+  bool fine_;
+  std::string error_;
+  vector<string_view> tokens_;
+  // a line split over two chunks
+  std::string carry_;
+  // source lines, only filled with track_lines
+  bool track_lines_;
+  AsmLines lines_;
+  size_t line_; //newlines fed so far
+
+  void AssembleLine(vector<string_view> &tokens);
+  // returns what is left after the last complete line
+  string_view AssembleLines(string_view chunk, bool last);
+  void ResolveFixups();
+  void Fail(const char *format, ...);
+  // takes over a fragment fed with the lines right after ours
+  void Append(Assembler &fragment);
+
+  public:
+  Assembler(Program &prog, bool track_lines = false) :
+    prog_(prog), fine_(true), track_lines_(track_lines), line_(0) {}
+
+  // assembles every complete line, keeps an unfinished last line
+  bool Feed(string_view chunk);
+  // same for a large chunk, on up to threads threads
+  bool FeedParallel(string_view chunk, size_t threads);
+  // the line left over from the last chunk, if any, then the jumps
+  bool Finish();
+
+  bool IsFine() const { return fine_; }
+  const std::string &GetError() const { return error_; }
+  // final pcs once Finish() succeeded
+  const Labels &GetLabels() const { return labels_; }
+  const AsmLines &GetLines() const { return lines_; }
+};
+
+// Assembles a whole file, mapped on unix, read in large chunks
+// elsewhere. More than one thread is used for large files only.
+// Prints the reason and returns false on failure. Source lines are only
+// tracked when lines is given.
+bool AssembleFile(const char *path, Program &prog, Labels &labels, size_t threads = 1,
+  AsmLines *lines = nullptr);
@@ -0,0 +1,276 @@
+#include "bytecode.h"
+#include <cstdio>
+#include <cstring>
+#include <bit>
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(BytecodeHeader) == 72, "on-disk header layout");
+static_assert(sizeof(BytecodeConstant) == 16, "on-disk constant layout");
+
+constexpr uint64_t kFnvOffset = 0xcbf29ce484222325ull;
+constexpr uint64_t kFnvPrime = 0x100000001b3ull;
+
+inline uint64_t Fnv1a(uint64_t hash, const void *data, size_t size) {
+  auto bytes = static_cast<const uint8_t *>(data);
+  for (size_t idx = 0; idx < size; idx += 1) {
+    hash = (hash ^ bytes[idx]) * kFnvPrime;
+  }
+
+  return hash;
+}
+
+inline BytecodeEndian GetNativeEndian() {
+  return std::endian::native == std::endian::little ?
+    BytecodeEndian::Little : BytecodeEndian::Big;
+}
+
+inline uint64_t AlignUp(uint64_t value, uint64_t align) {
+  return (value + align - 1) / align * align;
+}
+
+uint32_t GetIsaFingerprint() {
+  uint64_t hash = kFnvOffset;
+  for (auto str : kInstStrings) {
+    // terminator included so "ab" "c" differs from "a" "bc"
+    hash = Fnv1a(hash, str, strlen(str) + 1);
+  }
+
+  return uint32_t(hash ^ (hash >> 32));
+}
+
+bool WriteBytecodeFile(const char *path, ProgramView prog, const BytecodeSections &sections) {
+  bool result = true;
+
+  // everything after the header, code included
+  vector<uint8_t> body;
+  auto append = [&body](const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    body.insert(body.end(), bytes, bytes + size);
+  };
+
+  BytecodeHeader header{};
+  header.magic = kBytecodeMagic;
+  header.version = kBytecodeVersion;
+  header.endian = GetNativeEndian();
+  header.code_size = sizeof(Code);
+  header.isa = GetIsaFingerprint();
+
+  header.const_offset = sizeof(BytecodeHeader);
+  header.const_count = sections.constants.size();
+  for (auto &unit : sections.constants) {
+    BytecodeConstant constant{ UINTVAL(unit), uint32_t(unit.type), 0 };
+    append(&constant, sizeof(constant));
+  }
+
+  header.symbol_offset = sizeof(BytecodeHeader) + body.size();
+  header.symbol_count = sections.symbols.size();
+  for (auto &symbol : sections.symbols) {
+    uint32_t name_size = uint32_t(symbol.name.size());
+    append(&symbol.value, sizeof(symbol.value));
+    append(&name_size, sizeof(name_size));
+    append(symbol.name.data(), name_size);
+    body.resize(AlignUp(body.size(), 8), 0);
+  }
+
+  header.code_offset = AlignUp(sizeof(BytecodeHeader) + body.size(), kBytecodeAlign);
+  header.code_length = prog.size();
+  body.resize(header.code_offset - sizeof(BytecodeHeader), 0);
+  append(prog.data(), prog.size_bytes());
+
+  header.checksum = Fnv1a(kFnvOffset, body.data(), body.size());
+
+  auto fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    puts("Cannot open output file");
+    return false;
+  }
+
+  fwrite(&header, sizeof(header), 1, fp);
+  fwrite(body.data(), 1, body.size(), fp);
+  if (ferror(fp)) {
+    puts("Error occurred while writing bytecodes");
+    result = false;
+  }
+
+  fclose(fp);
+
+  return result;
+}
+
+bool BytecodeFile::ReadContainer(const uint8_t *data, size_t size, bool checksum) {
+#define REJECT(_reason)                                 \
+  {                                                     \
+    printf("Invalid bytecode file: %s\n", _reason);     \
+    return false;                                       \
+  }
+
+  if (size < sizeof(BytecodeHeader)) REJECT("too short for a header");
+
+  BytecodeHeader header;
+  memcpy(&header, data, sizeof(header));
+
+  if (header.magic != kBytecodeMagic) {
+    REJECT("not a Canvas container, compile it again");
+  }
+  if (header.endian != GetNativeEndian()) REJECT("byte order differs from this machine");
+  if (header.version != kBytecodeVersion) REJECT("unsupported version");
+  if (header.code_size != sizeof(Code)) REJECT("unsupported code size");
+  if (header.isa != GetIsaFingerprint()) {
+    REJECT("written for another instruction table");
+  }
+
+  // sections must lie inside the file, in order and without overflow
+  if (header.code_offset % kBytecodeAlign != 0
+    || header.code_offset > size
+    || header.code_length > (size - header.code_offset) / sizeof(Code)) {
+    REJECT("code section out of range");
+  }
+  if (header.const_offset < sizeof(BytecodeHeader)
+    || header.const_offset > header.code_offset
+    || header.const_count > (header.code_offset - header.const_offset) / sizeof(BytecodeConstant)) {
+    REJECT("constant section out of range");
+  }
+  if (header.symbol_offset < header.const_offset
+    || header.symbol_offset > header.code_offset) {
+    REJECT("symbol section out of range");
+  }
+
+  if (checksum) {
+    size_t file_end = header.code_offset + header.code_length * sizeof(Code);
+    auto hash = Fnv1a(kFnvOffset, data + sizeof(BytecodeHeader),
+      file_end - sizeof(BytecodeHeader));
+    if (hash != header.checksum) REJECT("checksum mismatch");
+  }
+
+  auto constants = data + header.const_offset;
+  for (uint64_t idx = 0; idx < header.const_count; idx += 1) {
+    BytecodeConstant constant;
+    memcpy(&constant, constants + idx * sizeof(constant), sizeof(constant));
+    Unit unit;
+    UINTVAL(unit) = constant.value;
+    unit.type = static_cast<UnitType>(constant.type);
+    sections_.constants.push_back(unit);
+  }
+
+  size_t offset = header.symbol_offset;
+  for (uint64_t idx = 0; idx < header.symbol_count; idx += 1) {
+    BytecodeSymbol symbol;
+    uint32_t name_size;
+    if (header.code_offset - offset < sizeof(symbol.value) + sizeof(name_size)) {
+      REJECT("symbol section out of range");
+    }
+
+    memcpy(&symbol.value, data + offset, sizeof(symbol.value));
+    memcpy(&name_size, data + offset + sizeof(symbol.value), sizeof(name_size));
+    offset += sizeof(symbol.value) + sizeof(name_size);
+    if (header.code_offset - offset < name_size) REJECT("symbol section out of range");
+
+    symbol.name.assign(reinterpret_cast<const char *>(data + offset), name_size);
+    offset = AlignUp(offset + name_size, 8);
+    sections_.symbols.push_back(std::move(symbol));
+  }
+#undef REJECT
+
+  view_ = ProgramView(reinterpret_cast<const Code *>(data + header.code_offset),
+    header.code_length);
+
+  return true;
+}
+
+bool BytecodeFile::Open(const char *path, bool raw, bool checksum) {
+  bool result = true;
+
+  Close();
+
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+
+#ifdef __unix__
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    puts("Invalid bytecode file");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    puts("Error while read file");
+    close(fd);
+    return false;
+  }
+
+  size = size_t(info.st_size);
+  if (size != 0) {
+    mapping_ = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mapping_ == MAP_FAILED) {
+      mapping_ = nullptr;
+    }
+    else {
+      // pages come in as the machine touches them
+      mapping_size_ = size;
+      data = static_cast<const uint8_t *>(mapping_);
+    }
+  }
+
+  close(fd);
+#endif
+
+  if (data == nullptr) {
+    auto fp = fopen(path, "rb");
+    if (fp == nullptr) {
+      puts("Invalid bytecode file");
+      return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buffer_.resize(file_size > 0 ? size_t(file_size) : 0);
+    if (fread(buffer_.data(), 1, buffer_.size(), fp) != buffer_.size()) {
+      puts("Error while read file");
+      buffer_.clear();
+      result = false;
+    }
+
+    fclose(fp);
+    data = buffer_.data();
+    size = buffer_.size();
+  }
+
+  if (!result) {
+    return result;
+  }
+
+  if (raw) {
+    view_ = ProgramView(reinterpret_cast<const Code *>(data), size / sizeof(Code));
+  }
+  else {
+    result = ReadContainer(data, size, checksum);
+  }
+
+  if (!result) {
+    Close();
+  }
+
+  return result;
+}
+
+void BytecodeFile::Close() {
+#ifdef __unix__
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+#endif
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  buffer_.clear();
+  view_ = ProgramView();
+  sections_ = BytecodeSections();
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "machine.h"
+#include <string>
+
+// Canvas bytecode container (.bc), version 1.
+// |--header--|--constants--|--symbols--|--pad--|--code--|
+// - header: BytecodeHeader
+// - constants: const_count BytecodeConstant entries
+// - symbols: symbol_count entries of uint64 value, uint32 name size,
+//   name bytes, zero padded to 8 bytes
+// - code: code_length words, starting on a kBytecodeAlign boundary so
+//   the mapped file can be executed in place
+// Integers are stored in the byte order named by the endian tag.
+// checksum is 64-bit FNV-1a over every byte after the header.
+
+constexpr uint32_t kBytecodeMagic = 0x53564E43; //"CNVS" on disk
+constexpr uint16_t kBytecodeVersion = 1;
+constexpr uint64_t kBytecodeAlign = 0x1000;
+
+enum class BytecodeEndian : uint8_t {
+  Little = 1,
+  Big = 2
+};
+
+struct BytecodeHeader {
+  uint32_t magic;
+  uint16_t version;
+  BytecodeEndian endian;
+  uint8_t code_size; //sizeof(Code)
+  uint32_t isa; //GetIsaFingerprint() of the writer
+  uint32_t reserved;
+  uint64_t code_offset; //bytes from file start
+  uint64_t code_length; //in Code words
+  uint64_t const_offset;
+  uint64_t const_count;
+  uint64_t symbol_offset;
+  uint64_t symbol_count;
+  uint64_t checksum;
+};
+
+struct BytecodeConstant {
+  uint64_t value;
+  uint32_t type; //UnitType
+  uint32_t reserved;
+};
+
+struct BytecodeSymbol {
+  std::string name;
+  uint64_t value; //word offset for labels
+};
+
+// Everything besides the code.
+struct BytecodeSections {
+  vector<Unit> constants;
+  vector<BytecodeSymbol> symbols;
+};
+
+// Opcode numbers depend on the generated superinstruction.h, so files
+// only run on builds with the same instruction table.
+uint32_t GetIsaFingerprint();
+
+// Prints the reason and returns false on failure.
+bool WriteBytecodeFile(const char *path, ProgramView prog, const BytecodeSections &sections);
+
+// Read-only view of a compiled .bc file.
+// On unix the file is mapped and the machine executes straight from the
+// mapping, elsewhere it is read in with a single fread.
+// Containers from another build, byte order or version, and damaged
+// ones, are rejected before anything runs. The checksum reads every
+// page of the file, so loading takes time in proportion to its size.
+// Without checksum only the header and the section bounds are checked
+// and pages are only read in when the machine reaches them.
+// raw accepts a headerless
+// stream of words, trailing bytes that do not form a whole Code are
+// ignored. Such a stream carries no fingerprint, so nothing can tell
+// which instruction table wrote it: it only runs as intended on this
+// exact build, anything else executes as whatever its words decode to.
+class BytecodeFile {
+  protected:
+  void *mapping_;
+  size_t mapping_size_;
+  vector<uint8_t> buffer_; //fallback copy when mapping is unavailable
+  ProgramView view_;
+  BytecodeSections sections_;
+
+  bool ReadContainer(const uint8_t *data, size_t size, bool checksum);
+
+  public:
+  BytecodeFile() : mapping_(nullptr), mapping_size_(0) {}
+  ~BytecodeFile() { Close(); }
+  BytecodeFile(const BytecodeFile &) = delete;
+  BytecodeFile &operator=(const BytecodeFile &) = delete;
+
+  // prints the reason and returns false on failure
+  bool Open(const char *path, bool raw = false, bool checksum = true);
+  void Close();
+
+  ProgramView View() const { return view_; }
+  const BytecodeSections &Sections() const { return sections_; }
+};
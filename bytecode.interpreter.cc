@@ -1,43 +1,47 @@
 #include "machine.h"
+#include "bytecode.h"
 #include <cstdio>
 #include <cstring>
 
-using std::FILE;
-using std::fopen;
-using std::fread;
-using std::feof;
-using std::ferror;
-
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  if (argc < 2) {
     puts("Provide a valid bytecode binary file!");
     return 0;
   }
 
-  Program prog;
-  auto fp = fopen(argv[1], "rb");
-  Code code;
-  bool fine = true;
-
-  if (fp != nullptr) {
-    while (!feof(fp) && !ferror(fp)) {
-      if (ferror(fp)) {
-        puts("Error while read file");
-        fine = false;
-        break;
-      }
-
-      fread(&code, sizeof(Code), 1, fp);
-      prog.push_back(code);
+  MachineOptions options;
+  bool raw = false;
+  bool checksum = true;
+  for (int idx = 2; idx < argc; idx += 1) {
+    if (ParseMachineOption(options, argv[idx])) {
+      continue;
+    }
+
+    // headerless stream of words written by this same build, unchecked
+    if (strcmp(argv[idx], "--raw") == 0) {
+      raw = true;
+      continue;
+    }
+
+    // start without reading the whole file, see BytecodeFile
+    if (strcmp(argv[idx], "--no-verify-checksum") == 0) {
+      checksum = false;
+      continue;
     }
+
+    printf("Invalid option: %s\n", argv[idx]);
+    return 0;
   }
 
-  if (fine && !prog.empty()) {
-    Machine machine;
-    machine.Run(prog);
-  } 
+  BytecodeFile file;
 
-  fclose(fp);
+  if (file.Open(argv[1], raw, checksum) && !file.View().empty()) {
+    Machine machine(options);
+    RunWithOptions(machine, file.View(), options);
+    if (options.gc_stats) {
+      PrintHeapStats(stderr, machine.GetHeap().GetStats());
+    }
+  }
 
   return 0;
 }
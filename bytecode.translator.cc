@@ -0,0 +1,67 @@
+#include "machine.h"
+#include "translator.h"
+#include "bytecode.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using std::FILE;
+using std::fopen;
+using std::string;
+
+// Translate a .bc file into <file>.cc, see translator.h.
+// usage: bc2c <file.bc> [--raw] [--no-verify-checksum] [machine options]
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    puts("Provide a valid bytecode binary file!");
+    return 0;
+  }
+
+  MachineOptions options;
+  bool raw = false;
+  bool checksum = true;
+  for (int idx = 2; idx < argc; idx += 1) {
+    if (ParseMachineOption(options, argv[idx])) {
+      continue;
+    }
+
+    // headerless stream of words written by this same build, unchecked
+    if (strcmp(argv[idx], "--raw") == 0) {
+      raw = true;
+      continue;
+    }
+
+    // start without reading the whole file, see BytecodeFile
+    if (strcmp(argv[idx], "--no-verify-checksum") == 0) {
+      checksum = false;
+      continue;
+    }
+
+    printf("Invalid option: %s\n", argv[idx]);
+    return 0;
+  }
+
+  BytecodeFile file;
+  if (!file.Open(argv[1], raw, checksum)) {
+    return 0;
+  }
+
+  string out(argv[1]);
+  out.append(".cc");
+  auto fp = fopen(out.data(), "w");
+
+  if (fp != nullptr) {
+    auto report = TranslateProgram(fp, file.View(), options, argv[1]);
+    fclose(fp);
+
+    if (!report.fine) {
+      printf("Cannot translate %s at %zu\n", report.error, report.bad_target);
+      remove(out.data());
+    }
+  }
+  else {
+    puts("Cannot open output file");
+  }
+
+  return 0;
+}
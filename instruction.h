@@ -3,6 +3,9 @@
 // SL - Shift left
 // AH - Assemble Highpart
 // F - Float
+// Define DEF_INST(_id, _str) yourself before including to generate other tables.
+// Superinstructions come last, define DEF_SUPER_INST2/DEF_SUPER_INST3 to
+// see their components, otherwise they expand to DEF_INST.
 
 #ifdef INIT_INSTID
 #define DEF_INST(_id, _str) _id,
@@ -76,4 +79,39 @@ DEF_INST(DupN, "dupn")
 
 DEF_INST(Doze, "doze")
 
+// Everything below was added after the original table. New opcodes are
+// appended, never inserted above, so word streams written by older
+// builds keep their numbering.
+
+// Load a literal from the words that follow in a single dispatch.
+// args is the UnitType of the pushed value.
+// PushWordImm sign-extends Int literals and zero-extends the others.
+// PushDoubleWordImm takes the low word first.
+DEF_INST(PushWordImm, "pushwi")
+DEF_INST(PushDoubleWordImm, "pushdwi")
+
+// Garbage-collected objects of n units, see Heap.
+// New: count -> ptr, the units start as Int 0
+// Load: ptr, index -> unit
+// Store: ptr, index, unit -> (nothing)
+DEF_INST(New, "new")
+DEF_INST(Load, "load")
+DEF_INST(Store, "store")
+
+#ifndef DEF_SUPER_INST2
+#define DEF_SUPER_INST2(_id, _str, _a, _b) DEF_INST(_id, _str)
+#endif
+#ifndef DEF_SUPER_INST3
+#define DEF_SUPER_INST3(_id, _str, _a, _b, _c) DEF_INST(_id, _str)
+#endif
+
+// CANVAS_SUPERINST_TABLE names another table, see make-test.sh
+#ifdef CANVAS_SUPERINST_TABLE
+#include CANVAS_SUPERINST_TABLE
+#else
+#include "superinstruction.h"
+#endif
+
+#undef DEF_SUPER_INST2
+#undef DEF_SUPER_INST3
 #undef DEF_INST
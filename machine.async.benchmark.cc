@@ -0,0 +1,121 @@
+#include "machine.async.h"
+#include "memory-pool.h"
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+// Thousands of RunAsync() tasks interleaved on a QueueExecutor.
+// Every task is a countdown with a Doze per iteration, so it suspends
+// kOuterCount times. With one thread, the time over running the same
+// programs back to back is the cost of the suspend/resume round trips.
+
+constexpr size_t kTaskCount = 4096;
+constexpr uint32_t kOuterCount = 64;
+constexpr uint32_t kInnerCount = 100;
+
+inline Code Encode(Inst inst, uint32_t args = 0) {
+  return (args << 7) + Code(inst);
+}
+
+// pushhwi outer
+// loop: pushhwi inner; inner: pushhwi 1; subu; branch inner; pop; doze
+//       pushhwi 1; subu; branch loop
+Program MakeTask() {
+  Program prog;
+  prog.push_back(Encode(Inst::PushHalfWordImm, kOuterCount));
+  prog.push_back(Encode(Inst::PushHalfWordImm, kInnerCount));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  prog.push_back(Encode(Inst::SubU));
+  prog.push_back(Encode(Inst::Branch, 2));
+  prog.push_back(Encode(Inst::Pop));
+  prog.push_back(Encode(Inst::Doze));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  prog.push_back(Encode(Inst::SubU));
+  prog.push_back(Encode(Inst::Branch, 1));
+  return prog;
+}
+
+// usage: bench-async [max threads], one per hardware thread by default
+int main(int argc, char **argv) {
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (argc > 1) {
+    max_threads = std::max(1, atoi(argv[1]));
+  }
+
+  auto prog = MakeTask();
+  PoolMemoryInterface memory;
+
+  // one machine, Doze does nothing in Run()
+  auto begin = steady_clock::now();
+  {
+    Machine machine(MachineOptions(), &memory);
+    for (size_t idx = 0; idx < kTaskCount; idx += 1) {
+      machine.Run(prog);
+    }
+  }
+  duration<double> serial = steady_clock::now() - begin;
+  printf("%-10s %8.3f s\n", "serial", serial.count());
+
+  vector<size_t> thread_counts;
+  for (size_t count = 1; count <= max_threads; count *= 2) {
+    thread_counts.push_back(count);
+  }
+  if (thread_counts.back() != max_threads) thread_counts.push_back(max_threads);
+
+  bool fine = true;
+  for (auto threads : thread_counts) {
+    QueueExecutor executor;
+    vector<std::unique_ptr<Machine>> machines;
+    vector<RunTask> tasks;
+    for (size_t idx = 0; idx < kTaskCount; idx += 1) {
+      machines.push_back(std::make_unique<Machine>(MachineOptions(), &memory));
+      tasks.push_back(machines.back()->RunAsync(prog, executor));
+    }
+
+    auto all_done = [&tasks]() {
+      for (auto &task : tasks) {
+        if (!task.Done()) return false;
+      }
+      return true;
+    };
+
+    begin = steady_clock::now();
+    for (auto &task : tasks) {
+      task.Spawn(executor);
+    }
+    vector<std::thread> pool;
+    for (size_t idx = 0; idx < threads; idx += 1) {
+      pool.emplace_back([&executor, &all_done]() {
+        while (executor.RunAll() != 0 || !all_done()) {}
+      });
+    }
+    for (auto &thread : pool) {
+      thread.join();
+    }
+    duration<double> elapsed = steady_clock::now() - begin;
+
+    bool checked = true;
+    for (size_t idx = 0; idx < kTaskCount; idx += 1) {
+      auto &stack = machines[idx]->GetStack();
+      checked = checked && tasks[idx].GetStatus() == RunStatus::Finished
+        && stack.Depth() == 1 && UINTVAL(stack.Base()[0]) == 0;
+    }
+
+    printf("%2zu threads %8.3f s %5.2fx", threads, elapsed.count(),
+      serial.count() / elapsed.count());
+    // the round trip cost, once nothing runs in parallel
+    if (threads == 1) {
+      double suspensions = double(kTaskCount) * kOuterCount;
+      printf(" %8.1f ns per suspension", (elapsed.count() - serial.count()) * 1e9 / suspensions);
+    }
+    printf("%s\n", checked ? "" : " MISMATCH");
+    fine = fine && checked;
+  }
+
+  return fine ? 0 : 1;
+}
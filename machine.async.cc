@@ -0,0 +1,44 @@
+#include "machine.async.h"
+
+void QueueExecutor::Post(std::coroutine_handle<> handle) {
+  std::lock_guard<std::mutex> guard(lock_);
+  queue_.push_back(handle);
+}
+
+bool QueueExecutor::RunOne() {
+  std::coroutine_handle<> handle;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (queue_.empty()) return false;
+    handle = queue_.front();
+    queue_.pop_front();
+  }
+
+  // may post itself again
+  handle.resume();
+  return true;
+}
+
+size_t QueueExecutor::RunAll() {
+  size_t count = 0;
+  while (RunOne()) {
+    count += 1;
+  }
+
+  return count;
+}
+
+size_t QueueExecutor::Size() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return queue_.size();
+}
+
+RunTask Machine::RunAsync(ProgramView prog, Executor &executor, uint64_t slice) {
+  auto status = Start(prog, {}, slice);
+  while (status == RunStatus::Yielded || status == RunStatus::Exhausted) {
+    co_await executor.Schedule();
+    status = Resume(slice);
+  }
+
+  co_return status;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "machine.h"
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+
+// Coroutine interface for interleaving many programs on a few threads.
+// Machine::RunAsync() returns a RunTask which does nothing until it is
+// awaited or spawned. From then on it runs the program one slice at a
+// time: at every Doze and every used-up slice of budget it posts itself
+// to the executor and suspends, and the executor resumes it whenever it
+// gets to it. When the program is done the awaiting coroutine, if any,
+// resumes with the RunStatus.
+// Each task needs a machine of its own, alive until the task is done.
+
+class Executor;
+
+struct ScheduleAwaiter {
+  Executor &executor;
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle);
+  void await_resume() const noexcept {}
+};
+
+// Where suspended tasks wait. Post() may be called from any thread and
+// has to resume the handle once, later, on any thread the executor
+// likes.
+class Executor {
+  public:
+  virtual ~Executor() {}
+  virtual void Post(std::coroutine_handle<> handle) = 0;
+
+  // co_await executor.Schedule() carries on from the executor
+  ScheduleAwaiter Schedule() { return ScheduleAwaiter{ *this }; }
+};
+
+inline void ScheduleAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  executor.Post(handle);
+}
+
+// FIFO executor driven by the threads calling RunOne()/RunAll(), e.g.
+// from an event loop.
+class QueueExecutor : public Executor {
+  protected:
+  std::mutex lock_;
+  std::deque<std::coroutine_handle<>> queue_;
+
+  public:
+  void Post(std::coroutine_handle<> handle) override;
+  // resume the oldest handle, false if there was none
+  bool RunOne();
+  // until the queue is empty, returns how many were resumed
+  size_t RunAll();
+  size_t Size();
+};
+
+class RunTask {
+  public:
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  // resumes whoever awaits the task, or nobody for a spawned one
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+      auto &promise = handle.promise();
+      auto continuation = promise.continuation;
+      promise.finished.store(true, std::memory_order_release);
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+
+  struct promise_type {
+    RunStatus status = RunStatus::Error;
+    std::coroutine_handle<> continuation;
+    std::atomic<bool> finished{ false };
+
+    RunTask get_return_object() { return RunTask(Handle::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_value(RunStatus value) { status = value; }
+    // machines report errors through RunStatus and never throw
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  protected:
+  Handle handle_;
+
+  explicit RunTask(Handle handle) : handle_(handle) {}
+
+  public:
+  RunTask() : handle_(nullptr) {}
+  RunTask(RunTask &&other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+  RunTask &operator=(RunTask &&other) noexcept {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = other.handle_;
+      other.handle_ = nullptr;
+    }
+    return *this;
+  }
+  RunTask(const RunTask &) = delete;
+  RunTask &operator=(const RunTask &) = delete;
+  // A task must not be destroyed while it is queued on an executor.
+  ~RunTask() {
+    if (handle_) handle_.destroy();
+  }
+
+  // co_await task runs it from the awaiting coroutine on
+  bool await_ready() const noexcept { return Done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle_.promise().continuation = awaiting;
+    return handle_;
+  }
+  RunStatus await_resume() const noexcept { return handle_.promise().status; }
+
+  // Runs the task from the executor without anyone awaiting it, poll
+  // Done() to see it finish. Awaiting or spawning happens once.
+  void Spawn(Executor &executor) { executor.Post(handle_); }
+
+  // safe from any thread
+  bool Done() const {
+    return handle_ && handle_.promise().finished.load(std::memory_order_acquire);
+  }
+  // once Done()
+  RunStatus GetStatus() const { return handle_.promise().status; }
+};
@@ -0,0 +1,395 @@
+#include "machine.h"
+#include "optimizer.h"
+#include "memory-pool.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <bit>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+// Canvas VM microbenchmarks.
+// Programs are generated here so the dynamic instruction count is known.
+
+constexpr uint32_t kLoopCount = 10000000;
+
+inline Code Encode(Inst inst, uint32_t args = 0) {
+  return (args << 7) + Code(inst);
+}
+
+struct Kernel {
+  const char *name;
+  Program prog;
+  uint64_t executed;
+};
+
+// pushhwi N; loop: pushhwi 1; subu; branch loop
+Kernel MakeCountdownKernel() {
+  Kernel kernel{ "countdown", {}, 0 };
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, kLoopCount));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  kernel.prog.push_back(Encode(Inst::SubU));
+  kernel.prog.push_back(Encode(Inst::Branch, 1));
+  kernel.executed = 1 + 3ull * kLoopCount;
+  return kernel;
+}
+
+// counter on the bottom, a short unsigned chain in the loop body.
+Kernel MakeArithKernel() {
+  Kernel kernel{ "arith", {}, 0 };
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, kLoopCount));
+  kernel.prog.push_back(Encode(Inst::Dup));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 3));
+  kernel.prog.push_back(Encode(Inst::MulU));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 7));
+  kernel.prog.push_back(Encode(Inst::AddU));
+  kernel.prog.push_back(Encode(Inst::Pop));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  kernel.prog.push_back(Encode(Inst::SubU));
+  kernel.prog.push_back(Encode(Inst::Branch, 1));
+  kernel.executed = 1 + 9ull * kLoopCount;
+  return kernel;
+}
+
+// the 9-word pushfp expansion, dropped right away
+Kernel MakeConstChainKernel() {
+  Kernel kernel{ "constchain", {}, 0 };
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, kLoopCount));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImmSL16, 0x4000));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 0x1234));
+  kernel.prog.push_back(Encode(Inst::AddU));
+  kernel.prog.push_back(Encode(Inst::ShiftLeftImm, 32));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImmSL16, 0x5678));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 0x9abc));
+  kernel.prog.push_back(Encode(Inst::AddU));
+  kernel.prog.push_back(Encode(Inst::AddU));
+  kernel.prog.push_back(Encode(Inst::SpawnFP));
+  kernel.prog.push_back(Encode(Inst::Pop));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  kernel.prog.push_back(Encode(Inst::SubU));
+  kernel.prog.push_back(Encode(Inst::Branch, 1));
+  kernel.executed = 1 + 13ull * kLoopCount;
+  return kernel;
+}
+
+// same literal as constchain through a single PushDoubleWordImm
+Kernel MakeWideConstKernel() {
+  Kernel kernel{ "wideconst", {}, 0 };
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, kLoopCount));
+  kernel.prog.push_back(Encode(Inst::PushDoubleWordImm, Code(UnitType::FP)));
+  kernel.prog.push_back(0x56789abc);
+  kernel.prog.push_back(0x40001234);
+  kernel.prog.push_back(Encode(Inst::Pop));
+  kernel.prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  kernel.prog.push_back(Encode(Inst::SubU));
+  kernel.prog.push_back(Encode(Inst::Branch, 1));
+  kernel.executed = 1 + 5ull * kLoopCount;
+  return kernel;
+}
+
+// Touches every stencil family of the jit once per iteration, the
+// final stack is compared across modes.
+Kernel MakeMixedKernel() {
+  Kernel kernel{ "mixed", {}, 0 };
+  auto &prog = kernel.prog;
+  uint64_t body = 0;
+  auto emit = [&](Inst inst, uint32_t args = 0) {
+    prog.push_back(Encode(inst, args));
+    body += 1;
+  };
+  auto emit_imm = [&](uint64_t value, UnitType type) {
+    EmitImmediate(prog, value, type);
+    body += 1;
+  };
+
+  prog.push_back(Encode(Inst::PushHalfWordImm, kLoopCount / 4));
+  size_t loop = prog.size();
+  emit_imm(std::bit_cast<uint64_t>(2.5), UnitType::FP);
+  emit_imm(std::bit_cast<uint64_t>(1.25), UnitType::FP);
+  emit(Inst::MulF);
+  emit_imm(std::bit_cast<uint64_t>(0.5), UnitType::FP);
+  emit(Inst::DivF);
+  emit_imm(std::bit_cast<uint64_t>(0.75), UnitType::FP);
+  emit(Inst::SubF);
+  emit(Inst::Pop);
+  emit_imm(uint64_t(-7), UnitType::Int);
+  emit(Inst::PushHalfWordImm, 3);
+  emit(Inst::Mul);
+  emit(Inst::PushHalfWordImm, 4);
+  emit(Inst::Mod);
+  emit(Inst::ArithShiftRightImm, 1);
+  emit(Inst::PushHalfWordImm, 5);
+  emit(Inst::RotateLeft);
+  emit(Inst::RotateRightImm, 3);
+  emit(Inst::Not);
+  emit(Inst::LogicNot);
+  emit(Inst::PushHalfWordImm, 6);
+  emit(Inst::SwapTop);
+  emit(Inst::DivU);
+  emit(Inst::DupN, 2);
+  emit(Inst::XOr);
+  emit(Inst::Or);
+  emit(Inst::PushHalfWordImm, 2);
+  emit(Inst::ShiftLeft);
+  emit(Inst::PushHalfWordImm, 3);
+  emit(Inst::LogicShiftRight);
+  emit(Inst::PushHalfWordImmSL16, 1);
+  emit(Inst::AddSL32);
+  emit(Inst::LogicShiftRightImm, 40);
+  emit(Inst::PushHalfWordImm, 0);
+  emit(Inst::LogicOr);
+  emit(Inst::PushHalfWordImm, 9);
+  emit(Inst::LogicAnd);
+  emit(Inst::SpawnSignedInt);
+  emit(Inst::Pop);
+  // far jump over a Doze
+  emit(Inst::PushHalfWordImm, uint32_t(prog.size() + 3));
+  emit(Inst::FarJump);
+  prog.push_back(Encode(Inst::Doze));
+  emit(Inst::PushHalfWordImm, 1);
+  emit(Inst::SubU);
+  emit(Inst::Dup);
+  emit(Inst::PushHalfWordImm, uint32_t(loop));
+  emit(Inst::FarBranch);
+  kernel.executed = 1 + body * (kLoopCount / 4);
+  return kernel;
+}
+
+// holder object on the stack, every iteration replaces its only unit
+// with a fresh object, so nearly everything New makes is garbage.
+Kernel MakeHeapKernel() {
+  Kernel kernel{ "heap", {}, 0 };
+  auto &prog = kernel.prog;
+  prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  prog.push_back(Encode(Inst::New));
+  prog.push_back(Encode(Inst::PushHalfWordImm, kLoopCount / 10));
+  size_t loop = prog.size();
+  prog.push_back(Encode(Inst::SwapTop));
+  prog.push_back(Encode(Inst::Dup));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 0));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 6));
+  prog.push_back(Encode(Inst::New));
+  prog.push_back(Encode(Inst::Store));
+  prog.push_back(Encode(Inst::SwapTop));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  prog.push_back(Encode(Inst::SubU));
+  prog.push_back(Encode(Inst::Branch, uint32_t(loop)));
+  // drop the holder, its address differs between runs
+  prog.push_back(Encode(Inst::SwapTop));
+  prog.push_back(Encode(Inst::Pop));
+  kernel.executed = 5 + 10ull * (kLoopCount / 10);
+  return kernel;
+}
+
+struct Mode {
+  const char *name;
+  DispatchMode dispatch;
+  bool cache_top;
+  int opt_level;
+  bool verify = true; //off keeps the emptiness/stack checks of unverified code
+  bool typed = true; //off keeps tagged units in verified code
+};
+
+#ifdef CANVAS_PROFILE_PAIRS
+const char *pair_profile = nullptr;
+#endif
+
+// Final stack of the first mode of a kernel, later modes must match it.
+vector<Unit> reference;
+bool mismatch = false;
+
+bool SameUnits(const Unit *units, size_t count) {
+  if (count != reference.size()) return false;
+  for (size_t idx = 0; idx < count; idx += 1) {
+    if (units[idx].type != reference[idx].type 
+      || UINTVAL(units[idx]) != UINTVAL(reference[idx])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Measure(Kernel &kernel, Mode &mode, bool first) {
+  MachineOptions options;
+  options.dispatch = mode.dispatch;
+  options.cache_top = mode.cache_top;
+  options.verify = mode.verify;
+  options.typed = mode.typed;
+  Machine machine(options);
+  // ns/inst stays relative to the unoptimized instruction count
+  Program prog = kernel.prog;
+  OptimizeProgram(prog, mode.opt_level);
+  auto begin = steady_clock::now();
+  machine.Run(prog);
+  duration<double> elapsed = steady_clock::now() - begin;
+  double seconds = elapsed.count();
+
+  printf("%-10s %-16s %8.2f Minst/s %6.2f ns/inst", kernel.name, mode.name,
+    kernel.executed / seconds / 1e6, seconds * 1e9 / kernel.executed);
+#ifdef CANVAS_STACK_TRAFFIC
+  printf(" %6.2f stack bytes/inst", 
+    double(machine.GetStackTraffic()) / kernel.executed);
+#endif
+  auto &heap_stats = machine.GetHeap().GetStats();
+  if (heap_stats.collections != 0) {
+    printf(" %4zu gc, pause max %.1f us avg %.1f us", heap_stats.collections,
+      heap_stats.max_pause_us, heap_stats.total_pause_us / heap_stats.collections);
+  }
+
+  auto &stack = machine.GetStack();
+  if (first) {
+    reference.assign(stack.Base(), stack.Top());
+  }
+  else if (!SameUnits(stack.Base(), stack.Depth())) {
+    printf("  MISMATCH");
+    mismatch = true;
+  }
+  printf("\n");
+
+#ifdef CANVAS_PROFILE_PAIRS
+  if (pair_profile != nullptr) {
+    auto fp = fopen(pair_profile, "a");
+    if (fp != nullptr) {
+      machine.DumpPairProfile(fp);
+      fclose(fp);
+    }
+  }
+#endif
+}
+
+// Many short programs, each on a fresh Machine, so the cost is mostly
+// setting up and tearing down the operand stack.
+constexpr size_t kChurnPrograms = 20000;
+constexpr size_t kChurnBatch = 1000; //programs between Collect() calls
+
+struct ChurnCase {
+  const char *name;
+  bool verify; //verified programs get a stack of their exact depth
+};
+
+void MeasureChurn(const ChurnCase &churn, const char *memory_name, 
+  MemoryInterface *memory) {
+  // pushhwi 16; loop: pushhwi 1; subu; branch loop
+  Program prog = { 
+    Encode(Inst::PushHalfWordImm, 16), Encode(Inst::PushHalfWordImm, 1),
+    Encode(Inst::SubU), Encode(Inst::Branch, 1)
+  };
+  MachineOptions options;
+  options.dispatch = DispatchMode::Switch;
+  options.stack_check = StackCheck::Explicit;
+  options.verify = churn.verify;
+
+  auto begin = steady_clock::now();
+  for (size_t idx = 0; idx < kChurnPrograms; idx += 1) {
+    {
+      Machine machine(options, memory);
+      machine.Run(prog);
+    }
+    if ((idx + 1) % kChurnBatch == 0) memory->Collect();
+  }
+  duration<double> elapsed = steady_clock::now() - begin;
+
+  auto stats = memory->GetStats();
+  printf("%-10s %-16s %8.2f us/prog  peak %zu bytes, %zu allocs\n", 
+    churn.name, memory_name, elapsed.count() * 1e6 / kChurnPrograms,
+    stats.bytes_peak, stats.alloc_count);
+}
+
+// PrintStackTop of a UInt counter and an FP literal per iteration, the
+// sinks write to /dev/null. printf is the same lines written by
+// fprintf without the machine, what every print used to cost.
+constexpr uint32_t kPrintCount = 1000000;
+
+void MeasurePrint() {
+  Program prog;
+  prog.push_back(Encode(Inst::PushHalfWordImm, kPrintCount / 2));
+  prog.push_back(Encode(Inst::PrintStackTop));
+  EmitImmediate(prog, std::bit_cast<uint64_t>(65542.123), UnitType::FP);
+  prog.push_back(Encode(Inst::PrintStackTop));
+  prog.push_back(Encode(Inst::Pop));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  prog.push_back(Encode(Inst::SubU));
+  prog.push_back(Encode(Inst::Branch, 1));
+
+  auto null_fp = fopen("/dev/null", "w");
+  if (null_fp == nullptr) return;
+
+  auto begin = steady_clock::now();
+  for (uint64_t idx = kPrintCount / 2; idx != 0; idx -= 1) {
+    fprintf(null_fp, "%s: %llu\n", "UInt", (unsigned long long)idx);
+    fprintf(null_fp, "%s: %f\n", "FP", 65542.123);
+  }
+  duration<double> elapsed = steady_clock::now() - begin;
+  printf("%-10s %-16s %8.2f ns/print\n", "print", "printf", elapsed.count() * 1e9 / kPrintCount);
+
+  const pair<const char *, OutputMode> sinks[] = {
+    { "text", OutputMode::Text }, { "binary", OutputMode::Binary },
+    { "discard", OutputMode::Discard }
+  };
+  for (auto &sink : sinks) {
+    OutputSink output(null_fp, sink.second);
+    Machine machine;
+    machine.SetOutput(&output);
+    begin = steady_clock::now();
+    machine.Run(prog);
+    elapsed = steady_clock::now() - begin;
+    printf("%-10s %-16s %8.2f ns/print%s\n", "print", sink.first,
+      elapsed.count() * 1e9 / kPrintCount, output.GetCount() == kPrintCount ? "" : "  MISMATCH");
+    mismatch = mismatch || output.GetCount() != kPrintCount;
+  }
+
+  fclose(null_fp);
+}
+
+// argc/argv only carry --pair-profile= in CANVAS_PROFILE_PAIRS builds
+int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
+#ifdef CANVAS_PROFILE_PAIRS
+  if (argc > 1 && strncmp(argv[1], "--pair-profile=", 15) == 0) {
+    pair_profile = argv[1] + 15;
+  }
+#endif
+
+  vector<Kernel> kernels = { 
+    MakeCountdownKernel(), MakeArithKernel(), MakeConstChainKernel(),
+    MakeWideConstKernel(), MakeMixedKernel(), MakeHeapKernel()
+  };
+  vector<Mode> modes = {
+    { "switch", DispatchMode::Switch, false, 0 },
+    { "switch+tos", DispatchMode::Switch, true, 0 },
+#ifdef CANVAS_THREADED_DISPATCH
+    { "threaded", DispatchMode::Threaded, false, 0 },
+    { "threaded+tos", DispatchMode::Threaded, true, 0 },
+    { "threaded+tos-unv", DispatchMode::Threaded, true, 0, false },
+    { "threaded+tos-tag", DispatchMode::Threaded, true, 0, true, false },
+    { "threaded+tos-O3", DispatchMode::Threaded, true, 3 },
+    { "register", DispatchMode::Register, false, 0 },
+    { "register-O3", DispatchMode::Register, false, 3 },
+#endif
+#ifdef CANVAS_JIT
+    { "jit", DispatchMode::Jit, false, 0 },
+    { "jit-O3", DispatchMode::Jit, false, 3 },
+#endif
+  };
+
+  for (auto &kernel : kernels) {
+    for (auto &mode : modes) {
+      Measure(kernel, mode, &mode == &modes.front());
+    }
+  }
+
+  MeasurePrint();
+
+  vector<ChurnCase> churns = { { "churn-vrf", true }, { "churn-unv", false } };
+  for (auto &churn : churns) {
+    SimpleMemoryInterface simple;
+    ArenaMemoryInterface arena;
+    PoolMemoryInterface pool;
+    MeasureChurn(churn, "simple", &simple);
+    MeasureChurn(churn, "arena", &arena);
+    MeasureChurn(churn, "pool", &pool);
+  }
+
+  return mismatch ? 1 : 0;
+}
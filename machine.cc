@@ -1,319 +1,927 @@
 #include "machine.h"
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
 #include <bit>
+#include <type_traits>
+#ifdef __unix__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
-// useful macros
-#define GET_INST(_code) static_cast<uint8_t>(_code % uint64_t(0x80))
-#define GET_ARGS(_code) static_cast<uint32_t>(_code >> 7)
-#define HAS_ARGS(_code) ((_code >> 7) != 0x0)
+#include "machine.handler.h"
+#include "machine.register.h"
+#include "verifier.h"
 
-#define POP_VALUE_TO(_tmp) \
-  _tmp = stack_.top();     \
-  stack_.pop();
+// CANVAS_PROFILE_PAIRS records opcode pairs/triples for bin/supergen.
+#ifdef CANVAS_PROFILE_PAIRS
+#define PROFILE_PAIR(_inst) RecordPair(pc, _inst);
+#else
+#define PROFILE_PAIR(_inst)
+#endif
 
-bool Machine::Run(Program &prog) {
+// Profiled engine variants only, the others compile to nothing here.
+#define PROFILE_STEP(_inst) \
+  if constexpr (kConfig.profile) { profile_->Step(pc, _inst); }
+
+// Budgeted runs only pay at backward jumps, by the words jumped over,
+// so every loop iteration is charged and straight-line code is bounded
+// by the program size anyway. The jump is taken before stopping.
+#define CHARGE_JUMP(_target)                    \
+  if ((_target) <= pc) {                        \
+    fuel -= int64_t(pc - (_target) + 1);        \
+    if (fuel < 0) {                             \
+      pc = (_target);                           \
+      goto L_Exhausted;                         \
+    }                                           \
+  }
+
+// Push a literal with as few dispatches as possible.
+void EmitImmediate(Program &prog, uint64_t value, UnitType type) {
+  auto signed_value = static_cast<int64_t>(value);
+
+  if (type == UnitType::UInt && value <= kMaxArgs) {
+    prog.push_back((Code(value) << 7) + Code(Inst::PushHalfWordImm));
+  }
+  else if ((type == UnitType::UInt && value <= UINT32_MAX)
+    || (type == UnitType::Int && signed_value >= INT32_MIN && signed_value <= INT32_MAX)) {
+    prog.push_back((Code(type) << 7) + Code(Inst::PushWordImm));
+    prog.push_back(Code(value & UINT32_MAX));
+  }
+  else {
+    prog.push_back((Code(type) << 7) + Code(Inst::PushDoubleWordImm));
+    prog.push_back(Code(value & UINT32_MAX));
+    prog.push_back(Code(value >> 32));
+  }
+}
+
+bool ParseMachineOption(MachineOptions &dest, const char *str) {
   bool result = true;
 
-  //reset state
+#define IS_OPTION(_str) (strncmp(str, _str, sizeof(_str) - 1) == 0)
+#define OPTION_VALUE(_str) (str + sizeof(_str) - 1)
+  if (IS_OPTION("--dispatch=")) {
+    auto value = OPTION_VALUE("--dispatch=");
+    if (strcmp(value, "switch") == 0) {
+      dest.dispatch = DispatchMode::Switch;
+    }
+    else if (strcmp(value, "threaded") == 0) {
+      dest.dispatch = DispatchMode::Threaded;
+    }
+    else if (strcmp(value, "jit") == 0) {
+      dest.dispatch = DispatchMode::Jit;
+    }
+    else if (strcmp(value, "register") == 0) {
+      dest.dispatch = DispatchMode::Register;
+    }
+    else {
+      result = false;
+    }
+  }
+  else if (IS_OPTION("--stack-check=")) {
+    auto value = OPTION_VALUE("--stack-check=");
+    if (strcmp(value, "none") == 0) {
+      dest.stack_check = StackCheck::None;
+    }
+    else if (strcmp(value, "explicit") == 0) {
+      dest.stack_check = StackCheck::Explicit;
+    }
+    else if (strcmp(value, "guard") == 0) {
+      dest.stack_check = StackCheck::GuardPage;
+    }
+    else {
+      result = false;
+    }
+  }
+  else if (IS_OPTION("--cache-top=")) {
+    auto value = OPTION_VALUE("--cache-top=");
+    if (strcmp(value, "on") == 0) {
+      dest.cache_top = true;
+    }
+    else if (strcmp(value, "off") == 0) {
+      dest.cache_top = false;
+    }
+    else {
+      result = false;
+    }
+  }
+  else if (IS_OPTION("--verify=")) {
+    auto value = OPTION_VALUE("--verify=");
+    if (strcmp(value, "on") == 0) {
+      dest.verify = true;
+    }
+    else if (strcmp(value, "off") == 0) {
+      dest.verify = false;
+    }
+    else {
+      result = false;
+    }
+  }
+  else if (IS_OPTION("--typed=")) {
+    auto value = OPTION_VALUE("--typed=");
+    if (strcmp(value, "on") == 0) {
+      dest.typed = true;
+    }
+    else if (strcmp(value, "off") == 0) {
+      dest.typed = false;
+    }
+    else {
+      result = false;
+    }
+  }
+  else if (IS_OPTION("--stack=")) {
+    char *end = nullptr;
+    auto value = strtoull(OPTION_VALUE("--stack="), &end, 10);
+    if (*end != '\0' || value == 0) {
+      result = false;
+    }
+    else {
+      dest.stack_capacity = value;
+    }
+  }
+  else if (IS_OPTION("--heap=")) {
+    char *end = nullptr;
+    auto value = strtoull(OPTION_VALUE("--heap="), &end, 10);
+    if (*end != '\0' || value == 0) {
+      result = false;
+    }
+    else {
+      dest.heap_threshold = value;
+    }
+  }
+  else if (IS_OPTION("--budget=")) {
+    char *end = nullptr;
+    auto value = strtoull(OPTION_VALUE("--budget="), &end, 10);
+    if (*end != '\0') {
+      result = false;
+    }
+    else {
+      dest.budget = value;
+    }
+  }
+  else if (IS_OPTION("--output=")) {
+    auto value = OPTION_VALUE("--output=");
+    if (strcmp(value, "text") == 0) {
+      dest.output = OutputMode::Text;
+    }
+    else if (strcmp(value, "binary") == 0) {
+      dest.output = OutputMode::Binary;
+    }
+    else if (strcmp(value, "discard") == 0) {
+      dest.output = OutputMode::Discard;
+    }
+    else {
+      result = false;
+    }
+  }
+  else if (IS_OPTION("--gc-stats=")) {
+    auto value = OPTION_VALUE("--gc-stats=");
+    if (strcmp(value, "on") == 0) {
+      dest.gc_stats = true;
+    }
+    else if (strcmp(value, "off") == 0) {
+      dest.gc_stats = false;
+    }
+    else {
+      result = false;
+    }
+  }
+  else {
+    result = false;
+  }
+#undef IS_OPTION
+#undef OPTION_VALUE
+
+  return result;
+}
+
+MemoryInterface *GetDefaultMemory() {
+  static SimpleMemoryInterface memory;
+  return &memory;
+}
+
+OperandStack::OperandStack(size_t capacity, bool guarded, MemoryInterface *memory) :
+  memory_(memory), base_(nullptr), limit_(nullptr), top_(nullptr), 
+  mapping_(nullptr), mapping_size_(0), guarded_(guarded) {
+  Allocate(capacity, guarded);
+}
+
+OperandStack::~OperandStack() {
+  Release();
+}
+
+void OperandStack::Reset(size_t capacity, bool guarded) {
+  if (capacity != Capacity() || guarded != guarded_) {
+    Release();
+    Allocate(capacity, guarded);
+  }
+
+  Clear();
+}
+
+void OperandStack::Allocate(size_t capacity, bool guarded) {
+  guarded_ = guarded;
+#ifdef __unix__
+  if (guarded) {
+    // |--guard--|--------units--------|--guard--|
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t units_size = ((capacity + 1) * sizeof(Unit) + page - 1) / page * page;
+    mapping_size_ = units_size + 2 * page;
+    mapping_ = mmap(nullptr, mapping_size_, PROT_NONE, 
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mapping_ != MAP_FAILED) {
+      auto units = static_cast<char *>(mapping_) + page;
+      mprotect(units, units_size, PROT_READ | PROT_WRITE);
+      // place the top end of the buffer right below the upper guard
+      limit_ = reinterpret_cast<Unit *>(units + units_size);
+      base_ = limit_ - capacity;
+    }
+    else {
+      mapping_ = nullptr;
+      mapping_size_ = 0;
+    }
+  }
+#endif
+
+  if (base_ == nullptr) {
+    // one extra unit below base for the floor slot
+    base_ = static_cast<Unit *>(memory_->AllocRaw(capacity + 1, sizeof(Unit))) + 1;
+    limit_ = base_ + capacity;
+  }
+
+  top_ = base_;
+}
+
+void OperandStack::Release() {
+#ifdef __unix__
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+  else
+#endif
+  if (base_ != nullptr) {
+    memory_->Delete(base_ - 1);
+  }
+
+  base_ = limit_ = top_ = nullptr;
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+}
+
+#ifdef CANVAS_PROFILE_PAIRS
+void Machine::RecordPair(uint64_t pc, uint8_t inst) {
+  if (pc != pair_next_pc_) {
+    pair_history_size_ = 0;
+  }
+
+  if (pair_history_size_ >= 1) {
+    pair_counts_[pair_history_[1] * 0x80 + inst] += 1;
+  }
+
+  if (pair_history_size_ >= 2) {
+    auto key = (uint32_t(pair_history_[0]) << 14) 
+      | (uint32_t(pair_history_[1]) << 7) | inst;
+    triple_counts_[key] += 1;
+  }
+
+  pair_history_[0] = pair_history_[1];
+  pair_history_[1] = inst;
+  pair_history_size_ = pair_history_size_ < 2 ? pair_history_size_ + 1 : 2;
+  pair_next_pc_ = pc + GetInstLength(static_cast<Inst>(inst));
+}
+
+void Machine::DumpPairProfile(FILE *fp) {
+  auto name = [](size_t inst) {
+    return inst < kInstStrings.size() ? kInstStrings[inst] : "?";
+  };
+
+  for (size_t idx = 0; idx < pair_counts_.size(); idx += 1) {
+    if (pair_counts_[idx] != 0) {
+      fprintf(fp, "%llu %s %s\n", (unsigned long long)pair_counts_[idx],
+        name(idx / 0x80), name(idx % 0x80));
+    }
+  }
+
+  for (auto &triple : triple_counts_) {
+    fprintf(fp, "%llu %s %s %s\n", (unsigned long long)triple.second,
+      name(triple.first >> 14), name((triple.first >> 7) % 0x80),
+      name(triple.first % 0x80));
+  }
+}
+#endif
+
+#ifdef CANVAS_PROFILE
+constexpr size_t kProfileHotSpots = 20;
+
+void Machine::EnableProfile(bool enable) {
+  if (!enable) {
+    profile_.reset();
+  }
+  else if (!profile_) {
+    profile_ = std::make_unique<ExecutionProfile>();
+  }
+}
+
+void Machine::DumpProfile(FILE *fp, const ProfileSource &source) {
+  if (!profile_) {
+    return;
+  }
+
+  auto &sites = profile_->GetSites();
+  auto size = std::min(sites.size(), prog_.size());
+  auto name = [](size_t inst) {
+    return inst < kInstStrings.size() ? kInstStrings[inst] : "?";
+  };
+  // mean sample times count, 0 without samples
+  auto estimate = [](uint64_t count, uint64_t samples, uint64_t ticks) {
+    return samples != 0 ? double(ticks) / double(samples) * double(count) : 0.0;
+  };
+  auto percent = [](double part, double total) {
+    return total > 0 ? part * 100 / total : 0.0;
+  };
+
+  // "<line> <label>+<offset>" of a pc
+  auto locate = [&source](uint64_t pc, char *dest, size_t dest_size) {
+    auto by_pc = [](uint64_t value, const auto &entry) { return value < entry.first; };
+    auto line = std::upper_bound(source.lines.begin(), source.lines.end(), pc, by_pc);
+    auto label = std::upper_bound(source.labels.begin(), source.labels.end(), pc, by_pc);
+    char line_str[24] = "-";
+    if (line != source.lines.begin()) {
+      snprintf(line_str, sizeof(line_str), "%llu", (unsigned long long)std::prev(line)->second);
+    }
+    if (label == source.labels.begin()) {
+      snprintf(dest, dest_size, "%6s  %-16s", line_str, "-");
+    }
+    else if (std::prev(label)->first == pc) {
+      snprintf(dest, dest_size, "%6s  %-16.16s", line_str, std::prev(label)->second.data());
+    }
+    else {
+      char label_str[64];
+      snprintf(label_str, sizeof(label_str), "%.40s+%llu", std::prev(label)->second.data(),
+        (unsigned long long)(pc - std::prev(label)->first));
+      snprintf(dest, dest_size, "%6s  %-16.16s", line_str, label_str);
+    }
+  };
+
+  // estimated ticks of the pcs of an opcode
+  struct OpcodeTotal {
+    uint64_t count;
+    double ticks;
+  };
+  vector<OpcodeTotal> opcodes(0x80, OpcodeTotal{ 0, 0 });
+  uint64_t total = 0;
+  uint64_t samples = 0;
+  double estimated = 0;
+  for (size_t pc = 0; pc < size; pc += 1) {
+    auto &site = sites[pc];
+    auto &opcode = opcodes[GET_INST(prog_[pc])];
+    auto ticks = estimate(site.count, site.samples, site.ticks);
+    opcode.count += site.count;
+    opcode.ticks += ticks;
+    total += site.count;
+    samples += site.samples;
+    estimated += ticks;
+  }
+
+  fprintf(fp, "Profile of %s: %llu instructions, %llu samples, ~%.0f %s\n",
+    source.path != nullptr ? source.path : "program", (unsigned long long)total,
+    (unsigned long long)samples, estimated, kProfileTickUnit);
+
+  vector<size_t> order;
+  for (size_t inst = 0; inst < opcodes.size(); inst += 1) {
+    if (opcodes[inst].count != 0) order.push_back(inst);
+  }
+  std::sort(order.begin(), order.end(), [&opcodes](size_t lhs, size_t rhs) {
+    return opcodes[lhs].count > opcodes[rhs].count;
+  });
+
+  fprintf(fp, "\n%-20s %14s %8s %12s %8s\n", "opcode", "count", "%", "ticks/inst", "est. %");
+  for (auto inst : order) {
+    auto &opcode = opcodes[inst];
+    fprintf(fp, "%-20s %14llu %7.2f%% %12.2f %7.2f%%\n", name(inst),
+      (unsigned long long)opcode.count, percent(double(opcode.count), double(total)),
+      opcode.ticks / double(opcode.count), percent(opcode.ticks, estimated));
+  }
+
+  // by estimated time, by count when nothing was sampled
+  order.clear();
+  for (size_t pc = 0; pc < size; pc += 1) {
+    if (sites[pc].count != 0) order.push_back(pc);
+  }
+  auto hot = [&sites, &estimate](size_t pc) {
+    return estimate(sites[pc].count, sites[pc].samples, sites[pc].ticks);
+  };
+  std::stable_sort(order.begin(), order.end(), [&sites, &hot](size_t lhs, size_t rhs) {
+    auto lhs_hot = hot(lhs), rhs_hot = hot(rhs);
+    return lhs_hot != rhs_hot ? lhs_hot > rhs_hot : sites[lhs].count > sites[rhs].count;
+  });
+
+  char location[64];
+  fprintf(fp, "\n%8s %6s  %-16s %-20s %14s %8s %12s %8s\n", "pc", "line", "label", "opcode",
+    "count", "%", "ticks/exec", "est. %");
+  for (size_t idx = 0; idx < order.size() && idx < kProfileHotSpots; idx += 1) {
+    auto pc = order[idx];
+    auto &site = sites[pc];
+    locate(pc, location, sizeof(location));
+    fprintf(fp, "%8llu %s %-20s %14llu %7.2f%% %12.2f %7.2f%%\n", (unsigned long long)pc,
+      location, name(GET_INST(prog_[pc])), (unsigned long long)site.count,
+      percent(double(site.count), double(total)),
+      site.samples != 0 ? double(site.ticks) / double(site.samples) : 0.0,
+      percent(hot(pc), estimated));
+  }
+
+  order.clear();
+  for (size_t pc = 0; pc < size; pc += 1) {
+    auto inst = GET_INST(prog_[pc]);
+    if (sites[pc].count != 0 && inst < std::size(kBranchInsts) && kBranchInsts[inst]) {
+      order.push_back(pc);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(), [&sites](size_t lhs, size_t rhs) {
+    return sites[lhs].count > sites[rhs].count;
+  });
+
+  if (!order.empty()) {
+    fprintf(fp, "\n%8s %6s  %-16s %-20s %14s %14s %14s\n", "pc", "line", "label", "branch",
+      "count", "taken", "not taken");
+  }
+  for (size_t idx = 0; idx < order.size() && idx < kProfileHotSpots; idx += 1) {
+    auto pc = order[idx];
+    auto &site = sites[pc];
+    locate(pc, location, sizeof(location));
+    fprintf(fp, "%8llu %s %-20s %14llu %14llu %14llu\n", (unsigned long long)pc, location,
+      name(GET_INST(prog_[pc])), (unsigned long long)site.count,
+      (unsigned long long)site.taken, (unsigned long long)(site.count - site.taken));
+  }
+}
+#endif
+
+// Converts a budget to fuel, kNoBudget never runs out in practice.
+inline int64_t GetFuel(uint64_t budget) {
+  return budget > uint64_t(INT64_MAX) ? INT64_MAX : int64_t(budget);
+}
+
+bool Machine::Run(ProgramView prog) {
+  yielding_ = false;
+  fuel_ = INT64_MAX;
+  return Enter(prog, {}) == RunStatus::Finished;
+}
+
+RunStatus Machine::Start(ProgramView prog, std::span<const Unit> input, uint64_t budget) {
+  yielding_ = true;
+  fuel_ = GetFuel(budget);
+  return Enter(prog, input);
+}
+
+RunStatus Machine::Resume() {
+  if (status_ != RunStatus::Yielded && status_ != RunStatus::Exhausted) return status_;
+  status_ = (this->*engine_)(prog_);
+  return status_;
+}
+
+RunStatus Machine::Resume(uint64_t budget) {
+  fuel_ = GetFuel(budget);
+  return Resume();
+}
+
+bool RunWithOptions(Machine &machine, ProgramView prog, const MachineOptions &options) {
+  if (options.budget == kNoBudget) {
+    return machine.Run(prog);
+  }
+
+  auto status = machine.Run(prog, options.budget);
+  while (status == RunStatus::Yielded) {
+    status = machine.Resume();
+  }
+
+  if (status == RunStatus::Exhausted) {
+    char message[64];
+    snprintf(message, sizeof(message), "(!)Budget exhausted at %llu",
+      (unsigned long long)machine.GetPC());
+    machine.GetOutput().Message(message);
+    machine.GetOutput().Flush();
+  }
+
+  return status == RunStatus::Finished;
+}
+
+RunStatus Machine::Enter(ProgramView prog, std::span<const Unit> input) {
+  bool checked = stack_check_ == StackCheck::Explicit;
+  bool verified = false;
+  bool typed = false;
+
+  prog_ = prog;
   pc_ = 0;
-  stack<Unit>().swap(stack_);
+#ifdef CANVAS_THREADED_DISPATCH
+  threaded_code_.clear();
+#endif
+
+  // verified programs can not fault, so an exact stack without guards
+  VerifyReport report{ false, 0, {}, 0, nullptr, {}, false };
+  if (verify_ || dispatch_ == DispatchMode::Register) {
+    report = VerifyProgram(prog, stack_capacity_, input.size());
+    verified = report.fine;
+    if (verified) {
+      stack_.Reset(report.max_depth, false);
+    }
+  }
+
+  // objects of the last run are unreachable now
+  heap_.Clear();
+
+#ifdef CANVAS_THREADED_DISPATCH
+  if (dispatch_ == DispatchMode::Register && verified && !report.uses_heap && !yielding_
+    && !profile_) {
+    bool result = RunRegister(TranslateToRegisters(prog, report));
+    pc_ = prog.size();
+    status_ = result ? RunStatus::Finished : RunStatus::Error;
+    return status_;
+  }
+#endif
+
+  // the JIT and the register tier keep tagged units
+  if (verified && typed_ && dispatch_ != DispatchMode::Jit && !yielding_) {
+    auto types = InferTypes(prog, report);
+    typed = types.fine;
+    print_types_ = std::move(types.print);
+    exit_types_ = std::move(types.exit);
+  }
+
+  if (!verified) {
+    stack_.Reset(stack_capacity_, stack_check_ == StackCheck::GuardPage);
+    if (input.size() > stack_.Capacity()) {
+      output_->Message("(!)Stack overflow");
+      output_->Flush();
+      status_ = RunStatus::Error;
+      return status_;
+    }
+  }
+  std::copy(input.begin(), input.end(), stack_.Base());
+  stack_.SetTop(stack_.Base() + input.size());
+#ifdef CANVAS_PROFILE_PAIRS
+  pair_history_size_ = 0;
+#endif
+  if (profile_) {
+    profile_->Reset(prog.size());
+  }
+
+#define SELECT_CONFIG(_engine, _profile)                                            \
+  if (typed) {                                                                      \
+    engine_ = cache_top_ ?                                                          \
+      &Machine::_engine<EngineConfig{ false, true, true, true, _profile }> :        \
+      &Machine::_engine<EngineConfig{ false, false, true, true, _profile }>;        \
+  }                                                                                 \
+  else if (verified) {                                                              \
+    engine_ = cache_top_ ?                                                          \
+      &Machine::_engine<EngineConfig{ false, true, true, false, _profile }> :       \
+      &Machine::_engine<EngineConfig{ false, false, true, false, _profile }>;       \
+  }                                                                                 \
+  else if (checked) {                                                               \
+    engine_ = cache_top_ ?                                                          \
+      &Machine::_engine<EngineConfig{ true, true, false, false, _profile }> :       \
+      &Machine::_engine<EngineConfig{ true, false, false, false, _profile }>;       \
+  }                                                                                 \
+  else {                                                                            \
+    engine_ = cache_top_ ?                                                          \
+      &Machine::_engine<EngineConfig{ false, true, false, false, _profile }> :      \
+      &Machine::_engine<EngineConfig{ false, false, false, false, _profile }>;      \
+  }
+
+#ifdef CANVAS_PROFILE
+#define SELECT_ENGINE(_engine)          \
+  if (profile_) {                       \
+    SELECT_CONFIG(_engine, true)        \
+  }                                     \
+  else {                                \
+    SELECT_CONFIG(_engine, false)       \
+  }
+#else
+#define SELECT_ENGINE(_engine) SELECT_CONFIG(_engine, false)
+#endif
+
+#ifdef CANVAS_JIT
+  if (dispatch_ == DispatchMode::Jit && !yielding_ && !profile_) {
+    JitCode jit;
+    if (jit.Compile(prog, checked, verified) && RunJit(prog, jit, status_)) {
+      return status_;
+    }
+  }
+#endif
+
+#ifdef CANVAS_THREADED_DISPATCH
+  if (dispatch_ != DispatchMode::Switch) {
+    SELECT_ENGINE(RunThreaded);
+  }
+  else
+#endif
+  {
+    SELECT_ENGINE(RunSwitch);
+  }
+#undef SELECT_ENGINE
+#undef SELECT_CONFIG
+
+  status_ = (this->*engine_)(prog);
+  return status_;
+}
+
+void Machine::RetagStack(const RawUnit *base, const RawUnit *top) {
+  auto dest = stack_.Base();
+  size_t depth = top - base;
+  for (size_t idx = 0; idx < depth; idx += 1) {
+    dest[idx].value = base[idx].value;
+    dest[idx].type = exit_types_[idx];
+  }
+
+  stack_.SetTop(dest + depth);
+}
+
+// Portable engine: decode every code and branch through one switch.
+template <EngineConfig kConfig>
+RunStatus Machine::RunSwitch(ProgramView prog) {
+  auto status = RunStatus::Finished;
 
   auto prog_size = prog.size();
-  Unit tmp0, tmp1;
+  uint64_t pc = pc_;
+  int64_t fuel = fuel_;
+  using Slot = std::conditional_t<kConfig.typed, RawUnit, Unit>;
+  Slot *base;
+  if constexpr (kConfig.typed) {
+    // one spare unit below base, like OperandStack
+    raw_stack_.resize(stack_.Capacity() + 1);
+    base = raw_stack_.data() + 1;
+  }
+  else {
+    base = stack_.Base();
+  }
+  Slot *limit = base + stack_.Capacity();
+  // typed runs always start empty, others may be resumed
+  Slot *sp = base;
+  if constexpr (!kConfig.typed) {
+    sp = stack_.Top();
+  }
+  Slot tos{}, tmp0, tmp1;
+  if constexpr (kConfig.cache_top) {
+    sp -= 1;
+    tos = *sp;
+  }
+
+  // tagged engines print what the unit says, typed ones what was proven,
+  // pc goes by value so it never has to leave its register
+  auto print_type = [this](const Slot &unit, uint64_t at) {
+    if constexpr (kConfig.typed) {
+      return print_types_.find(at)->second;
+    }
+    else {
+      return unit.type;
+    }
+  };
+#ifdef CANVAS_STACK_TRAFFIC
+  uint64_t traffic = 0;
+#endif
   Code current;
 
-  while (pc_ < prog_size) {
-    current = prog[pc_];
+#define ARG GET_ARGS(current)
+#define WORD(_n) prog[pc + (_n)]
+#define PRINT_TYPE print_type(TOP, pc)
+#define HEAP heap_
+#define OUTPUT (*output_)
+#define YIELD() if (yielding_) { pc += 1; goto L_Yield; }
+#define JUMP_TO(_target)                    \
+  {                                         \
+    uint64_t jump_target = (_target);       \
+    CHARGE_JUMP(jump_target);               \
+    pc = jump_target;                       \
+    continue;                               \
+  }
+
+  while (pc < prog_size) {
+    current = prog[pc];
+    PROFILE_PAIR(GET_INST(current));
+    PROFILE_STEP(GET_INST(current));
     switch (static_cast<Inst>(GET_INST(current))) {
-    case Inst::Add:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::Int});
-      INTVAL(stack_.top()) = INTVAL(tmp1) + INTVAL(tmp0); 
-      break;
-    case Inst::Sub:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::Int});
-      INTVAL(stack_.top()) = INTVAL(tmp0) - INTVAL(tmp1);
-      break;
-    case Inst::Mul:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::Int});
-      INTVAL(stack_.top()) = INTVAL(tmp1) * INTVAL(tmp0);
-      break;
-    case Inst::Div:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::Int});
-      INTVAL(stack_.top()) = INTVAL(tmp0) / INTVAL(tmp1);
-      break;
-    case Inst::Mod:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::Int});
-      INTVAL(stack_.top()) = INTVAL(tmp0) % INTVAL(tmp1);
-      break;
-    case Inst::AddU:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp1) + UINTVAL(tmp0);
-      break;
-    case Inst::SubU:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) - UINTVAL(tmp1);
-      break;
-    case Inst::MulU:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp1) * UINTVAL(tmp0);
-      break;
-    case Inst::DivU:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) / UINTVAL(tmp1);
-      break;
-    case Inst::ModU:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) % UINTVAL(tmp1);
-      break;
-    case Inst::AddF:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::FP});
-      FPVAL(stack_.top()) = FPVAL(tmp0) + FPVAL(tmp1);
-      break;
-    case Inst::SubF:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::FP});
-      FPVAL(stack_.top()) = FPVAL(tmp0) - FPVAL(tmp1);
-      break;
-    case Inst::MulF:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::FP});
-      FPVAL(stack_.top()) = FPVAL(tmp0) * FPVAL(tmp1);
-      break;
-    case Inst::DivF:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::FP});
-      FPVAL(stack_.top()) = FPVAL(tmp0) / FPVAL(tmp1);
-      break;
-    case Inst::PushHalfWordImm:
-      stack_.push(Unit{GET_ARGS(current), UnitType::UInt});
-      break;
-    case Inst::PushHalfWordImmSL16:
-      UINTVAL(tmp0) = GET_ARGS(current);
-      UINTVAL(tmp0) <<= 16;
-      stack_.push(Unit{tmp0.value, UnitType::UInt});
-      break;
-    case Inst::AddSL32:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp1) + UINTVAL(tmp0);
-      UINTVAL(stack_.top()) <<= 32;
-      break;
-    case Inst::SpawnFP:
-      stack_.top().type = UnitType::FP;
-      break;
-    case Inst::SpawnSignedInt:
-      stack_.top().type = UnitType::Int;
-      break;
-    case Inst::Jump:
-      pc_ = GET_ARGS(current);
-      continue;
-    //jump if top value is (equals to) true
-    case Inst::Branch:
-      if (!stack_.empty()) {
-        if (UINTVAL(stack_.top()) != 0ull) {
-          pc_ = GET_ARGS(current);
-          continue;
-        }
-      }
-      break;
-    case Inst::FarJump:
-      POP_VALUE_TO(tmp0);
-      pc_ = UINTVAL(tmp0);
-      continue;
-    case Inst::FarBranch:
-      // addr
-      POP_VALUE_TO(tmp1);
-      // condition
-      POP_VALUE_TO(tmp0);
-      if (UINTVAL(tmp0) != 0ull) {
-        pc_ = UINTVAL(tmp1);
-        continue;
-      }
-      break;
-    case Inst::Pop:
-      if (!stack_.empty()) {
-        stack_.pop();
-      }
-      break;
-    case Inst::PrintStackTop:
-      if (!stack_.empty()) {
-        switch (stack_.top().type) {
-        case UnitType::Int:
-          printf("%s: %lld\n", "Int", INTVAL(stack_.top()));
-          break;
-        case UnitType::UInt:
-          printf("%s: %llu\n", "UInt", UINTVAL(stack_.top()));
-          break;
-        case UnitType::FP:
-          printf("%s: %f\n", "FP", FPVAL(stack_.top()));
-          break;
-        }
-      }
-      else {
-        //TODO: interrupt
-        std::puts("(!)Empty stack");
-      }
+#define DEF_INST(_id, _str) case Inst::_id: { OP_##_id } break;
+#define DEF_SUPER_INST2(_id, _str, _a, _b) \
+  case Inst::_id: { OP_##_a OP_##_b } break;
+#define DEF_SUPER_INST3(_id, _str, _a, _b, _c) \
+  case Inst::_id: { OP_##_a OP_##_b OP_##_c } break;
+#include "instruction.h"
+    default:
       break;
+    }
 
-    case Inst::ShiftLeft:
-      POP_VALUE_TO(tmp0); //shift amount
-      //target is on stack top.
-      INTVAL(stack_.top()) <<= UINTVAL(tmp0);
-      break;
+    pc += 1;
+  }
 
-    case Inst::ShiftLeftImm:
-      UINTVAL(tmp0) = GET_ARGS(current);
-      INTVAL(stack_.top()) <<= UINTVAL(tmp0);
-      break;
+  goto L_Exit;
 
-    case Inst::LogicShiftRight:
-      POP_VALUE_TO(tmp0);
-      UINTVAL(stack_.top()) >>= UINTVAL(tmp0);
-      break;
+#undef ARG
+#undef WORD
+#undef PRINT_TYPE
+#undef HEAP
+#undef OUTPUT
+#undef YIELD
+#undef JUMP_TO
 
-    case Inst::ArithShiftRight:
-      POP_VALUE_TO(tmp0);
-      INTVAL(stack_.top()) >>= UINTVAL(tmp0);
-      break;
+// only jumped to by the stack checks of checked configs
+[[maybe_unused]] L_Underflow:
+  output_->Message("(!)Stack underflow");
+  status = RunStatus::Error;
+  goto L_Exit;
 
-    case Inst::LogicShiftRightImm:
-      UINTVAL(tmp0) = GET_ARGS(current);
-      UINTVAL(stack_.top()) >>= UINTVAL(tmp0);
-      break;
+[[maybe_unused]] L_Overflow:
+  output_->Message("(!)Stack overflow");
+  status = RunStatus::Error;
+  goto L_Exit;
 
-    case Inst::ArithShiftRightImm:
-      UINTVAL(tmp0) = GET_ARGS(current);
-      INTVAL(stack_.top()) >>= UINTVAL(tmp0);
-      break;
+L_Fault:
+  status = RunStatus::Error;
+  goto L_Exit;
 
-    case Inst::And:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) & UINTVAL(tmp1);
-      break;
+L_Yield:
+  status = RunStatus::Yielded;
+  goto L_Exit;
 
-    case Inst::Or:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) | UINTVAL(tmp1);
-      break;
+L_Exhausted:
+  status = RunStatus::Exhausted;
 
-    case Inst::Not:
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = ~UINTVAL(tmp0);
-      break;
+L_Exit:
+  if constexpr (kConfig.cache_top) {
+    SLOT(0) = tos;
+    sp += 1;
+  }
 
-    case Inst::XOr:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) ^ UINTVAL(tmp1);
-      break;
+  pc_ = pc;
+  fuel_ = fuel;
+  output_->Flush();
+  if constexpr (kConfig.profile) {
+    profile_->Stop(pc);
+  }
+  if constexpr (kConfig.typed) {
+    RetagStack(base, sp);
+  }
+  else {
+    stack_.SetTop(sp);
+  }
+#ifdef CANVAS_STACK_TRAFFIC
+  stack_traffic_ += traffic;
+#endif
 
-    //Any non-zero value is converted to true.
-    case Inst::LogicAnd:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) && UINTVAL(tmp1);
-      break;
+  return status;
+}
 
-    case Inst::LogicOr:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = UINTVAL(tmp0) || UINTVAL(tmp1);
-      break;
+#ifdef CANVAS_THREADED_DISPATCH
+// Direct-threaded engine: every handler jumps straight to the next one.
+template <EngineConfig kConfig>
+RunStatus Machine::RunThreaded(ProgramView prog) {
+  auto status = RunStatus::Finished;
 
-    case Inst::LogicNot:
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = !UINTVAL(tmp0);
-      break;
+  auto prog_size = prog.size();
+  uint64_t pc = pc_;
+  int64_t fuel = fuel_;
+  using Slot = std::conditional_t<kConfig.typed, RawUnit, Unit>;
+  Slot *base;
+  if constexpr (kConfig.typed) {
+    // one spare unit below base, like OperandStack
+    raw_stack_.resize(stack_.Capacity() + 1);
+    base = raw_stack_.data() + 1;
+  }
+  else {
+    base = stack_.Base();
+  }
+  Slot *limit = base + stack_.Capacity();
+  // typed runs always start empty, others may be resumed
+  Slot *sp = base;
+  if constexpr (!kConfig.typed) {
+    sp = stack_.Top();
+  }
+  Slot tos{}, tmp0, tmp1;
+  if constexpr (kConfig.cache_top) {
+    sp -= 1;
+    tos = *sp;
+  }
 
-    //Use C++20 directly for UB-free impl of rotate shift.
-    case Inst::RotateLeft:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = std::rotl(UINTVAL(tmp0), UINTVAL(tmp1));
-      break;
+  // tagged engines print what the unit says, typed ones what was proven,
+  // pc goes by value so it never has to leave its register
+  auto print_type = [this](const Slot &unit, uint64_t at) {
+    if constexpr (kConfig.typed) {
+      return print_types_.find(at)->second;
+    }
+    else {
+      return unit.type;
+    }
+  };
+#ifdef CANVAS_STACK_TRAFFIC
+  uint64_t traffic = 0;
+#endif
 
-    case Inst::RotateRight:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = std::rotr(UINTVAL(tmp0), UINTVAL(tmp1));
-      break;
+  static const void *handlers[] = {
+#define DEF_INST(_id, _str) &&L_##_id,
+#include "instruction.h"
+  };
+  constexpr size_t handler_count = sizeof(handlers) / sizeof(handlers[0]);
 
-    case Inst::RotateLeftImm:
-      UINTVAL(tmp1) = GET_ARGS(current);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = std::rotl(UINTVAL(tmp0), UINTVAL(tmp1));
-      break;
+  // One-time pre-decode pass, resumed slices of the same run reuse it.
+  // The extra tail entry is the exit handler, so falling off the end
+  // needs no bound check per instruction.
+  if (threaded_code_.empty()) {
+    threaded_code_.resize(prog_size + 1);
+    for (size_t idx = 0; idx < prog_size; idx += 1) {
+      auto inst = GET_INST(prog[idx]);
+      threaded_code_[idx].handler = inst < handler_count ? handlers[inst] : &&L_Unknown;
+      threaded_code_[idx].args = GET_ARGS(prog[idx]);
+      threaded_code_[idx].word = prog[idx];
+    }
+    threaded_code_[prog_size] = ThreadedCode{ &&L_Exit, 0, 0 };
+  }
+  auto code = threaded_code_.data();
 
-    case Inst::RotateRightImm:
-      UINTVAL(tmp1) = GET_ARGS(current);
-      POP_VALUE_TO(tmp0);
-      stack_.push(Unit{0, UnitType::UInt});
-      UINTVAL(stack_.top()) = std::rotr(UINTVAL(tmp0), UINTVAL(tmp1));
-      break;
+#define ARG code[pc].args
+#define WORD(_n) code[pc + (_n)].word
+#define PRINT_TYPE print_type(TOP, pc)
+#define HEAP heap_
+#define OUTPUT (*output_)
+#define YIELD() if (yielding_) { pc += 1; goto L_Yield; }
+#define DISPATCH() goto *code[pc].handler
+#define JUMP_TO(_target)                    \
+  {                                         \
+    uint64_t jump_target = (_target);       \
+    if (jump_target > prog_size) jump_target = prog_size; \
+    CHARGE_JUMP(jump_target);               \
+    pc = jump_target;                       \
+    DISPATCH();                             \
+  }
 
-    case Inst::SwapTop:
-      POP_VALUE_TO(tmp1);
-      POP_VALUE_TO(tmp0);
-      stack_.push(tmp1);
-      stack_.push(tmp0);
-      break;
+  DISPATCH();
 
-    case Inst::Dup:
-      stack_.push(stack_.top());
-      break;
+#define DEF_INST(_id, _str) \
+  L_##_id: PROFILE_PAIR(uint8_t(Inst::_id)) PROFILE_STEP(uint8_t(Inst::_id)) \
+  { OP_##_id } pc += 1; DISPATCH();
+#define DEF_SUPER_INST2(_id, _str, _a, _b) \
+  L_##_id: PROFILE_PAIR(uint8_t(Inst::_id)) PROFILE_STEP(uint8_t(Inst::_id)) \
+  { OP_##_a OP_##_b } pc += 1; DISPATCH();
+#define DEF_SUPER_INST3(_id, _str, _a, _b, _c) \
+  L_##_id: PROFILE_PAIR(uint8_t(Inst::_id)) PROFILE_STEP(uint8_t(Inst::_id)) \
+  { OP_##_a OP_##_b OP_##_c } pc += 1; DISPATCH();
+#include "instruction.h"
 
-    case Inst::DupN:
-      UINTVAL(tmp0) = GET_ARGS(current);
-      for (size_t i = 0; i < UINTVAL(tmp0); i += 1) {
-        stack_.push(stack_.top());
-      }
-      break;
+L_Unknown:
+  pc += 1;
+  DISPATCH();
 
-    case Inst::Doze:
-    default:
-      break;
-    }
+#undef ARG
+#undef WORD
+#undef PRINT_TYPE
+#undef HEAP
+#undef OUTPUT
+#undef YIELD
+#undef DISPATCH
+#undef JUMP_TO
 
-    pc_ += 1;
-  }  
+// only jumped to by the stack checks of checked configs
+[[maybe_unused]] L_Underflow:
+  output_->Message("(!)Stack underflow");
+  status = RunStatus::Error;
+  goto L_Exit;
 
-  return result;
+[[maybe_unused]] L_Overflow:
+  output_->Message("(!)Stack overflow");
+  status = RunStatus::Error;
+  goto L_Exit;
+
+L_Fault:
+  status = RunStatus::Error;
+  goto L_Exit;
+
+L_Yield:
+  status = RunStatus::Yielded;
+  goto L_Exit;
+
+L_Exhausted:
+  status = RunStatus::Exhausted;
+
+L_Exit:
+  if constexpr (kConfig.cache_top) {
+    SLOT(0) = tos;
+    sp += 1;
+  }
+
+  pc_ = pc;
+  fuel_ = fuel;
+  output_->Flush();
+  if constexpr (kConfig.profile) {
+    profile_->Stop(pc);
+  }
+  if constexpr (kConfig.typed) {
+    RetagStack(base, sp);
+  }
+  else {
+    stack_.SetTop(sp);
+  }
+#ifdef CANVAS_STACK_TRAFFIC
+  stack_traffic_ += traffic;
+#endif
+
+  return status;
 }
+#endif
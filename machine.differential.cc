@@ -0,0 +1,176 @@
+#include "machine.differential.h"
+#include <cstdio>
+#include <string>
+
+using std::string;
+
+struct DiffMode {
+  const char *name;
+  DispatchMode dispatch;
+  bool cache_top;
+  bool verify;
+  bool budgeted; //also runs budgeted programs
+};
+
+struct DiffOutcome {
+  RunStatus status;
+  string output;
+  vector<Unit> stack;
+};
+
+// the first one is the reference
+const DiffMode kDiffModes[] = {
+  { "switch", DispatchMode::Switch, false, true, true },
+  { "switch+tos", DispatchMode::Switch, true, true, true },
+  { "switch-unv", DispatchMode::Switch, true, false, true },
+#ifdef CANVAS_THREADED_DISPATCH
+  { "threaded", DispatchMode::Threaded, false, true, true },
+  { "threaded+tos", DispatchMode::Threaded, true, true, true },
+  { "threaded-unv", DispatchMode::Threaded, true, false, true },
+  { "register", DispatchMode::Register, false, true, false },
+#endif
+#ifdef CANVAS_JIT
+  { "jit", DispatchMode::Jit, false, true, false },
+  { "jit-unv", DispatchMode::Jit, false, false, false },
+#endif
+};
+
+const char *GetRunStatusName(RunStatus status) {
+  switch (status) {
+  case RunStatus::Finished: return "finished";
+  case RunStatus::Yielded: return "yielded";
+  case RunStatus::Exhausted: return "exhausted";
+  case RunStatus::Error: return "error";
+  }
+
+  return "?";
+}
+
+bool ExecuteMode(ProgramView prog, MachineOptions options, const DiffMode &mode,
+  uint64_t budget, DiffOutcome &dest) {
+  auto fp = tmpfile();
+  if (fp == nullptr) {
+    puts("Cannot create a temporary file");
+    return false;
+  }
+
+  options.dispatch = mode.dispatch;
+  options.cache_top = mode.cache_top;
+  options.verify = mode.verify;
+  options.stack_check = StackCheck::Explicit;
+
+  {
+    OutputSink output(fp);
+    Machine machine(options);
+    machine.SetOutput(&output);
+
+    if (budget == kNoBudget) {
+      dest.status = machine.Run(prog) ? RunStatus::Finished : RunStatus::Error;
+    }
+    else {
+      dest.status = machine.Start(prog, {}, budget);
+      while (dest.status == RunStatus::Yielded) {
+        dest.status = machine.Resume();
+      }
+    }
+
+    auto &stack = machine.GetStack();
+    dest.stack.assign(stack.Base(), stack.Top());
+    output.Flush();
+  }
+
+  dest.output.clear();
+  rewind(fp);
+  char buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), fp)) != 0) {
+    dest.output.append(buffer, length);
+  }
+  fclose(fp);
+  return true;
+}
+
+// first line of the output that differs, "<end>" past the last one
+string GetDiffLine(const string &output, size_t pos) {
+  auto begin = pos == 0 ? 0 : output.rfind('\n', pos - 1);
+  begin = begin == string::npos || pos == 0 ? 0 : begin + 1;
+  if (begin >= output.size()) return "<end>";
+  auto end = output.find('\n', begin);
+  return output.substr(begin, end == string::npos ? string::npos : end - begin);
+}
+
+// prints what differs, nothing if the outcomes match
+bool CompareOutcomes(const DiffOutcome &expected, const DiffOutcome &actual) {
+  bool result = true;
+
+  if (expected.status != actual.status) {
+    printf("    status %s, expected %s\n", GetRunStatusName(actual.status),
+      GetRunStatusName(expected.status));
+    result = false;
+  }
+
+  if (expected.output != actual.output) {
+    size_t pos = 0;
+    while (pos < expected.output.size() && pos < actual.output.size()
+      && expected.output[pos] == actual.output[pos]) {
+      pos += 1;
+    }
+    printf("    output differs at byte %zu: \"%s\", expected \"%s\"\n", pos,
+      GetDiffLine(actual.output, pos).data(), GetDiffLine(expected.output, pos).data());
+    result = false;
+  }
+
+  if (expected.stack.size() != actual.stack.size()) {
+    printf("    stack depth %zu, expected %zu\n", actual.stack.size(), expected.stack.size());
+    return false;
+  }
+
+  for (size_t idx = 0; idx < expected.stack.size(); idx += 1) {
+    auto &lhs = expected.stack[idx];
+    auto &rhs = actual.stack[idx];
+    if (lhs.type != rhs.type || UINTVAL(lhs) != UINTVAL(rhs)) {
+      printf("    stack[%zu] %u:%016llx, expected %u:%016llx\n", idx,
+        unsigned(rhs.type), (unsigned long long)UINTVAL(rhs),
+        unsigned(lhs.type), (unsigned long long)UINTVAL(lhs));
+      result = false;
+      break;
+    }
+  }
+
+  return result;
+}
+
+bool DiffDispatchModes(ProgramView prog, const MachineOptions &options, const char *name) {
+  auto &reference = kDiffModes[0];
+
+  // the reference run tells whether the program ends at all
+  DiffOutcome expected;
+  if (!ExecuteMode(prog, options, reference, kDiffBudget, expected)) return false;
+  uint64_t budget = kDiffBudget;
+  if (expected.status != RunStatus::Exhausted) {
+    budget = kNoBudget;
+    if (!ExecuteMode(prog, options, reference, budget, expected)) return false;
+  }
+
+  size_t failed = 0;
+  size_t skipped = 0;
+  for (auto &mode : kDiffModes) {
+    if (&mode == &reference) continue;
+    if (budget != kNoBudget && !mode.budgeted) {
+      skipped += 1;
+      continue;
+    }
+
+    DiffOutcome actual;
+    if (!ExecuteMode(prog, options, mode, budget, actual)) return false;
+    if (!CompareOutcomes(expected, actual)) {
+      printf("  %s: MISMATCH\n", mode.name);
+      failed += 1;
+    }
+  }
+
+  printf("%s: %s, %zu units left, %zu modes differ%s\n", name,
+    GetRunStatusName(expected.status), expected.stack.size(), failed,
+    skipped == 0 ? "" : ", budgeted, jit/register skipped");
+  return failed == 0;
+}
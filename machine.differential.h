@@ -0,0 +1,17 @@
+#pragma once
+#include "machine.h"
+
+// Differential test of the dispatch modes.
+// DiffDispatchModes() runs a program on every engine of the build, with
+// and without the cached top and verification, under explicit stack
+// checks. The printed output, diagnostics included, the run status and
+// the final stack of each run have to be the same as those of the plain
+// switch interpreter. vm runs it as "vm <file> difftest [options]".
+// A program still running after kDiffBudget instructions on the switch
+// interpreter is compared under that budget. Budgeted runs never leave
+// the interpreters, so the JIT and register modes are skipped for it.
+
+constexpr uint64_t kDiffBudget = 4000000;
+
+// Prints one line per mode that differs and a summary, true if none did.
+bool DiffDispatchModes(ProgramView prog, const MachineOptions &options, const char *name);
@@ -1,35 +1,64 @@
+#pragma once
 #include <unordered_map>
 #include <vector>
-#include <stack>
+#include <span>
 #include <cstdint>
 #include <string>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include "memory-utils.h"
 
 //7bit inst, 25bit args
 using Code = uint32_t;
 // |--------args--------|--inst--|
 
+// useful macros
+#define GET_INST(_code) static_cast<uint8_t>((_code) % uint64_t(0x80))
+#define GET_ARGS(_code) static_cast<uint32_t>((_code) >> 7)
+#define HAS_ARGS(_code) (((_code) >> 7) != 0x0)
+
+// widest value that fits the args bits
+constexpr uint32_t kMaxArgs = 0x1FFFFFF;
+
 // 1 Word = 32bits
 // HalfWord, DoubleWord, Byte
 
 // Maybe we can use better container design?
 using Program = std::vector<Code>;
+// Non-owning, read-only words the machine executes from, e.g. a Program
+// or a mapped bytecode file.
+using ProgramView = std::span<const Code>;
 
-//for runtime stack
-using std::stack;
 using std::vector;
 using std::pair;
 
+// Allocation statistics of a MemoryInterface, in requested bytes.
+struct MemoryStats {
+  size_t bytes_live;
+  size_t bytes_peak;
+  size_t alloc_count;
+  size_t delete_count;
+  size_t collect_count;
+};
+
 // Base class for Memory Interface that will need to be
 // inherited by any exact implementation.
+// Alloc returns zeroed memory like calloc, see memory-pool.h for the
+// arena and pool implementations.
 class MemoryInterface {
 protected:
 public:
   MemoryInterface() { /* Placebo */ }
+  virtual ~MemoryInterface() {}
   virtual void *Alloc(size_t num, size_t size) = 0;
   virtual void Delete(void *) = 0;
   virtual void Collect() = 0;
+  // same as Alloc but the memory may hold garbage, for buffers that are
+  // always written before they are read
+  virtual void *AllocRaw(size_t num, size_t size) { return Alloc(num, size); }
+  // implementations without statistics report zeros
+  virtual MemoryStats GetStats() const { return MemoryStats{}; }
 };
 
 // Barebone wrapper of calloc/free.
@@ -45,9 +74,12 @@ public:
     free(ptr);
   }
 
-  void Collect() {}
+  void Collect() override {}
 };
 
+// Shared SimpleMemoryInterface, the default for a Machine.
+MemoryInterface *GetDefaultMemory();
+
 // warning: shift left for a negative signed int is UB before c++20
 // consider safe impl for signed int.
 //struct Symbol {
@@ -72,8 +104,67 @@ const vector<const char*> kInstStrings = {
 enum class UnitType {
   Int, //int64_t 
   UInt, //uint64_t
-  FP //double
+  FP, //double
+  Ptr //uint64_t handle of a HeapObject, made by New
+};
+
+// Words taken by an instruction, including trailing literal words.
+inline size_t GetInstLength(Inst inst) {
+  switch (inst) {
+  case Inst::PushWordImm:
+    return 2;
+  case Inst::PushDoubleWordImm:
+    return 3;
+  default:
+    break;
+  }
+
+  return 1;
+}
+
+// New/Load/Store, which need a Heap and tagged units.
+inline bool IsHeapInst(Inst inst) {
+  return inst == Inst::New || inst == Inst::Load || inst == Inst::Store;
+}
+
+// Whether the handler reads the args bits of its code.
+inline bool InstUsesArgs(Inst inst) {
+  return inst == Inst::PushHalfWordImm
+    || inst == Inst::PushHalfWordImmSL16
+    || inst == Inst::PushWordImm
+    || inst == Inst::PushDoubleWordImm
+    || inst == Inst::Jump
+    || inst == Inst::Branch
+    || inst == Inst::ShiftLeftImm
+    || inst == Inst::LogicShiftRightImm
+    || inst == Inst::ArithShiftRightImm
+    || inst == Inst::RotateLeftImm
+    || inst == Inst::RotateRightImm
+    || inst == Inst::DupN;
+}
+
+// Superinstruction components, in execution order.
+// At most one component reads the args bits and only the last one
+// may transfer control.
+struct SuperInst {
+  Inst inst;
+  Inst parts[3];
+  size_t count;
+};
+
+#define DEF_SUPER_INST2(_id, _str, _a, _b) \
+  { Inst::_id, { Inst::_a, Inst::_b, Inst::_b }, 2 },
+#define DEF_SUPER_INST3(_id, _str, _a, _b, _c) \
+  { Inst::_id, { Inst::_a, Inst::_b, Inst::_c }, 3 },
+const vector<SuperInst> kSuperInsts = {
+#ifdef CANVAS_SUPERINST_TABLE
+#include CANVAS_SUPERINST_TABLE
+#else
+#include "superinstruction.h"
+#endif
 };
+#undef DEF_SUPER_INST2
+#undef DEF_SUPER_INST3
 
 //TODO: For string features, we must add symbol table.
 union UnitValue {
@@ -88,20 +179,424 @@ struct Unit {
   UnitType type;
 };
 
+// Unit without its tag, for programs whose types are proven before they
+// run, see InferTypes().
+struct RawUnit {
+  UnitValue value;
+};
+
+#include "machine.output.h"
+#include "machine.profile.h"
+
+// Push a literal with as few dispatches as possible.
+void EmitImmediate(Program &prog, uint64_t value, UnitType type);
+
+// Direct-threaded dispatch relies on GCC/Clang labels-as-values.
+// Define CANVAS_NO_THREADED_DISPATCH to build the portable switch loop only.
+#if defined(__GNUC__) && !defined(CANVAS_NO_THREADED_DISPATCH)
+#define CANVAS_THREADED_DISPATCH
+#endif
+
+// Native code generation lives in machine.jit.cc and targets x86-64 SysV.
+// Define CANVAS_NO_JIT to leave it out.
+#if defined(__x86_64__) && defined(__unix__) && !defined(CANVAS_NO_JIT)
+#define CANVAS_JIT
+#endif
+
+enum class DispatchMode {
+  Switch, //one shared indirect branch
+  Threaded, //pre-decoded handler addresses, one branch per handler
+  Jit, //one machine-code stencil per instruction
+  Register //three-address ops over one register per stack slot, verified programs only
+};
+
+#ifdef CANVAS_THREADED_DISPATCH
+constexpr DispatchMode kDefaultDispatchMode = DispatchMode::Threaded;
+#else
+constexpr DispatchMode kDefaultDispatchMode = DispatchMode::Switch;
+#endif
+
+enum class StackCheck {
+  None, //trust the program
+  Explicit, //depth/room checked by handlers, failure stops the machine
+  GuardPage //inaccessible pages around the buffer, failure faults
+};
+
+#ifdef __unix__
+constexpr StackCheck kDefaultStackCheck = StackCheck::GuardPage;
+#else
+constexpr StackCheck kDefaultStackCheck = StackCheck::Explicit;
+#endif
+
+// in Units
+constexpr size_t kDefaultStackCapacity = 0x10000;
+// heap bytes before the first collection
+constexpr size_t kDefaultHeapThreshold = size_t(1) << 20;
+// run budget meaning no limit
+constexpr uint64_t kNoBudget = UINT64_MAX;
+// budget of one time slice for Runner and RunAsync()
+constexpr uint64_t kDefaultSlice = uint64_t(1) << 20;
+
+// Runtime knobs shared by vm and bcvm command lines.
+struct MachineOptions {
+  DispatchMode dispatch = kDefaultDispatchMode;
+  size_t stack_capacity = kDefaultStackCapacity;
+  StackCheck stack_check = kDefaultStackCheck;
+  bool cache_top = true;
+  bool verify = true; //run verified programs without checks, see verifier.h
+  bool typed = true; //and on an untagged stack once their types are proven
+  size_t heap_threshold = kDefaultHeapThreshold;
+  bool gc_stats = false; //print HeapStats after the run
+  uint64_t budget = kNoBudget; //instructions before vm/bcvm give up
+  OutputMode output = OutputMode::Text; //of the machine's own OutputSink on stdout
+};
+
+// Accepts --dispatch=switch|threaded|jit|register, --stack=<units>,
+// --stack-check=none|explicit|guard, --cache-top=on|off, --verify=on|off,
+// --typed=on|off, --heap=<bytes>, --gc-stats=on|off, --budget=<count>,
+// --output=text|binary|discard
+bool ParseMachineOption(MachineOptions &dest, const char *str);
+
 // INT VALue, Unsigned INT VALue, Floating-Point VALue
 #define INTVAL(_unit)  (_unit).value.integer
 #define UINTVAL(_unit) (_unit).value.uinteger
 #define FPVAL(_unit) (_unit).value.fp
 
+// Contiguous, fixed-capacity operand stack.
+// Engines copy the stack pointer into a local while running and
+// write it back with SetTop() when they return.
+// One spare unit is always kept right below Base().
+// Unguarded buffers come from the given MemoryInterface.
+class OperandStack {
+  protected:
+  MemoryInterface *memory_;
+  Unit *base_;
+  Unit *limit_;
+  Unit *top_; //one past the top unit
+  void *mapping_;
+  size_t mapping_size_;
+  bool guarded_;
+
+  void Allocate(size_t capacity, bool guarded);
+  void Release();
+
+  public:
+  OperandStack(size_t capacity, bool guarded, MemoryInterface *memory);
+  ~OperandStack();
+  OperandStack(const OperandStack &) = delete;
+  OperandStack &operator=(const OperandStack &) = delete;
+
+  Unit *Base() { return base_; }
+  Unit *Limit() { return limit_; }
+  Unit *Top() { return top_; }
+  void SetTop(Unit *top) { top_ = top; }
+  void Clear() { top_ = base_; }
+
+  // reallocate unless capacity and guard already match, drops the contents
+  void Reset(size_t capacity, bool guarded);
+
+  size_t Capacity() const { return limit_ - base_; }
+  size_t Depth() const { return top_ - base_; }
+  bool Empty() const { return top_ == base_; }
+};
+
+// printf reference for the text OutputSink writes.
+inline void PrintValue(UnitValue value, UnitType type) {
+  switch (type) {
+  case UnitType::Int:
+    printf("%s: %lld\n", "Int", (long long)value.integer);
+    break;
+  case UnitType::UInt:
+    printf("%s: %llu\n", "UInt", (unsigned long long)value.uinteger);
+    break;
+  case UnitType::FP:
+    printf("%s: %f\n", "FP", value.fp);
+    break;
+  case UnitType::Ptr:
+    printf("%s: #%llu\n", "Ptr", (unsigned long long)value.uinteger);
+    break;
+  }
+}
+
+inline void PrintUnit(const Unit &unit) {
+  PrintValue(unit.value, unit.type);
+}
+
+#ifdef CANVAS_JIT
+enum class JitStatus {
+  Finished,
+  Underflow, //explicit depth check failed
+  Overflow, //explicit room check failed
+  BadTarget //far jump into a literal word, the interpreter takes over
+};
+
+// Native code for one program, see machine.jit.cc.
+class JitCode {
+  protected:
+  void *code_;
+  size_t code_size_;
+  vector<const void *> table_; //far jump targets, one per program word
+
+  public:
+  JitCode() : code_(nullptr), code_size_(0) {}
+  ~JitCode();
+  JitCode(const JitCode &) = delete;
+  JitCode &operator=(const JitCode &) = delete;
+
+  // Fails on programs it can not map one to one, like a Jump/Branch
+  // into a literal word, and on programs using the heap. checked emits the explicit stack checks,
+  // verified also drops the emptiness tests of Pop/Branch.
+  bool Compile(ProgramView prog, bool checked, bool verified);
+  // sp is updated in place, pc is the far jump target after BadTarget
+  JitStatus Run(Unit *&sp, uint64_t &pc, Unit *base, Unit *limit, OutputSink *output);
+};
+#endif
+
+// Object made by New, its units follow the header.
+struct HeapObject {
+  uint64_t size; //units
+  uint64_t marked;
+
+  Unit *Units() { return reinterpret_cast<Unit *>(this + 1); }
+};
+
+struct HeapStats {
+  size_t objects; //live or not yet collected
+  size_t bytes; //of those, headers included
+  size_t peak_bytes;
+  size_t threshold; //a New passing it collects first
+  size_t collections;
+  size_t freed_objects; //over all collections
+  double last_pause_us;
+  double max_pause_us;
+  double total_pause_us;
+};
+
+// the next threshold is this times the bytes surviving a collection
+constexpr size_t kHeapGrowthFactor = 2;
+// bigger New counts fault
+constexpr uint64_t kMaxObjectUnits = uint64_t(1) << 32;
+constexpr uint64_t kNoObject = UINT64_MAX;
+
+// Garbage-collected heap behind New/Load/Store, see machine.heap.cc.
+// Objects come from the machine's MemoryInterface. Collection is a
+// precise, non-moving mark-sweep: the roots are the units on the
+// operand stack, and only units tagged UnitType::Ptr are followed.
+// Ptr units hold an index into the object table rather than an address,
+// so a forged one (a literal, or a shifted handle keeping its tag) can
+// at worst name another live object, never arbitrary memory.
+class Heap {
+  protected:
+  MemoryInterface *memory_;
+  vector<HeapObject *> objects_; //by handle, nullptr once freed
+  vector<uint64_t> free_handles_;
+  vector<HeapObject *> mark_stack_;
+  size_t initial_threshold_;
+  HeapStats stats_;
+
+  void Mark(const Unit &unit);
+
+  public:
+  Heap(MemoryInterface *memory, size_t threshold);
+  ~Heap();
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  // Collects first once the threshold would be passed, with the units
+  // in [roots, roots_end) as roots. Returns the handle, kNoObject if
+  // count is too big or memory runs out.
+  uint64_t Allocate(uint64_t count, const Unit *roots, const Unit *roots_end);
+
+  // the object a Ptr unit names, nullptr for anything else
+  HeapObject *Find(const Unit &unit) const {
+    if (unit.type != UnitType::Ptr || unit.value.uinteger >= objects_.size()) {
+      return nullptr;
+    }
+    return objects_[unit.value.uinteger];
+  }
+
+  void Collect(const Unit *roots, const Unit *roots_end);
+  // free every object at once, statistics stay
+  void Clear();
+
+  const HeapStats &GetStats() const { return stats_; }
+};
+
+void PrintHeapStats(FILE *fp, const HeapStats &stats);
+
+struct RegisterProgram;
+class RunTask;
+class Executor;
+
+enum class RunStatus {
+  Finished, //pc fell off the end
+  Yielded, //stopped right after a Doze, Resume() continues
+  Exhausted, //ran out of budget at a backward jump, Resume() continues
+  Error //stack check or heap fault, already reported
+};
+
+#ifdef CANVAS_THREADED_DISPATCH
+// Pre-decoded code for the direct-threaded engine.
+// One entry per program word, so jump targets need no translation.
+struct ThreadedCode {
+  const void *handler;
+  uint32_t args;
+  Code word; //raw, for literal words
+};
+#endif
+
+// Compile-time engine variant, instantiated once per combination.
+struct EngineConfig {
+  bool checked; //explicit depth/room checks
+  bool cache_top; //keep the top unit in a local across dispatches
+  bool verified = false; //passed VerifyProgram, no emptiness checks either
+  bool typed = false; //RawUnit stack, tags come from InferTypes
+  bool profile = false; //counts into ExecutionProfile, CANVAS_PROFILE builds only
+};
+
+class Machine;
+using EngineEntry = RunStatus (Machine::*)(ProgramView);
+
 class Machine {
   protected:
-  stack<Unit> stack_;
+  MemoryInterface *memory_;
+  OperandStack stack_;
+  Heap heap_;
+  OutputSink own_output_; //on stdout
+  OutputSink *output_;
   uint64_t pc_;
-  
+  // program of the last Start(), the engine it runs on and where it is
+  ProgramView prog_;
+  EngineEntry engine_;
+  RunStatus status_;
+  bool yielding_; //Doze stops the engine
+  int64_t fuel_; //budget left, negative once exhausted
+#ifdef CANVAS_THREADED_DISPATCH
+  vector<ThreadedCode> threaded_code_; //kept across slices
+#endif
+  DispatchMode dispatch_;
+  StackCheck stack_check_;
+  size_t stack_capacity_;
+  bool cache_top_;
+  bool verify_;
+  bool typed_;
+  // proven types while a typed engine runs
+  std::unordered_map<size_t, UnitType> print_types_;
+  vector<UnitType> exit_types_;
+  vector<RawUnit> raw_stack_;
+#ifdef CANVAS_STACK_TRAFFIC
+  uint64_t stack_traffic_ = 0;
+#endif
+  // set while profiling, engines only touch it in profiled variants
+  std::unique_ptr<ExecutionProfile> profile_;
+#ifdef CANVAS_PROFILE_PAIRS
+  // opcodes executed back to back without a taken jump
+  vector<uint64_t> pair_counts_ = vector<uint64_t>(0x80 * 0x80, 0);
+  std::unordered_map<uint32_t, uint64_t> triple_counts_;
+  uint8_t pair_history_[2] = { 0, 0 };
+  size_t pair_history_size_ = 0;
+  uint64_t pair_next_pc_ = 0;
+
+  void RecordPair(uint64_t pc, uint8_t inst);
+#endif
+
+  // Engines continue from pc_ and the units on stack_.
+  template <EngineConfig kConfig>
+  RunStatus RunSwitch(ProgramView prog);
+#ifdef CANVAS_THREADED_DISPATCH
+  template <EngineConfig kConfig>
+  RunStatus RunThreaded(ProgramView prog);
+#endif
+#ifdef CANVAS_THREADED_DISPATCH
+  // see machine.register.h
+  bool RunRegister(const RegisterProgram &prog);
+#endif
+  // copy a finished untagged stack back, tagged with exit_types_
+  void RetagStack(const RawUnit *base, const RawUnit *top);
+#ifdef CANVAS_JIT
+  // false when the program goes on from pc_ on an interpreter
+  bool RunJit(ProgramView prog, JitCode &jit, RunStatus &status);
+#endif
+  RunStatus Enter(ProgramView prog, std::span<const Unit> input);
+
   public:
-  Machine() : stack_(), pc_(0) {}
+  // The stack and any other heap objects come from memory, which must
+  // outlive the machine. The stack is sized per program by Run().
+  Machine(const MachineOptions &options = MachineOptions(), 
+    MemoryInterface *memory = GetDefaultMemory()) : 
+    memory_(memory), stack_(0, false, memory),
+    heap_(memory, options.heap_threshold), own_output_(stdout, options.output),
+    output_(&own_output_), pc_(0), engine_(nullptr),
+    status_(RunStatus::Finished), yielding_(false), fuel_(INT64_MAX), dispatch_(options.dispatch), stack_check_(options.stack_check),
+    stack_capacity_(options.stack_capacity), cache_top_(options.cache_top), 
+    verify_(options.verify), typed_(options.typed) {}
   ~Machine() {}
 
+  // Threaded mode silently falls back to switch if it is not compiled in,
+  // jit mode to the best interpreter if the program can not be compiled,
+  // register mode to threaded if the program can not be verified
+  // or uses the heap.
+  void SetDispatchMode(DispatchMode dispatch) { dispatch_ = dispatch; }
+  DispatchMode GetDispatchMode() const { return dispatch_; }
+
+  OperandStack &GetStack() { return stack_; }
+  MemoryInterface *GetMemory() { return memory_; }
+  // objects of the last run, until the next one starts
+  Heap &GetHeap() { return heap_; }
+  // Where PrintStackTop and run-time errors write, flushed whenever a
+  // run returns. Another sink, e.g. one shared by many machines on the
+  // same thread, must outlive its use, nullptr goes back to the own one.
+  void SetOutput(OutputSink *output) { output_ = output != nullptr ? output : &own_output_; }
+  OutputSink &GetOutput() { return *output_; }
+#ifdef CANVAS_STACK_TRAFFIC
+  // stack bytes touched in memory since construction
+  uint64_t GetStackTraffic() const { return stack_traffic_; }
+#endif
+
+#ifdef CANVAS_PROFILE_PAIRS
+  // "<count> <inst> <inst> [<inst>]" lines, accumulated over all runs
+  void DumpPairProfile(FILE *fp);
+#endif
+
+#ifdef CANVAS_PROFILE
+  // Profiles the following runs, see machine.profile.h. Profiled runs
+  // stay on the switch/threaded interpreters.
+  void EnableProfile(bool enable = true);
+  // of the runs since the last Start(), nullptr unless enabled
+  const ExecutionProfile *GetProfile() const { return profile_.get(); }
+  // opcode totals, hot spots and branches of the last program
+  void DumpProfile(FILE *fp, const ProfileSource &source = ProfileSource());
+#endif
+
   //TODO: accept symbol table
-  bool Run(Program &prog);  
+  bool Run(ProgramView prog);
+
+  // Resumable runs. Start() pushes input, bottom first, and runs prog
+  // until it ends, fails, reaches a Doze or uses up its budget, Resume()
+  // carries on from there. prog must stay alive until the run finishes.
+  // These always run on the switch/threaded interpreters, the typed,
+  // JIT and register tiers can not stop halfway. Resume() after
+  // Finished or Error returns the same status again.
+  //
+  // The budget counts instructions but is only checked at backward
+  // jumps, so a run stops at the first loop iteration going past it.
+  // Resume() goes on with what is left, which after Exhausted is
+  // nothing, Resume(budget) starts over with a new one.
+  RunStatus Start(ProgramView prog, std::span<const Unit> input = {},
+    uint64_t budget = kNoBudget);
+  RunStatus Run(ProgramView prog, uint64_t budget) { return Start(prog, {}, budget); }
+  RunStatus Resume();
+  RunStatus Resume(uint64_t budget);
+  RunStatus GetStatus() const { return status_; }
+  uint64_t GetBudget() const { return fuel_ < 0 ? 0 : uint64_t(fuel_); }
+
+  // Coroutine over Start()/Resume(), see machine.async.h. Every Doze
+  // and every slice of budget suspends it and hands it to executor.
+  RunTask RunAsync(ProgramView prog, Executor &executor, uint64_t slice = kDefaultSlice);
+  uint64_t GetPC() const { return pc_; }
 };
+
+// Run() for the vm and bcvm command lines: with options.budget set the
+// program goes through Start()/Resume() instead, Doze only yields back
+// here, and running out of budget is reported.
+bool RunWithOptions(Machine &machine, ProgramView prog, const MachineOptions &options);
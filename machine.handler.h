@@ -0,0 +1,350 @@
+#pragma once
+#include "machine.h"
+#include <cstdio>
+#include <bit>
+
+// Instruction handlers.
+// Each OP_<Inst> is written once and expanded into every dispatch engine
+// and into the C++ written by TranslateProgram().
+// Operands are updated in place on the contiguous stack.
+// An engine must provide:
+//   ARG              - argument bits of the current code
+//   WORD(_n)         - raw program word at pc + _n
+//   JUMP_TO(_target) - transfer control to _target and dispatch
+//   PRINT_TYPE       - type of the unit PrintStackTop prints, TOP.type
+//                      unless kConfig.typed
+//   HEAP             - the Heap, for New/Load/Store
+//   OUTPUT           - the OutputSink PrintStackTop and heap faults write to
+//   YIELD()          - Doze: leave with pc past it if the run can be
+//                      resumed, nothing otherwise
+//   L_Underflow/L_Overflow labels for checked variants, L_Fault for a
+//   failed heap instruction
+// and locals pc/prog_size/sp/base/limit/tos plus tmp0/tmp1 for scratch
+// values, all under a constexpr EngineConfig kConfig. Stack units are
+// of type Slot, Unit or RawUnit with kConfig.typed, so handlers only tag
+// them through SET_TYPE()/MAKE_UNIT().
+//
+// With kConfig.cache_top the top unit lives in the local tos and sp
+// points one below where it would be stored, so memory is only touched
+// when the stack grows or shrinks past the top. The slot below base
+// absorbs the spill of the empty-stack tos.
+
+// CANVAS_STACK_TRAFFIC counts the bytes of every stack slot touched in
+// memory, typed engines move half as many per slot.
+#ifdef CANVAS_STACK_TRAFFIC
+// a call, so two slots in one expression count in some order instead of
+// modifying traffic unsequenced
+template <typename T>
+inline T &CountSlot(uint64_t &traffic, T *slot) {
+  traffic += sizeof(T);
+  return *slot;
+}
+#define SLOT(_idx) CountSlot(traffic, sp + (_idx))
+#else
+#define SLOT(_idx) sp[_idx]
+#endif
+
+#define TOP (kConfig.cache_top ? tos : SLOT(-1))
+#define SECOND (kConfig.cache_top ? SLOT(-1) : SLOT(-2))
+// where a binary op leaves its result before sp drops by one
+#define BINARY_DEST (kConfig.cache_top ? tos : SLOT(-2))
+#define DEPTH() (static_cast<size_t>(sp - base) + (kConfig.cache_top ? 1 : 0))
+// units that can still be pushed, the cached top also needs its slot
+#define ROOM() (static_cast<size_t>(limit - sp) - (kConfig.cache_top ? 1 : 0))
+// verified programs never reach these with an empty stack
+#define NOT_EMPTY() (kConfig.verified || DEPTH() != 0)
+
+// typed engines keep tags out of memory altogether
+inline void SetUnitType(Unit &unit, UnitType type) { unit.type = type; }
+inline void SetUnitType(RawUnit &, UnitType) {}
+
+template <typename T>
+inline T MakeUnit(uint64_t value, UnitType type) {
+  T unit;
+  UINTVAL(unit) = value;
+  SetUnitType(unit, type);
+  return unit;
+}
+
+#define SET_TYPE(_unit, _type) SetUnitType(_unit, _type)
+#define MAKE_UNIT(_value, _type) MakeUnit<Slot>(_value, _type)
+
+// explicit checks only exist in checked variants.
+#define REQUIRE(_n)                                   \
+  if constexpr (kConfig.checked) {                    \
+    if (DEPTH() < (_n)) goto L_Underflow;             \
+  }
+
+#define RESERVE(_n)                                   \
+  if constexpr (kConfig.checked) {                    \
+    if (ROOM() < (_n)) goto L_Overflow;                \
+  }
+
+#define PUSH_UNIT(_unit)                \
+  RESERVE(1);                           \
+  if constexpr (kConfig.cache_top) {    \
+    SLOT(0) = tos;                      \
+    tos = _unit;                        \
+  }                                     \
+  else {                                \
+    SLOT(0) = _unit;                    \
+  }                                     \
+  sp += 1;
+
+#define POP_VALUE_TO(_tmp)              \
+  sp -= 1;                              \
+  if constexpr (kConfig.cache_top) {    \
+    _tmp = tos;                         \
+    tos = SLOT(0);                      \
+  }                                     \
+  else {                                \
+    _tmp = SLOT(0);                     \
+  }
+
+// drop the top unit without reading it
+#define DROP()                          \
+  sp -= 1;                              \
+  if constexpr (kConfig.cache_top) {    \
+    tos = SLOT(0);                      \
+  }
+
+// BINARY_DEST = SECOND _op TOP, tagged as _type
+#define BINARY_OP(_val, _type, _op)               \
+  REQUIRE(2);                                     \
+  _val(BINARY_DEST) = _val(SECOND) _op _val(TOP); \
+  SET_TYPE(BINARY_DEST, UnitType::_type);         \
+  sp -= 1;
+
+// TOP = _expr, tagged as _type
+#define UNARY_OP(_val, _type, _expr) \
+  REQUIRE(1);                        \
+  _val(TOP) = _expr;                 \
+  SET_TYPE(TOP, UnitType::_type);
+
+#define OP_Add BINARY_OP(INTVAL, Int, +)
+#define OP_Sub BINARY_OP(INTVAL, Int, -)
+#define OP_Mul BINARY_OP(INTVAL, Int, *)
+#define OP_Div BINARY_OP(INTVAL, Int, /)
+#define OP_Mod BINARY_OP(INTVAL, Int, %)
+#define OP_AddU BINARY_OP(UINTVAL, UInt, +)
+#define OP_SubU BINARY_OP(UINTVAL, UInt, -)
+#define OP_MulU BINARY_OP(UINTVAL, UInt, *)
+#define OP_DivU BINARY_OP(UINTVAL, UInt, /)
+#define OP_ModU BINARY_OP(UINTVAL, UInt, %)
+#define OP_AddF BINARY_OP(FPVAL, FP, +)
+#define OP_SubF BINARY_OP(FPVAL, FP, -)
+#define OP_MulF BINARY_OP(FPVAL, FP, *)
+#define OP_DivF BINARY_OP(FPVAL, FP, /)
+
+#define OP_PushHalfWordImm \
+  PUSH_UNIT(MAKE_UNIT(ARG, UnitType::UInt));
+
+#define OP_PushHalfWordImmSL16 \
+  PUSH_UNIT(MAKE_UNIT(uint64_t(ARG) << 16, UnitType::UInt));
+
+// a truncated literal ends the program
+#define REQUIRE_WORDS(_n)                       \
+  if (pc + (_n) >= prog_size) {                 \
+    JUMP_TO(prog_size);                         \
+  }
+
+#define OP_PushWordImm                                    \
+  REQUIRE_WORDS(1);                                       \
+  SET_TYPE(tmp0, static_cast<UnitType>(ARG));             \
+  UINTVAL(tmp0) = static_cast<UnitType>(ARG) == UnitType::Int ? \
+    static_cast<uint64_t>(static_cast<int32_t>(WORD(1))) : WORD(1); \
+  PUSH_UNIT(tmp0);                                        \
+  pc += 1;
+
+#define OP_PushDoubleWordImm                              \
+  REQUIRE_WORDS(2);                                       \
+  SET_TYPE(tmp0, static_cast<UnitType>(ARG));             \
+  UINTVAL(tmp0) = (uint64_t(WORD(2)) << 32) | WORD(1);    \
+  PUSH_UNIT(tmp0);                                        \
+  pc += 2;
+
+#define OP_AddSL32             \
+  OP_AddU                      \
+  UINTVAL(TOP) <<= 32;
+
+#define OP_SpawnFP \
+  REQUIRE(1);      \
+  SET_TYPE(TOP, UnitType::FP);
+
+#define OP_SpawnSignedInt \
+  REQUIRE(1);             \
+  SET_TYPE(TOP, UnitType::Int);
+
+#define OP_Jump \
+  JUMP_TO(ARG);
+
+//jump if top value is (equals to) true
+#define OP_Branch                         \
+  if (NOT_EMPTY()) {                      \
+    if (UINTVAL(TOP) != 0ull) {           \
+      JUMP_TO(ARG);                       \
+    }                                     \
+  }
+
+#define OP_FarJump     \
+  REQUIRE(1);          \
+  POP_VALUE_TO(tmp0);  \
+  JUMP_TO(UINTVAL(tmp0));
+
+#define OP_FarBranch             \
+  REQUIRE(2);                    \
+  /* addr */                     \
+  POP_VALUE_TO(tmp1);            \
+  /* condition */                \
+  POP_VALUE_TO(tmp0);            \
+  if (UINTVAL(tmp0) != 0ull) {   \
+    JUMP_TO(UINTVAL(tmp1));      \
+  }
+
+#define OP_Pop            \
+  if (NOT_EMPTY()) {      \
+    DROP();               \
+  }
+
+#define OP_PrintStackTop                                        \
+  if (NOT_EMPTY()) {                                            \
+    OUTPUT.Print(TOP.value, PRINT_TYPE);                        \
+  }                                                             \
+  else {                                                        \
+    /* TODO: interrupt */                                       \
+    OUTPUT.PrintEmpty();                                        \
+  }
+
+// shift amount is popped, target stays on stack top.
+#define OP_ShiftLeft \
+  REQUIRE(2);        \
+  POP_VALUE_TO(tmp0); \
+  INTVAL(TOP) <<= UINTVAL(tmp0);
+
+#define OP_ShiftLeftImm \
+  REQUIRE(1);           \
+  INTVAL(TOP) <<= ARG;
+
+#define OP_LogicShiftRight \
+  REQUIRE(2);              \
+  POP_VALUE_TO(tmp0);      \
+  UINTVAL(TOP) >>= UINTVAL(tmp0);
+
+#define OP_ArithShiftRight \
+  REQUIRE(2);              \
+  POP_VALUE_TO(tmp0);      \
+  INTVAL(TOP) >>= UINTVAL(tmp0);
+
+#define OP_LogicShiftRightImm \
+  REQUIRE(1);                 \
+  UINTVAL(TOP) >>= ARG;
+
+#define OP_ArithShiftRightImm \
+  REQUIRE(1);                 \
+  INTVAL(TOP) >>= ARG;
+
+#define OP_And BINARY_OP(UINTVAL, UInt, &)
+#define OP_Or BINARY_OP(UINTVAL, UInt, |)
+#define OP_XOr BINARY_OP(UINTVAL, UInt, ^)
+#define OP_Not UNARY_OP(UINTVAL, UInt, ~UINTVAL(TOP))
+
+//Any non-zero value is converted to true.
+#define OP_LogicAnd BINARY_OP(UINTVAL, UInt, &&)
+#define OP_LogicOr BINARY_OP(UINTVAL, UInt, ||)
+#define OP_LogicNot UNARY_OP(UINTVAL, UInt, !UINTVAL(TOP))
+
+//Use C++20 directly for UB-free impl of rotate shift.
+#define OP_RotateLeft                                 \
+  REQUIRE(2);                                         \
+  POP_VALUE_TO(tmp1);                                 \
+  UNARY_OP(UINTVAL, UInt, std::rotl(UINTVAL(TOP), UINTVAL(tmp1)))
+
+#define OP_RotateRight                                \
+  REQUIRE(2);                                         \
+  POP_VALUE_TO(tmp1);                                 \
+  UNARY_OP(UINTVAL, UInt, std::rotr(UINTVAL(TOP), UINTVAL(tmp1)))
+
+#define OP_RotateLeftImm \
+  UNARY_OP(UINTVAL, UInt, std::rotl(UINTVAL(TOP), ARG))
+
+#define OP_RotateRightImm \
+  UNARY_OP(UINTVAL, UInt, std::rotr(UINTVAL(TOP), ARG))
+
+#define OP_SwapTop       \
+  REQUIRE(2);            \
+  tmp0 = SECOND;         \
+  SECOND = TOP;          \
+  TOP = tmp0;
+
+#define OP_Dup    \
+  REQUIRE(1);     \
+  PUSH_UNIT(TOP);
+
+#define OP_DupN                                   \
+  REQUIRE(1);                                     \
+  RESERVE(ARG);                                   \
+  tmp0 = TOP;                                     \
+  for (size_t i = 0; i < ARG; i += 1) {           \
+    SLOT(0) = tmp0;                               \
+    sp += 1;                                      \
+  }
+
+// cooperative yield point, see Machine::Start()
+#define OP_Doze \
+  YIELD();
+
+// Typed engines never run heap instructions, InferTypes gives up on
+// them, so these only do the work on tagged units.
+inline uint64_t NewObject(Heap &heap, uint64_t count, const Unit *roots, const Unit *roots_end) {
+  return heap.Allocate(count, roots, roots_end);
+}
+inline uint64_t NewObject(Heap &, uint64_t, const RawUnit *, const RawUnit *) {
+  return kNoObject;
+}
+
+inline bool LoadUnit(Heap &heap, Unit &dest, const Unit &object, uint64_t index) {
+  auto found = heap.Find(object);
+  if (found == nullptr || index >= found->size) return false;
+  dest = found->Units()[index];
+  return true;
+}
+inline bool LoadUnit(Heap &, RawUnit &, const RawUnit &, uint64_t) { return false; }
+
+inline bool StoreUnit(Heap &heap, const Unit &object, uint64_t index, const Unit &unit) {
+  auto found = heap.Find(object);
+  if (found == nullptr || index >= found->size) return false;
+  found->Units()[index] = unit;
+  return true;
+}
+inline bool StoreUnit(Heap &, const RawUnit &, uint64_t, const RawUnit &) { return false; }
+
+#define HEAP_FAULT(_msg)   \
+  {                        \
+    OUTPUT.Message(_msg);  \
+    goto L_Fault;          \
+  }
+
+// every unit below TOP is a root, TOP itself is the count
+#define OP_New                                                    \
+  REQUIRE(1);                                                     \
+  UINTVAL(tmp0) = NewObject(HEAP, UINTVAL(TOP), base,             \
+    kConfig.cache_top ? sp : sp - 1);                             \
+  if (UINTVAL(tmp0) == kNoObject) HEAP_FAULT("(!)Out of heap memory"); \
+  UINTVAL(TOP) = UINTVAL(tmp0);                                   \
+  SET_TYPE(TOP, UnitType::Ptr);
+
+#define OP_Load                                                   \
+  REQUIRE(2);                                                     \
+  /* index */                                                     \
+  POP_VALUE_TO(tmp0);                                             \
+  tmp1 = TOP;                                                     \
+  if (!LoadUnit(HEAP, TOP, tmp1, UINTVAL(tmp0))) HEAP_FAULT("(!)Bad heap access");
+
+#define OP_Store                                                  \
+  REQUIRE(3);                                                     \
+  /* unit */                                                      \
+  POP_VALUE_TO(tmp1);                                             \
+  /* index */                                                     \
+  POP_VALUE_TO(tmp0);                                             \
+  if (!StoreUnit(HEAP, TOP, UINTVAL(tmp0), tmp1)) HEAP_FAULT("(!)Bad heap access"); \
+  DROP();
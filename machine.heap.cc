@@ -0,0 +1,118 @@
+#include "machine.h"
+#include <algorithm>
+#include <chrono>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+Heap::Heap(MemoryInterface *memory, size_t threshold) :
+  memory_(memory), initial_threshold_(threshold), stats_{} {
+  stats_.threshold = threshold;
+}
+
+Heap::~Heap() {
+  Clear();
+}
+
+uint64_t Heap::Allocate(uint64_t count, const Unit *roots, const Unit *roots_end) {
+  if (count > kMaxObjectUnits) return kNoObject;
+
+  size_t bytes = sizeof(HeapObject) + count * sizeof(Unit);
+  if (stats_.bytes + bytes > stats_.threshold) {
+    Collect(roots, roots_end);
+  }
+
+  // zeroed units read as Int 0
+  auto object = static_cast<HeapObject *>(memory_->Alloc(1, bytes));
+  if (object == nullptr) return kNoObject;
+
+  object->size = count;
+  object->marked = 0;
+
+  uint64_t handle;
+  if (!free_handles_.empty()) {
+    handle = free_handles_.back();
+    free_handles_.pop_back();
+    objects_[handle] = object;
+  }
+  else {
+    handle = objects_.size();
+    objects_.push_back(object);
+  }
+
+  stats_.objects += 1;
+  stats_.bytes += bytes;
+  stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.bytes);
+  return handle;
+}
+
+void Heap::Mark(const Unit &unit) {
+  auto object = Find(unit);
+  if (object != nullptr && object->marked == 0) {
+    object->marked = 1;
+    mark_stack_.push_back(object);
+  }
+}
+
+void Heap::Collect(const Unit *roots, const Unit *roots_end) {
+  auto begin = steady_clock::now();
+
+  for (auto unit = roots; unit < roots_end; unit += 1) {
+    Mark(*unit);
+  }
+
+  // explicit stack, object graphs can be deeper than the native one
+  while (!mark_stack_.empty()) {
+    auto object = mark_stack_.back();
+    mark_stack_.pop_back();
+
+    auto units = object->Units();
+    for (uint64_t idx = 0; idx < object->size; idx += 1) {
+      Mark(units[idx]);
+    }
+  }
+
+  for (uint64_t handle = 0; handle < objects_.size(); handle += 1) {
+    auto object = objects_[handle];
+    if (object == nullptr) continue;
+    if (object->marked != 0) {
+      object->marked = 0;
+      continue;
+    }
+
+    stats_.objects -= 1;
+    stats_.bytes -= sizeof(HeapObject) + object->size * sizeof(Unit);
+    stats_.freed_objects += 1;
+    memory_->Delete(object);
+    objects_[handle] = nullptr;
+    free_handles_.push_back(handle);
+  }
+
+  stats_.threshold = std::max(initial_threshold_, stats_.bytes * kHeapGrowthFactor);
+
+  duration<double, std::micro> pause = steady_clock::now() - begin;
+  stats_.collections += 1;
+  stats_.last_pause_us = pause.count();
+  stats_.max_pause_us = std::max(stats_.max_pause_us, pause.count());
+  stats_.total_pause_us += pause.count();
+}
+
+void Heap::Clear() {
+  for (auto object : objects_) {
+    if (object != nullptr) memory_->Delete(object);
+  }
+
+  objects_.clear();
+  free_handles_.clear();
+  stats_.objects = 0;
+  stats_.bytes = 0;
+  stats_.threshold = initial_threshold_;
+}
+
+void PrintHeapStats(FILE *fp, const HeapStats &stats) {
+  fprintf(fp, "Heap: %zu objects, %zu bytes live, %zu bytes peak, next collection at %zu\n",
+    stats.objects, stats.bytes, stats.peak_bytes, stats.threshold);
+  fprintf(fp, "GC: %zu collections, %zu objects freed, pause last %.1f us, max %.1f us, total %.1f us\n",
+    stats.collections, stats.freed_objects, stats.last_pause_us,
+    stats.max_pause_us, stats.total_pause_us);
+}
@@ -0,0 +1,571 @@
+#include "machine.h"
+#ifdef CANVAS_JIT
+#include <cstring>
+#include <cstddef>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// x86-64 template JIT.
+// Every Inst has a fixed machine-code stencil. Stencils are laid out
+// back to back in program order, superinstructions as the stencils of
+// their parts. The operand stack stays in memory:
+//   rbx - sp, one past the top unit
+//   r12 - stack base
+//   r13 - stack limit
+//   r14 - JitFrame
+//   r15 - far jump table, one native address per program word
+// Jump/Branch become rel32 jumps between stencils. FarJump/FarBranch
+// index the table, words inside literals have no stencil and their
+// entries leave with the target, so the interpreter goes on from there.
+
+struct JitFrame {
+  Unit *sp;
+  Unit *base;
+  Unit *limit;
+  const void *const *table;
+  uint64_t size;
+  uint64_t status;
+  OutputSink *output;
+  uint64_t pc; //far jump target on BadTarget
+};
+
+static_assert(sizeof(Unit) == 16 && offsetof(Unit, type) == 8,
+  "stencils address units as 16 bytes with the tag at +8");
+
+// byte displacements
+constexpr int8_t kTop = -16;
+constexpr int8_t kSecond = -32;
+constexpr int8_t kTag = 8;
+constexpr int8_t kFrameSp = offsetof(JitFrame, sp);
+constexpr int8_t kFrameBase = offsetof(JitFrame, base);
+constexpr int8_t kFrameLimit = offsetof(JitFrame, limit);
+constexpr int8_t kFrameTable = offsetof(JitFrame, table);
+constexpr int8_t kFrameSize = offsetof(JitFrame, size);
+constexpr int8_t kFrameStatus = offsetof(JitFrame, status);
+constexpr int8_t kFramePc = offsetof(JitFrame, pc);
+
+// labels after the program words
+enum JitLabel {
+  kLabelExit,
+  kLabelUnderflow,
+  kLabelOverflow,
+  kLabelBadTarget,
+  kLabelEpilogue,
+  kLabelCount
+};
+
+constexpr size_t kNoOffset = SIZE_MAX;
+
+class JitAssembler {
+  protected:
+  vector<uint8_t> buf_;
+  vector<pair<size_t, size_t>> fixups_; //rel32 position, label
+  vector<size_t> labels_; //native offset per label
+  size_t words_;
+  bool checked_;
+  bool verified_;
+
+  public:
+  JitAssembler(size_t words, bool checked, bool verified) :
+    labels_(words + kLabelCount, kNoOffset), words_(words), 
+    checked_(checked), verified_(verified) {}
+
+  bool Verified() const { return verified_; }
+  size_t Offset() const { return buf_.size(); }
+  vector<uint8_t> &Buffer() { return buf_; }
+  size_t LabelOffset(size_t label) const { return labels_[label]; }
+  size_t SpecialLabel(JitLabel label) const { return words_ + label; }
+  // jumps past the end exit like falling off it
+  size_t WordLabel(size_t pc) const { return pc < words_ ? pc : SpecialLabel(kLabelExit); }
+  void Bind(size_t label) { labels_[label] = buf_.size(); }
+
+  void Bytes(std::initializer_list<uint8_t> bytes) {
+    buf_.insert(buf_.end(), bytes.begin(), bytes.end());
+  }
+
+  void Imm32(uint32_t value) {
+    for (int idx = 0; idx < 4; idx += 1) {
+      buf_.push_back(uint8_t(value >> (idx * 8)));
+    }
+  }
+
+  void Imm64(uint64_t value) {
+    Imm32(uint32_t(value));
+    Imm32(uint32_t(value >> 32));
+  }
+
+  // rel32 to a label, resolved by Link()
+  void Rel32(size_t label) {
+    fixups_.emplace_back(buf_.size(), label);
+    Imm32(0);
+  }
+
+  void JumpTo(size_t label) { Bytes({ 0xE9 }); Rel32(label); }
+  void JumpIf(uint8_t cc, size_t label) { Bytes({ 0x0F, uint8_t(0x80 | cc) }); Rel32(label); }
+
+  // false if a jump lands on a word without a stencil
+  bool Link() {
+    for (auto &fixup : fixups_) {
+      auto target = labels_[fixup.second];
+      if (target == kNoOffset) return false;
+      auto rel = int32_t(int64_t(target) - int64_t(fixup.first + 4));
+      memcpy(buf_.data() + fixup.first, &rel, sizeof(rel));
+    }
+
+    return true;
+  }
+
+  // mov rax/rcx, [rbx + disp]
+  void LoadRax(int8_t disp) { Bytes({ 0x48, 0x8B, 0x43, uint8_t(disp) }); }
+  void LoadRcx(int8_t disp) { Bytes({ 0x48, 0x8B, 0x4B, uint8_t(disp) }); }
+  // mov [rbx + disp], rax
+  void StoreRax(int8_t disp) { Bytes({ 0x48, 0x89, 0x43, uint8_t(disp) }); }
+  // mov dword [rbx + disp + 8], type
+  void SetTag(int8_t disp, uint32_t type) {
+    Bytes({ 0xC7, 0x43, uint8_t(disp + kTag) });
+    Imm32(type);
+  }
+
+  // add rbx, units * 16
+  void MoveSp(int32_t units) {
+    int32_t bytes = units * int32_t(sizeof(Unit));
+    if (bytes >= -128 && bytes <= 127) {
+      Bytes({ 0x48, 0x83, 0xC3, uint8_t(bytes) });
+    }
+    else {
+      Bytes({ 0x48, 0x81, 0xC3 });
+      Imm32(uint32_t(bytes));
+    }
+  }
+
+  // mov rax, value with the shortest encoding
+  void LoadRaxImm(uint64_t value) {
+    auto signed_value = static_cast<int64_t>(value);
+    if (value <= UINT32_MAX) {
+      Bytes({ 0xB8 });
+      Imm32(uint32_t(value));
+    }
+    else if (signed_value >= INT32_MIN && signed_value <= INT32_MAX) {
+      Bytes({ 0x48, 0xC7, 0xC0 });
+      Imm32(uint32_t(value));
+    }
+    else {
+      Bytes({ 0x48, 0xB8 });
+      Imm64(value);
+    }
+  }
+
+  // explicit checks, only in checked code
+  void Require(size_t units) {
+    if (!checked_ || units == 0) return;
+    // lea rax, [r12 + units * 16]; cmp rbx, rax; jb underflow
+    Bytes({ 0x49, 0x8D, 0x84, 0x24 });
+    Imm32(uint32_t(units * sizeof(Unit)));
+    Bytes({ 0x48, 0x39, 0xC3 });
+    JumpIf(0x2, SpecialLabel(kLabelUnderflow));
+  }
+
+  void Reserve(size_t units) {
+    if (!checked_ || units == 0) return;
+    // lea rax, [rbx + units * 16]; cmp rax, r13; ja overflow
+    Bytes({ 0x48, 0x8D, 0x83 });
+    Imm32(uint32_t(units * sizeof(Unit)));
+    Bytes({ 0x4C, 0x39, 0xE8 });
+    JumpIf(0x7, SpecialLabel(kLabelOverflow));
+  }
+
+  void Push(uint64_t value, uint32_t type) {
+    Reserve(1);
+    LoadRaxImm(value);
+    StoreRax(0);
+    SetTag(0, type);
+    MoveSp(1);
+  }
+
+  // target in rax
+  void FarDispatch() {
+    // cmp rax, [r14 + size]; jae exit; jmp [r15 + rax * 8]
+    Bytes({ 0x49, 0x3B, 0x46, uint8_t(kFrameSize) });
+    JumpIf(0x3, SpecialLabel(kLabelExit));
+    Bytes({ 0x41, 0xFF, 0x24, 0xC7 });
+  }
+};
+
+// dispatch sequence length of FarDispatch()
+constexpr uint8_t kFarDispatchSize = 14;
+
+static void JitPrintStackTop(Unit *sp, Unit *base, JitFrame *frame) {
+  if (sp != base) {
+    frame->output->Print(sp[-1].value, sp[-1].type);
+  }
+  else {
+    frame->output->PrintEmpty();
+  }
+}
+
+// SECOND = SECOND <op> TOP on rax, tagged as type
+static void EmitBinaryRax(JitAssembler &as, std::initializer_list<uint8_t> op, UnitType type) {
+  as.Require(2);
+  as.LoadRax(kSecond);
+  as.Bytes(op);
+  as.StoreRax(kSecond);
+  as.SetTag(kSecond, uint32_t(type));
+  as.MoveSp(-1);
+}
+
+static void EmitBinaryFP(JitAssembler &as, uint8_t op) {
+  as.Require(2);
+  // movsd xmm0, [rbx - 32]; <op>sd xmm0, [rbx - 16]; movsd [rbx - 32], xmm0
+  as.Bytes({ 0xF2, 0x0F, 0x10, 0x43, uint8_t(kSecond) });
+  as.Bytes({ 0xF2, 0x0F, op, 0x43, uint8_t(kTop) });
+  as.Bytes({ 0xF2, 0x0F, 0x11, 0x43, uint8_t(kSecond) });
+  as.SetTag(kSecond, uint32_t(UnitType::FP));
+  as.MoveSp(-1);
+}
+
+// shift/rotate group (D3/C1 /ext) on the top unit
+static void EmitShiftByStack(JitAssembler &as, uint8_t ext) {
+  as.Require(2);
+  as.LoadRcx(kTop);
+  as.MoveSp(-1);
+  as.Bytes({ 0x48, 0xD3, uint8_t(0x43 | (ext << 3)), uint8_t(kTop) });
+}
+
+static void EmitShiftByImm(JitAssembler &as, uint8_t ext, uint32_t count) {
+  as.Require(1);
+  as.Bytes({ 0x48, 0xC1, uint8_t(0x43 | (ext << 3)), uint8_t(kTop), uint8_t(count & 63) });
+}
+
+// words points at the code itself for instructions with literal words
+static void EmitStencil(JitAssembler &as, Inst inst, uint32_t args,
+  const Code *words, size_t words_size) {
+  // opcode bytes for "<op> rax, [rbx - 16]"
+#define RAX_OP(...) { 0x48, __VA_ARGS__, 0x43, uint8_t(kTop) }
+  switch (inst) {
+  case Inst::Add: EmitBinaryRax(as, RAX_OP(0x03), UnitType::Int); break;
+  case Inst::Sub: EmitBinaryRax(as, RAX_OP(0x2B), UnitType::Int); break;
+  case Inst::Mul: EmitBinaryRax(as, RAX_OP(0x0F, 0xAF), UnitType::Int); break;
+  case Inst::AddU: EmitBinaryRax(as, RAX_OP(0x03), UnitType::UInt); break;
+  case Inst::SubU: EmitBinaryRax(as, RAX_OP(0x2B), UnitType::UInt); break;
+  case Inst::MulU: EmitBinaryRax(as, RAX_OP(0x0F, 0xAF), UnitType::UInt); break;
+  case Inst::And: EmitBinaryRax(as, RAX_OP(0x23), UnitType::UInt); break;
+  case Inst::Or: EmitBinaryRax(as, RAX_OP(0x0B), UnitType::UInt); break;
+  case Inst::XOr: EmitBinaryRax(as, RAX_OP(0x33), UnitType::UInt); break;
+  // cqo; idiv qword [rbx - 16]
+  case Inst::Div: EmitBinaryRax(as, { 0x48, 0x99, 0x48, 0xF7, 0x7B, uint8_t(kTop) }, UnitType::Int); break;
+  case Inst::Mod:
+    EmitBinaryRax(as, { 0x48, 0x99, 0x48, 0xF7, 0x7B, uint8_t(kTop), 0x48, 0x89, 0xD0 }, UnitType::Int);
+    break;
+  // xor edx, edx; div qword [rbx - 16]
+  case Inst::DivU: EmitBinaryRax(as, { 0x31, 0xD2, 0x48, 0xF7, 0x73, uint8_t(kTop) }, UnitType::UInt); break;
+  case Inst::ModU:
+    EmitBinaryRax(as, { 0x31, 0xD2, 0x48, 0xF7, 0x73, uint8_t(kTop), 0x48, 0x89, 0xD0 }, UnitType::UInt);
+    break;
+  // test rax, rax; setne al; mov rcx, [rbx - 16]; test rcx, rcx; setne cl;
+  // and al, cl; movzx eax, al
+  case Inst::LogicAnd:
+    EmitBinaryRax(as, { 0x48, 0x85, 0xC0, 0x0F, 0x95, 0xC0, 0x48, 0x8B, 0x4B, uint8_t(kTop),
+      0x48, 0x85, 0xC9, 0x0F, 0x95, 0xC1, 0x20, 0xC8, 0x0F, 0xB6, 0xC0 }, UnitType::UInt);
+    break;
+  // or rax, [rbx - 16]; setne al; movzx eax, al
+  case Inst::LogicOr:
+    EmitBinaryRax(as, { 0x48, 0x0B, 0x43, uint8_t(kTop), 0x0F, 0x95, 0xC0, 0x0F, 0xB6, 0xC0 },
+      UnitType::UInt);
+    break;
+  case Inst::AddF: EmitBinaryFP(as, 0x58); break;
+  case Inst::SubF: EmitBinaryFP(as, 0x5C); break;
+  case Inst::MulF: EmitBinaryFP(as, 0x59); break;
+  case Inst::DivF: EmitBinaryFP(as, 0x5E); break;
+
+  case Inst::PushHalfWordImm:
+    as.Push(args, uint32_t(UnitType::UInt));
+    break;
+  case Inst::PushHalfWordImmSL16:
+    as.Push(uint64_t(args) << 16, uint32_t(UnitType::UInt));
+    break;
+  case Inst::PushWordImm:
+    if (words_size < 2) {
+      as.JumpTo(as.SpecialLabel(kLabelExit));
+    }
+    else {
+      as.Push(static_cast<UnitType>(args) == UnitType::Int ?
+        static_cast<uint64_t>(static_cast<int32_t>(words[1])) : words[1], args);
+    }
+    break;
+  case Inst::PushDoubleWordImm:
+    if (words_size < 3) {
+      as.JumpTo(as.SpecialLabel(kLabelExit));
+    }
+    else {
+      as.Push((uint64_t(words[2]) << 32) | words[1], args);
+    }
+    break;
+
+  case Inst::AddSL32:
+    EmitBinaryRax(as, RAX_OP(0x03), UnitType::UInt);
+    EmitShiftByImm(as, 4, 32);
+    break;
+  case Inst::SpawnFP:
+    as.Require(1);
+    as.SetTag(kTop, uint32_t(UnitType::FP));
+    break;
+  case Inst::SpawnSignedInt:
+    as.Require(1);
+    as.SetTag(kTop, uint32_t(UnitType::Int));
+    break;
+
+  case Inst::Jump:
+    as.JumpTo(as.WordLabel(args));
+    break;
+  case Inst::Branch:
+    // cmp rbx, r12; je skip; cmp qword [rbx - 16], 0; jne target
+    if (!as.Verified()) {
+      as.Bytes({ 0x4C, 0x39, 0xE3, 0x74, 0x0B });
+    }
+    as.Bytes({ 0x48, 0x83, 0x7B, uint8_t(kTop), 0x00 });
+    as.JumpIf(0x5, as.WordLabel(args));
+    break;
+  case Inst::FarJump:
+    as.Require(1);
+    as.LoadRax(kTop);
+    as.MoveSp(-1);
+    as.FarDispatch();
+    break;
+  case Inst::FarBranch:
+    as.Require(2);
+    as.LoadRax(kTop);
+    as.LoadRcx(kSecond);
+    as.MoveSp(-2);
+    // test rcx, rcx; je skip
+    as.Bytes({ 0x48, 0x85, 0xC9, 0x74, kFarDispatchSize });
+    as.FarDispatch();
+    break;
+
+  case Inst::Pop:
+    if (as.Verified()) {
+      as.MoveSp(-1);
+    }
+    else {
+      // lea rax, [rbx - 16]; cmp rbx, r12; cmovne rbx, rax
+      as.Bytes({ 0x48, 0x8D, 0x43, uint8_t(kTop), 0x4C, 0x39, 0xE3, 0x48, 0x0F, 0x45, 0xD8 });
+    }
+    break;
+  case Inst::PrintStackTop:
+    // mov rdi, rbx; mov rsi, r12; mov rdx, r14; call JitPrintStackTop
+    as.Bytes({ 0x48, 0x89, 0xDF, 0x4C, 0x89, 0xE6, 0x4C, 0x89, 0xF2, 0x48, 0xB8 });
+    as.Imm64(reinterpret_cast<uint64_t>(&JitPrintStackTop));
+    as.Bytes({ 0xFF, 0xD0 });
+    break;
+
+  case Inst::ShiftLeft: EmitShiftByStack(as, 4); break;
+  case Inst::LogicShiftRight: EmitShiftByStack(as, 5); break;
+  case Inst::ArithShiftRight: EmitShiftByStack(as, 7); break;
+  case Inst::ShiftLeftImm: EmitShiftByImm(as, 4, args); break;
+  case Inst::LogicShiftRightImm: EmitShiftByImm(as, 5, args); break;
+  case Inst::ArithShiftRightImm: EmitShiftByImm(as, 7, args); break;
+  case Inst::RotateLeft:
+    EmitShiftByStack(as, 0);
+    as.SetTag(kTop, uint32_t(UnitType::UInt));
+    break;
+  case Inst::RotateRight:
+    EmitShiftByStack(as, 1);
+    as.SetTag(kTop, uint32_t(UnitType::UInt));
+    break;
+  case Inst::RotateLeftImm:
+    EmitShiftByImm(as, 0, args);
+    as.SetTag(kTop, uint32_t(UnitType::UInt));
+    break;
+  case Inst::RotateRightImm:
+    EmitShiftByImm(as, 1, args);
+    as.SetTag(kTop, uint32_t(UnitType::UInt));
+    break;
+  case Inst::Not:
+    as.Require(1);
+    // not qword [rbx - 16]
+    as.Bytes({ 0x48, 0xF7, 0x53, uint8_t(kTop) });
+    as.SetTag(kTop, uint32_t(UnitType::UInt));
+    break;
+  case Inst::LogicNot:
+    as.Require(1);
+    // cmp qword [rbx - 16], 0; sete al; movzx eax, al
+    as.Bytes({ 0x48, 0x83, 0x7B, uint8_t(kTop), 0x00, 0x0F, 0x94, 0xC0, 0x0F, 0xB6, 0xC0 });
+    as.StoreRax(kTop);
+    as.SetTag(kTop, uint32_t(UnitType::UInt));
+    break;
+
+  case Inst::SwapTop:
+    as.Require(2);
+    // movdqu xmm0, [rbx - 32]; movdqu xmm1, [rbx - 16]
+    // movdqu [rbx - 32], xmm1; movdqu [rbx - 16], xmm0
+    as.Bytes({ 0xF3, 0x0F, 0x6F, 0x43, uint8_t(kSecond), 0xF3, 0x0F, 0x6F, 0x4B, uint8_t(kTop) });
+    as.Bytes({ 0xF3, 0x0F, 0x7F, 0x4B, uint8_t(kSecond), 0xF3, 0x0F, 0x7F, 0x43, uint8_t(kTop) });
+    break;
+  case Inst::Dup:
+    as.Require(1);
+    as.Reserve(1);
+    // movdqu xmm0, [rbx - 16]; movdqu [rbx], xmm0
+    as.Bytes({ 0xF3, 0x0F, 0x6F, 0x43, uint8_t(kTop), 0xF3, 0x0F, 0x7F, 0x43, 0x00 });
+    as.MoveSp(1);
+    break;
+  case Inst::DupN:
+    as.Require(1);
+    as.Reserve(args);
+    if (args != 0) {
+      // movdqu xmm0, [rbx - 16]; mov ecx, args
+      as.Bytes({ 0xF3, 0x0F, 0x6F, 0x43, uint8_t(kTop), 0xB9 });
+      as.Imm32(args);
+      // loop: movdqu [rbx], xmm0; add rbx, 16; dec ecx; jne loop
+      as.Bytes({ 0xF3, 0x0F, 0x7F, 0x43, 0x00, 0x48, 0x83, 0xC3, 0x10, 0xFF, 0xC9, 0x75, 0xF3 });
+    }
+    break;
+
+  case Inst::Doze:
+  default:
+    break;
+  }
+#undef RAX_OP
+}
+
+JitCode::~JitCode() {
+  if (code_ != nullptr) {
+    munmap(code_, code_size_);
+  }
+}
+
+bool JitCode::Compile(ProgramView prog, bool checked, bool verified) {
+  auto prog_size = prog.size();
+  JitAssembler as(prog_size, checked, verified);
+
+  // superinstruction parts by opcode
+  vector<const SuperInst *> supers(0x80, nullptr);
+  for (auto &super : kSuperInsts) {
+    supers[size_t(super.inst)] = &super;
+  }
+
+  // push rbx, r12-r15 keeps rsp 16-byte aligned for helper calls
+  as.Bytes({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });
+  // mov r14, rdi
+  as.Bytes({ 0x49, 0x89, 0xFE });
+  // mov rbx/r12/r13/r15, [r14 + field]
+  as.Bytes({ 0x49, 0x8B, 0x5E, uint8_t(kFrameSp) });
+  as.Bytes({ 0x4D, 0x8B, 0x66, uint8_t(kFrameBase) });
+  as.Bytes({ 0x4D, 0x8B, 0x6E, uint8_t(kFrameLimit) });
+  as.Bytes({ 0x4D, 0x8B, 0x7E, uint8_t(kFrameTable) });
+
+  for (size_t pc = 0; pc < prog_size;) {
+    auto inst = static_cast<Inst>(GET_INST(prog[pc]));
+    auto args = GET_ARGS(prog[pc]);
+    // the heap stays with the interpreters
+    if (IsHeapInst(inst)) return false;
+    as.Bind(pc);
+
+    if (supers[size_t(inst)] != nullptr) {
+      auto super = supers[size_t(inst)];
+      for (size_t idx = 0; idx < super->count; idx += 1) {
+        EmitStencil(as, super->parts[idx], args, nullptr, 1);
+      }
+    }
+    else {
+      EmitStencil(as, inst, args, &prog[pc], prog_size - pc);
+    }
+
+    pc += GetInstLength(inst);
+  }
+
+#define EMIT_EXIT_STUB(_label, _status)                                     \
+  as.Bind(as.SpecialLabel(_label));                                         \
+  as.Bytes({ 0x49, 0xC7, 0x46, uint8_t(kFrameStatus) });                    \
+  as.Imm32(uint32_t(_status));                                              \
+  as.JumpTo(as.SpecialLabel(kLabelEpilogue));
+
+  EMIT_EXIT_STUB(kLabelExit, JitStatus::Finished);
+  EMIT_EXIT_STUB(kLabelUnderflow, JitStatus::Underflow);
+  EMIT_EXIT_STUB(kLabelOverflow, JitStatus::Overflow);
+  // the table was indexed with the target in rax, mov [r14 + pc], rax
+  as.Bind(as.SpecialLabel(kLabelBadTarget));
+  as.Bytes({ 0x49, 0x89, 0x46, uint8_t(kFramePc) });
+  as.Bytes({ 0x49, 0xC7, 0x46, uint8_t(kFrameStatus) });
+  as.Imm32(uint32_t(JitStatus::BadTarget));
+  as.JumpTo(as.SpecialLabel(kLabelEpilogue));
+#undef EMIT_EXIT_STUB
+
+  as.Bind(as.SpecialLabel(kLabelEpilogue));
+  // mov [r14 + sp], rbx; pop r15-r12, rbx; ret
+  as.Bytes({ 0x49, 0x89, 0x5E, uint8_t(kFrameSp) });
+  as.Bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+
+  if (!as.Link()) {
+    return false;
+  }
+
+  auto &buf = as.Buffer();
+  size_t page = sysconf(_SC_PAGESIZE);
+  code_size_ = (buf.size() + page - 1) / page * page;
+  code_ = mmap(nullptr, code_size_, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (code_ == MAP_FAILED) {
+    code_ = nullptr;
+    return false;
+  }
+
+  memcpy(code_, buf.data(), buf.size());
+  if (mprotect(code_, code_size_, PROT_READ | PROT_EXEC) != 0) {
+    return false;
+  }
+
+  auto native = static_cast<const uint8_t *>(code_);
+  table_.resize(prog_size);
+  for (size_t idx = 0; idx < prog_size; idx += 1) {
+    auto offset = as.LabelOffset(idx);
+    table_[idx] = native + (offset != kNoOffset ? offset :
+      as.LabelOffset(as.SpecialLabel(kLabelBadTarget)));
+  }
+
+  return true;
+}
+
+JitStatus JitCode::Run(Unit *&sp, uint64_t &pc, Unit *base, Unit *limit,
+  OutputSink *output) {
+  JitFrame frame{ sp, base, limit, table_.data(), table_.size(), 0, output, 0 };
+  reinterpret_cast<void (*)(JitFrame *)>(code_)(&frame);
+  sp = frame.sp;
+  pc = frame.pc;
+  return static_cast<JitStatus>(frame.status);
+}
+
+bool Machine::RunJit(ProgramView prog, JitCode &jit, RunStatus &status) {
+  bool result = true;
+  status = RunStatus::Finished;
+
+  //reset state
+  pc_ = 0;
+  stack_.Clear();
+
+  Unit *sp = stack_.Base();
+  uint64_t target = 0;
+  switch (jit.Run(sp, target, stack_.Base(), stack_.Limit(), output_)) {
+  case JitStatus::Finished:
+    break;
+  case JitStatus::Underflow:
+    output_->Message("(!)Stack underflow");
+    status = RunStatus::Error;
+    break;
+  case JitStatus::Overflow:
+    output_->Message("(!)Stack overflow");
+    status = RunStatus::Error;
+    break;
+  case JitStatus::BadTarget:
+    // the interpreters decode the literal word as code, leave it to them
+    result = false;
+    break;
+  }
+
+  pc_ = result ? prog.size() : target;
+  stack_.SetTop(sp);
+  output_->Flush();
+
+  return result;
+}
+#endif
@@ -0,0 +1,229 @@
+// Output path of PrintStackTop, included by machine.h after Unit.
+// Do not include directly.
+//
+// Values are formatted by hand into one reusable buffer, which goes out
+// with a single fwrite once it is nearly full and whenever an engine
+// returns. Text mode writes exactly the lines PrintValue() would.
+
+enum class OutputMode {
+  Text, //"Int: -1" lines, like printf
+  Binary, //one 9 byte record per print: tag byte, then the value in native order
+  Discard //only counted, for benchmarks
+};
+
+// tag of the binary record for a print on an empty stack
+constexpr uint8_t kEmptyStackTag = 0xFF;
+constexpr size_t kDefaultOutputBuffer = size_t(1) << 16;
+// longest text line, "FP: -" plus DBL_MAX in %f is 323 bytes
+constexpr size_t kMaxOutputLine = 384;
+
+inline char *FormatUInt(char *dest, uint64_t value) {
+  static const char kDigitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char digits[20];
+  char *pos = digits + 20;
+
+  while (value >= 100) {
+    auto pair = (value % 100) * 2;
+    value /= 100;
+    pos -= 2;
+    pos[0] = kDigitPairs[pair];
+    pos[1] = kDigitPairs[pair + 1];
+  }
+  if (value >= 10) {
+    pos -= 2;
+    pos[0] = kDigitPairs[value * 2];
+    pos[1] = kDigitPairs[value * 2 + 1];
+  }
+  else {
+    pos -= 1;
+    pos[0] = char('0' + value);
+  }
+
+  size_t length = digits + 20 - pos;
+  memcpy(dest, pos, length);
+  return dest + length;
+}
+
+inline char *FormatInt(char *dest, int64_t value) {
+  if (value < 0) {
+    *dest++ = '-';
+    return FormatUInt(dest, 0 - static_cast<uint64_t>(value));
+  }
+
+  return FormatUInt(dest, static_cast<uint64_t>(value));
+}
+
+// %f, six decimals rounded half to even on the exact binary value like
+// glibc does. Magnitudes from 2^63 up, inf and nan go through snprintf,
+// so does everything without a 128-bit integer type.
+inline char *FormatFixed(char *dest, double value) {
+#ifdef __SIZEOF_INT128__
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int exponent = int((bits >> 52) & 0x7FF);
+  uint64_t mantissa = bits & ((uint64_t(1) << 52) - 1);
+
+  if (exponent < 1023 + 63) {
+    if (bits >> 63) *dest++ = '-';
+
+    // |value| = mantissa / 2^shift
+    if (exponent != 0) mantissa |= uint64_t(1) << 52;
+    int shift = 1075 - (exponent != 0 ? exponent : 1);
+
+    uint64_t whole = 0;
+    uint64_t micros = 0;
+    if (shift <= 0) {
+      whole = mantissa << -shift;
+    }
+    else {
+      using Wide = unsigned __int128;
+      whole = shift < 64 ? mantissa >> shift : 0;
+      // fraction * 10^6 fits 128 bits, anything below 2^-128 rounds to 0
+      Wide fraction = shift < 64 ? mantissa & ((uint64_t(1) << shift) - 1) : mantissa;
+      Wide scaled = fraction * 1000000u;
+      if (shift < 128) {
+        micros = uint64_t(scaled >> shift);
+        auto rest = scaled - (Wide(micros) << shift);
+        auto half = Wide(1) << (shift - 1);
+        if (rest > half || (rest == half && (micros & 1) != 0)) {
+          micros += 1;
+        }
+      }
+
+      if (micros == 1000000) {
+        whole += 1;
+        micros = 0;
+      }
+    }
+
+    dest = FormatUInt(dest, whole);
+    *dest++ = '.';
+    for (int idx = 5; idx >= 0; idx -= 1) {
+      dest[idx] = char('0' + micros % 10);
+      micros /= 10;
+    }
+    return dest + 6;
+  }
+#endif
+
+  return dest + snprintf(dest, kMaxOutputLine, "%f", value);
+}
+
+// Where PrintStackTop output and run-time errors go.
+// The buffer is allocated on the first print, so idle machines cost
+// nothing. Not thread-safe: give every thread its own sink and they
+// still never split a line, every fwrite ends on a line or record.
+class OutputSink {
+  protected:
+  FILE *fp_;
+  OutputMode mode_;
+  vector<char> buffer_;
+  size_t used_;
+  size_t capacity_;
+  uint64_t count_; //prints, empty stack included
+
+  // room for one line or record
+  char *Reserve() {
+    if (capacity_ - used_ < kMaxOutputLine) Flush();
+    if (buffer_.empty()) buffer_.resize(capacity_);
+    return buffer_.data() + used_;
+  }
+
+  void PutRecord(uint8_t tag, uint64_t value) {
+    auto dest = Reserve();
+    dest[0] = char(tag);
+    memcpy(dest + 1, &value, sizeof(value));
+    used_ += 1 + sizeof(value);
+  }
+
+  public:
+  OutputSink(FILE *fp = stdout, OutputMode mode = OutputMode::Text,
+    size_t capacity = kDefaultOutputBuffer) :
+    fp_(fp), mode_(mode), used_(0),
+    capacity_(capacity > 2 * kMaxOutputLine ? capacity : 2 * kMaxOutputLine), count_(0) {}
+  ~OutputSink() { Flush(); }
+  OutputSink(const OutputSink &) = delete;
+  OutputSink &operator=(const OutputSink &) = delete;
+
+  void Print(UnitValue value, UnitType type) {
+    count_ += 1;
+    if (mode_ == OutputMode::Discard) return;
+    if (mode_ == OutputMode::Binary) {
+      PutRecord(uint8_t(type), value.uinteger);
+      return;
+    }
+
+    auto begin = Reserve();
+    auto dest = begin;
+    switch (type) {
+    case UnitType::Int:
+      memcpy(dest, "Int: ", 5);
+      dest = FormatInt(dest + 5, value.integer);
+      break;
+    case UnitType::UInt:
+      memcpy(dest, "UInt: ", 6);
+      dest = FormatUInt(dest + 6, value.uinteger);
+      break;
+    case UnitType::FP:
+      memcpy(dest, "FP: ", 4);
+      dest = FormatFixed(dest + 4, value.fp);
+      break;
+    case UnitType::Ptr:
+      memcpy(dest, "Ptr: #", 6);
+      dest = FormatUInt(dest + 6, value.uinteger);
+      break;
+    default:
+      //no line at all, like PrintValue()
+      return;
+    }
+    *dest++ = '\n';
+    used_ += dest - begin;
+  }
+
+  void PrintEmpty() {
+    count_ += 1;
+    if (mode_ == OutputMode::Discard) return;
+    if (mode_ == OutputMode::Binary) {
+      PutRecord(kEmptyStackTag, 0);
+      return;
+    }
+
+    Message("(!)Empty stack");
+  }
+
+  // A line of diagnostics, in order with the values in text mode,
+  // on stderr otherwise.
+  void Message(const char *str) {
+    if (mode_ != OutputMode::Text) {
+      fprintf(stderr, "%s\n", str);
+      return;
+    }
+
+    auto length = strlen(str);
+    if (length + 1 > kMaxOutputLine) {
+      Flush();
+      fprintf(fp_, "%s\n", str);
+      return;
+    }
+
+    auto dest = Reserve();
+    memcpy(dest, str, length);
+    dest[length] = '\n';
+    used_ += length + 1;
+  }
+
+  void Flush() {
+    if (used_ != 0) {
+      fwrite(buffer_.data(), 1, used_, fp_);
+      used_ = 0;
+    }
+  }
+
+  OutputMode GetMode() const { return mode_; }
+  uint64_t GetCount() const { return count_; }
+};
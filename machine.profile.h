@@ -0,0 +1,133 @@
+// Opcode profiler, included by machine.h after Inst. Do not include
+// directly.
+//
+// Engines are instantiated with and without EngineConfig::profile, the
+// profiling variants only in builds with CANVAS_PROFILE defined, so
+// other builds do not even contain them. A profiled run counts every
+// dispatch per pc and how often each branch was taken. It also times one
+// instruction, dispatch included, every 32 to 95 dispatches: the
+// interval is jittered so no loop gets sampled at the same pc only.
+// Estimated time of a pc is its mean sample times its count.
+
+// time stamp counter ticks where there is one, nanoseconds elsewhere
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+inline uint64_t ReadProfileTicks() { return __builtin_ia32_rdtsc(); }
+constexpr const char *kProfileTickUnit = "tsc ticks";
+#else
+#include <ctime>
+inline uint64_t ReadProfileTicks() {
+  timespec now;
+  timespec_get(&now, TIME_UTC);
+  return uint64_t(now.tv_sec) * 1000000000u + uint64_t(now.tv_nsec);
+}
+constexpr const char *kProfileTickUnit = "ns";
+#endif
+
+// Branch and FarBranch, also as the last part of a superinstruction
+constexpr bool kBranchInsts[] = {
+#define DEF_INST(_id, _str) Inst::_id == Inst::Branch || Inst::_id == Inst::FarBranch,
+#define DEF_SUPER_INST2(_id, _str, _a, _b) \
+  Inst::_b == Inst::Branch || Inst::_b == Inst::FarBranch,
+#define DEF_SUPER_INST3(_id, _str, _a, _b, _c) \
+  Inst::_c == Inst::Branch || Inst::_c == Inst::FarBranch,
+#include "instruction.h"
+};
+
+struct ProfileSite {
+  uint64_t count; //dispatches
+  uint64_t taken; //of a branch
+  uint64_t samples;
+  uint64_t ticks; //of the samples, read overhead taken off
+};
+
+// Counts of the runs since the last Start()/Run() of a machine.
+class ExecutionProfile {
+  protected:
+  enum : uint8_t { kSamplePending = 1, kBranchPending = 2 };
+
+  vector<ProfileSite> sites_; //per pc
+  uint8_t pending_;
+  uint32_t countdown_; //dispatches to the next sample
+  uint32_t jitter_;
+  uint64_t sample_pc_;
+  uint64_t sample_start_;
+  uint64_t branch_pc_;
+  uint64_t read_overhead_; //of two back to back reads
+
+  // ends the sample and the branch of the previous dispatch
+  void Settle(uint64_t pc) {
+    if (pending_ & kSamplePending) {
+      auto ticks = ReadProfileTicks() - sample_start_;
+      auto &site = sites_[sample_pc_];
+      site.samples += 1;
+      site.ticks += ticks > read_overhead_ ? ticks - read_overhead_ : 0;
+    }
+    if (pending_ & kBranchPending) {
+      sites_[branch_pc_].taken += pc != branch_pc_ + 1;
+    }
+    pending_ = 0;
+  }
+
+  public:
+  ExecutionProfile() : pending_(0), countdown_(1), jitter_(0x9E3779B9),
+    sample_pc_(0), sample_start_(0), branch_pc_(0), read_overhead_(0) {}
+
+  // a new program, the counts start over
+  void Reset(size_t prog_size) {
+    sites_.assign(prog_size + 1, ProfileSite{ 0, 0, 0, 0 });
+    pending_ = 0;
+    countdown_ = 1;
+
+    read_overhead_ = UINT64_MAX;
+    for (int idx = 0; idx < 64; idx += 1) {
+      auto begin = ReadProfileTicks();
+      auto ticks = ReadProfileTicks() - begin;
+      read_overhead_ = ticks < read_overhead_ ? ticks : read_overhead_;
+    }
+  }
+
+  // before every dispatch of a profiled engine
+  void Step(uint64_t pc, uint8_t inst) {
+    if (pending_ != 0) {
+      Settle(pc);
+    }
+
+    sites_[pc].count += 1;
+    if (inst < std::size(kBranchInsts) && kBranchInsts[inst]) {
+      branch_pc_ = pc;
+      pending_ = kBranchPending;
+    }
+
+    countdown_ -= 1;
+    if (countdown_ == 0) {
+      jitter_ ^= jitter_ << 13;
+      jitter_ ^= jitter_ >> 17;
+      jitter_ ^= jitter_ << 5;
+      countdown_ = 32 + (jitter_ & 63);
+      sample_pc_ = pc;
+      pending_ |= kSamplePending;
+      sample_start_ = ReadProfileTicks();
+    }
+  }
+
+  // when an engine returns, a sample running into the exit is dropped
+  void Stop(uint64_t pc) {
+    pending_ &= ~kSamplePending;
+    // a branch that failed never got to decide
+    if ((pending_ & kBranchPending) && pc == branch_pc_) {
+      pending_ = 0;
+    }
+    if (pending_ != 0) {
+      Settle(pc);
+    }
+  }
+
+  const vector<ProfileSite> &GetSites() const { return sites_; }
+};
+
+// What a profile report maps pcs back to, everything optional.
+struct ProfileSource {
+  const char *path = nullptr;
+  vector<pair<uint64_t, std::string>> labels; //pc, name, sorted by pc
+  vector<pair<uint64_t, uint64_t>> lines; //first pc of a source line, line, sorted by pc
+};
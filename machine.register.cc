@@ -0,0 +1,471 @@
+#include "machine.register.h"
+#include <algorithm>
+#include <unordered_map>
+
+// Where the value of a stack slot is while translating.
+enum class SlotState : uint8_t {
+  Register, //in the slot's own register
+  Literal, //not emitted yet
+  Alias //same value as register reg, from a deferred Dup
+};
+
+struct SlotDesc {
+  SlotState state;
+  uint32_t reg;
+  Unit literal;
+};
+
+// binary stack instructions and their register op
+inline bool GetBinaryInst(Inst inst, RegisterInst &dest) {
+  switch (inst) {
+#define DEF_REG_BINARY(_id, _body) \
+  case Inst::_id: dest = RegisterInst::_id; return true;
+  REGISTER_BINARY_OPS
+#undef DEF_REG_BINARY
+  default:
+    break;
+  }
+
+  return false;
+}
+
+// x op y == y op x, bit for bit (floating point NaNs are not)
+inline bool IsCommutative(RegisterInst inst) {
+  return inst == RegisterInst::Add || inst == RegisterInst::Mul
+    || inst == RegisterInst::AddU || inst == RegisterInst::MulU
+    || inst == RegisterInst::And || inst == RegisterInst::Or
+    || inst == RegisterInst::XOr || inst == RegisterInst::LogicAnd
+    || inst == RegisterInst::LogicOr;
+}
+
+inline RegisterInst ImmForm(RegisterInst inst) {
+  return static_cast<RegisterInst>(uint8_t(inst) + 1);
+}
+
+class RegisterTranslator {
+  protected:
+  RegisterProgram &dest_;
+  vector<SlotDesc> slots_;
+  size_t first_pending_; //slots below are all in their registers
+
+  public:
+  RegisterTranslator(RegisterProgram &dest, size_t registers) :
+    dest_(dest), slots_(registers + 1), first_pending_(registers + 1) {}
+
+  size_t Emit(RegisterInst inst, size_t dst, size_t a, size_t b, Unit imm = Unit{}) {
+    dest_.ops.push_back(RegisterOp{ inst, uint32_t(dst), uint32_t(a), uint32_t(b), imm });
+    return dest_.ops.size() - 1;
+  }
+
+  SlotDesc &Slot(size_t slot) { return slots_[slot]; }
+
+  void Defer(size_t slot, const SlotDesc &desc) {
+    slots_[slot] = desc;
+    if (desc.state != SlotState::Register) {
+      first_pending_ = std::min(first_pending_, slot);
+    }
+  }
+
+  void SetRegister(size_t slot) {
+    slots_[slot].state = SlotState::Register;
+  }
+
+  // a register holding the slot's value, literals are loaded into the
+  // slot's own register
+  size_t Read(size_t slot) {
+    auto &desc = slots_[slot];
+    if (desc.state == SlotState::Alias) return desc.reg;
+    if (desc.state == SlotState::Literal) {
+      Emit(RegisterInst::Load, slot, 0, 0, desc.literal);
+      desc.state = SlotState::Register;
+    }
+
+    return slot;
+  }
+
+  void Materialize(size_t slot) {
+    auto &desc = slots_[slot];
+    if (desc.state == SlotState::Alias) {
+      Emit(RegisterInst::Move, slot, desc.reg, 0);
+      desc.state = SlotState::Register;
+    }
+    else {
+      Read(slot);
+    }
+  }
+
+  // everything below depth into its own register
+  void Flush(size_t depth) {
+    for (size_t slot = first_pending_; slot < depth; slot += 1) {
+      Materialize(slot);
+    }
+    first_pending_ = depth;
+  }
+};
+
+RegisterProgram TranslateToRegisters(ProgramView prog, const VerifyReport &verify) {
+  auto prog_size = prog.size();
+  RegisterProgram result{ {}, verify.max_depth };
+  RegisterTranslator tr(result, verify.max_depth);
+
+  vector<const SuperInst *> supers(0x80, nullptr);
+  for (auto &super : kSuperInsts) {
+    supers[size_t(super.inst)] = &super;
+  }
+
+  auto get_parts = [&](Inst inst, Inst (&parts)[3]) -> size_t {
+    if (supers[size_t(inst)] == nullptr) {
+      parts[0] = inst;
+      return 1;
+    }
+
+    std::copy_n(supers[size_t(inst)]->parts, 3, parts);
+    return supers[size_t(inst)]->count;
+  };
+
+  // jump targets need every slot in its register
+  vector<bool> targets(prog_size + 1, false);
+  for (size_t pc = 0; pc < prog_size; pc += 1) {
+    if (verify.depths[pc] == kUnreachable) continue;
+    Inst parts[3];
+    auto count = get_parts(static_cast<Inst>(GET_INST(prog[pc])), parts);
+    auto last = parts[count - 1];
+    if (last == Inst::Jump || last == Inst::Branch) {
+      targets[GET_ARGS(prog[pc])] = true;
+    }
+  }
+  for (auto &[pc, target] : verify.far_targets) {
+    targets[target] = true;
+  }
+
+  vector<size_t> labels(prog_size, 0);
+  vector<pair<size_t, size_t>> fixups; //op, stack pc
+  vector<pair<size_t, size_t>> exit_fixups; //op, depth
+
+  auto jump_to = [&](RegisterInst inst, size_t cond, size_t target, size_t depth) {
+    if (target >= prog_size && inst == RegisterInst::Jump) {
+      tr.Emit(RegisterInst::Exit, 0, 0, depth);
+      return;
+    }
+
+    auto op = tr.Emit(inst, 0, cond, 0);
+    if (target >= prog_size) {
+      exit_fixups.emplace_back(op, depth);
+    }
+    else {
+      fixups.emplace_back(op, target);
+    }
+  };
+
+  for (size_t pc = 0; pc < prog_size; pc += 1) {
+    if (verify.depths[pc] == kUnreachable) continue;
+
+    size_t depth = verify.depths[pc];
+    if (targets[pc]) {
+      tr.Flush(depth);
+      labels[pc] = result.ops.size();
+    }
+
+    auto inst = static_cast<Inst>(GET_INST(prog[pc]));
+    auto args = GET_ARGS(prog[pc]);
+    Inst parts[3];
+    auto part_count = get_parts(inst, parts);
+
+    bool falls_through = true;
+    for (size_t idx = 0; idx < part_count; idx += 1) {
+      auto part = parts[idx];
+      size_t top = depth - 1;
+      RegisterInst binary;
+
+      if (GetBinaryInst(part, binary)) {
+        auto &x = tr.Slot(top - 1);
+        auto &y = tr.Slot(top);
+        if (y.state == SlotState::Literal) {
+          auto literal = y.literal;
+          tr.Emit(ImmForm(binary), top - 1, tr.Read(top - 1), 0, literal);
+        }
+        else if (x.state == SlotState::Literal && IsCommutative(binary)) {
+          auto literal = x.literal;
+          tr.Emit(ImmForm(binary), top - 1, tr.Read(top), 0, literal);
+        }
+        else {
+          auto a = tr.Read(top - 1);
+          tr.Emit(binary, top - 1, a, tr.Read(top));
+        }
+
+        tr.SetRegister(top - 1);
+        depth -= 1;
+        continue;
+      }
+
+      switch (part) {
+      case Inst::PushHalfWordImm:
+      case Inst::PushHalfWordImmSL16:
+      case Inst::PushWordImm:
+      case Inst::PushDoubleWordImm: {
+        Unit literal;
+        literal.type = UnitType::UInt;
+        if (part == Inst::PushHalfWordImm) {
+          UINTVAL(literal) = args;
+        }
+        else if (part == Inst::PushHalfWordImmSL16) {
+          UINTVAL(literal) = uint64_t(args) << 16;
+        }
+        else if (part == Inst::PushWordImm) {
+          literal.type = static_cast<UnitType>(args);
+          UINTVAL(literal) = literal.type == UnitType::Int ?
+            static_cast<uint64_t>(static_cast<int32_t>(prog[pc + 1])) : prog[pc + 1];
+        }
+        else {
+          literal.type = static_cast<UnitType>(args);
+          UINTVAL(literal) = (uint64_t(prog[pc + 2]) << 32) | prog[pc + 1];
+        }
+
+        tr.Defer(depth, SlotDesc{ SlotState::Literal, 0, literal });
+        depth += 1;
+        break;
+      }
+
+      case Inst::ShiftLeftImm:
+      case Inst::LogicShiftRightImm:
+      case Inst::ArithShiftRightImm:
+      case Inst::RotateLeftImm:
+      case Inst::RotateRightImm: {
+        auto base_inst = part == Inst::ShiftLeftImm ? RegisterInst::ShiftLeft
+          : part == Inst::LogicShiftRightImm ? RegisterInst::LogicShiftRight
+          : part == Inst::ArithShiftRightImm ? RegisterInst::ArithShiftRight
+          : part == Inst::RotateLeftImm ? RegisterInst::RotateLeft
+          : RegisterInst::RotateRight;
+        tr.Emit(ImmForm(base_inst), top, tr.Read(top), 0, Unit{ { args }, UnitType::UInt });
+        tr.SetRegister(top);
+        break;
+      }
+
+      case Inst::Not:
+      case Inst::LogicNot:
+        tr.Emit(part == Inst::Not ? RegisterInst::Not : RegisterInst::LogicNot,
+          top, tr.Read(top), 0);
+        tr.SetRegister(top);
+        break;
+
+      case Inst::SpawnFP:
+      case Inst::SpawnSignedInt: {
+        auto type = part == Inst::SpawnFP ? UnitType::FP : UnitType::Int;
+        auto &desc = tr.Slot(top);
+        if (desc.state == SlotState::Literal) {
+          desc.literal.type = type;
+        }
+        else {
+          tr.Emit(RegisterInst::Retag, top, tr.Read(top), 0, Unit{ {}, type });
+          tr.SetRegister(top);
+        }
+        break;
+      }
+
+      case Inst::Pop:
+        depth -= 1;
+        break;
+
+      case Inst::Dup: {
+        auto desc = tr.Slot(top);
+        if (desc.state == SlotState::Register) {
+          desc = SlotDesc{ SlotState::Alias, uint32_t(top), {} };
+        }
+        tr.Defer(depth, desc);
+        depth += 1;
+        break;
+      }
+
+      case Inst::DupN:
+        if (args != 0) {
+          tr.Emit(RegisterInst::DupN, depth, tr.Read(top), args);
+          for (size_t slot = depth; slot < depth + args; slot += 1) {
+            tr.SetRegister(slot);
+          }
+          depth += args;
+        }
+        break;
+
+      case Inst::SwapTop: {
+        auto x = tr.Slot(top - 1);
+        auto y = tr.Slot(top);
+        // nothing can alias a slot that is not in its own register
+        if (x.state != SlotState::Register && y.state != SlotState::Register) {
+          tr.Defer(top - 1, y);
+          tr.Defer(top, x);
+        }
+        else {
+          tr.Materialize(top - 1);
+          tr.Materialize(top);
+          tr.Emit(RegisterInst::Swap, 0, top - 1, top);
+        }
+        break;
+      }
+
+      case Inst::PrintStackTop:
+        tr.Emit(RegisterInst::Print, 0, tr.Read(top), 0);
+        break;
+
+      case Inst::Jump:
+        tr.Flush(depth);
+        jump_to(RegisterInst::Jump, 0, args, depth);
+        falls_through = false;
+        break;
+
+      case Inst::Branch:
+        tr.Flush(depth);
+        jump_to(RegisterInst::Branch, top, args, depth);
+        break;
+
+      case Inst::FarJump:
+        depth -= 1;
+        tr.Flush(depth);
+        jump_to(RegisterInst::Jump, 0, verify.far_targets.at(pc), depth);
+        falls_through = false;
+        break;
+
+      case Inst::FarBranch: {
+        auto cond = tr.Read(top - 1);
+        depth -= 2;
+        tr.Flush(depth);
+        jump_to(RegisterInst::Branch, cond, verify.far_targets.at(pc), depth);
+        break;
+      }
+
+      default:
+        //Doze
+        break;
+      }
+    }
+
+    if (falls_through && pc + GetInstLength(inst) >= prog_size) {
+      tr.Flush(depth);
+      tr.Emit(RegisterInst::Exit, 0, 0, depth);
+    }
+  }
+
+  for (auto &[op, target] : fixups) {
+    result.ops[op].b = uint32_t(labels[target]);
+  }
+
+  // one exit per final depth for branches off the end
+  std::unordered_map<size_t, size_t> exits;
+  for (auto &[op, depth] : exit_fixups) {
+    auto it = exits.find(depth);
+    if (it == exits.end()) {
+      it = exits.emplace(depth, tr.Emit(RegisterInst::Exit, 0, 0, depth)).first;
+    }
+    result.ops[op].b = uint32_t(it->second);
+  }
+
+  return result;
+}
+
+#ifdef CANVAS_THREADED_DISPATCH
+// Token-threaded, one indirect branch per register op.
+bool Machine::RunRegister(const RegisterProgram &prog) {
+  //reset state
+  pc_ = 0;
+  stack_.Clear();
+
+  static const void *handlers[] = {
+#define DEF_REG_BINARY(_id, _body) &&L_##_id, &&L_##_id##Imm,
+    REGISTER_BINARY_OPS
+#undef DEF_REG_BINARY
+    &&L_Not, &&L_LogicNot, &&L_Retag, &&L_Load, &&L_Move, &&L_Swap,
+    &&L_DupN, &&L_Branch, &&L_Jump, &&L_Print, &&L_Exit
+  };
+
+  if (prog.ops.empty()) {
+    return true;
+  }
+
+  Unit *regs = stack_.Base();
+  auto ops = prog.ops.data();
+  auto op = ops;
+
+#define R(_idx) regs[_idx]
+#define DISPATCH() goto *handlers[size_t(op->inst)]
+#define NEXT() { op += 1; DISPATCH(); }
+
+  DISPATCH();
+
+#define DEF_REG_BINARY(_id, _body)                    \
+  L_##_id: {                                          \
+    const Unit &x = R(op->a);                         \
+    const Unit &y = R(op->b);                         \
+    Unit result = x;                                  \
+    _body                                             \
+    R(op->dst) = result;                              \
+  }                                                   \
+  NEXT();                                             \
+  L_##_id##Imm: {                                     \
+    const Unit &x = R(op->a);                         \
+    const Unit &y = op->imm;                          \
+    Unit result = x;                                  \
+    _body                                             \
+    R(op->dst) = result;                              \
+  }                                                   \
+  NEXT();
+  REGISTER_BINARY_OPS
+#undef DEF_REG_BINARY
+
+L_Not:
+  UINTVAL(R(op->dst)) = ~UINTVAL(R(op->a));
+  R(op->dst).type = UnitType::UInt;
+  NEXT();
+
+L_LogicNot:
+  UINTVAL(R(op->dst)) = !UINTVAL(R(op->a));
+  R(op->dst).type = UnitType::UInt;
+  NEXT();
+
+L_Retag:
+  UINTVAL(R(op->dst)) = UINTVAL(R(op->a));
+  R(op->dst).type = op->imm.type;
+  NEXT();
+
+L_Load:
+  R(op->dst) = op->imm;
+  NEXT();
+
+L_Move:
+  R(op->dst) = R(op->a);
+  NEXT();
+
+L_Swap:
+  std::swap(R(op->a), R(op->b));
+  NEXT();
+
+L_DupN:
+  for (size_t idx = 0; idx < op->b; idx += 1) {
+    R(op->dst + idx) = R(op->a);
+  }
+  NEXT();
+
+L_Branch:
+  if (UINTVAL(R(op->a)) != 0ull) {
+    op = ops + op->b;
+    DISPATCH();
+  }
+  NEXT();
+
+L_Jump:
+  op = ops + op->b;
+  DISPATCH();
+
+L_Print:
+  output_->Print(R(op->a).value, R(op->a).type);
+  NEXT();
+
+L_Exit:
+  stack_.SetTop(regs + op->b);
+  output_->Flush();
+
+#undef R
+#undef DISPATCH
+#undef NEXT
+
+  return true;
+}
+#endif
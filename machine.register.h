@@ -0,0 +1,91 @@
+#pragma once
+#include "machine.h"
+#include "verifier.h"
+#include <bit>
+
+// Register tier.
+// A verified program has one stack depth per pc, so stack slot n can
+// live in virtual register n for the whole run. TranslateToRegisters()
+// turns every stack instruction into three-address ops over those
+// registers, and defers literals and Dup copies until something needs
+// them in a register:
+//   pushhwi 1; pushhwi 2; add  ->  load r0, 1; add.imm r0, r0, 2
+//   dup; pushhwi 1; subu       ->  subu.imm r1, r0, 1
+// Pop, Doze and swaps of deferred slots emit nothing. Every deferred
+// slot is written out before jumps, branches and jump targets, so
+// registers hold the whole stack at each block boundary.
+// Registers are the machine's OperandStack units, the final stack is
+// exactly what the stack engines leave.
+
+// DEF_REG_BINARY(_id, _body): result = x op y, where result starts as a
+// copy of x. Each op comes in a register form (y = register b) and an
+// _id##Imm form (y = the literal).
+#define REG_ARITH(_val, _type, _op)     \
+  _val(result) = _val(x) _op _val(y);   \
+  result.type = UnitType::_type;
+
+#define REGISTER_BINARY_OPS                                             \
+  DEF_REG_BINARY(Add, REG_ARITH(INTVAL, Int, +))                        \
+  DEF_REG_BINARY(Sub, REG_ARITH(INTVAL, Int, -))                        \
+  DEF_REG_BINARY(Mul, REG_ARITH(INTVAL, Int, *))                        \
+  DEF_REG_BINARY(Div, REG_ARITH(INTVAL, Int, /))                        \
+  DEF_REG_BINARY(Mod, REG_ARITH(INTVAL, Int, %))                        \
+  DEF_REG_BINARY(AddU, REG_ARITH(UINTVAL, UInt, +))                     \
+  DEF_REG_BINARY(SubU, REG_ARITH(UINTVAL, UInt, -))                     \
+  DEF_REG_BINARY(MulU, REG_ARITH(UINTVAL, UInt, *))                     \
+  DEF_REG_BINARY(DivU, REG_ARITH(UINTVAL, UInt, /))                     \
+  DEF_REG_BINARY(ModU, REG_ARITH(UINTVAL, UInt, %))                     \
+  DEF_REG_BINARY(AddF, REG_ARITH(FPVAL, FP, +))                         \
+  DEF_REG_BINARY(SubF, REG_ARITH(FPVAL, FP, -))                         \
+  DEF_REG_BINARY(MulF, REG_ARITH(FPVAL, FP, *))                         \
+  DEF_REG_BINARY(DivF, REG_ARITH(FPVAL, FP, /))                         \
+  DEF_REG_BINARY(AddSL32, REG_ARITH(UINTVAL, UInt, +) UINTVAL(result) <<= 32;) \
+  DEF_REG_BINARY(And, REG_ARITH(UINTVAL, UInt, &))                      \
+  DEF_REG_BINARY(Or, REG_ARITH(UINTVAL, UInt, |))                       \
+  DEF_REG_BINARY(XOr, REG_ARITH(UINTVAL, UInt, ^))                      \
+  DEF_REG_BINARY(LogicAnd, REG_ARITH(UINTVAL, UInt, &&))                \
+  DEF_REG_BINARY(LogicOr, REG_ARITH(UINTVAL, UInt, ||))                 \
+  /* shifts keep the tag of the shifted unit */                         \
+  DEF_REG_BINARY(ShiftLeft, INTVAL(result) <<= UINTVAL(y);)             \
+  DEF_REG_BINARY(LogicShiftRight, UINTVAL(result) >>= UINTVAL(y);)      \
+  DEF_REG_BINARY(ArithShiftRight, INTVAL(result) >>= UINTVAL(y);)       \
+  DEF_REG_BINARY(RotateLeft,                                            \
+    UINTVAL(result) = std::rotl(UINTVAL(x), UINTVAL(y));                \
+    result.type = UnitType::UInt;)                                      \
+  DEF_REG_BINARY(RotateRight,                                           \
+    UINTVAL(result) = std::rotr(UINTVAL(x), UINTVAL(y));                \
+    result.type = UnitType::UInt;)
+
+enum class RegisterInst : uint8_t {
+#define DEF_REG_BINARY(_id, _body) _id, _id##Imm,
+  REGISTER_BINARY_OPS
+#undef DEF_REG_BINARY
+  Not, //r[dst] = ~r[a]
+  LogicNot, //r[dst] = !r[a]
+  Retag, //r[dst] = r[a] tagged imm.type
+  Load, //r[dst] = imm
+  Move, //r[dst] = r[a]
+  Swap, //r[a] <-> r[b]
+  DupN, //r[dst .. dst + b) = r[a]
+  Branch, //to op b if r[a] is non-zero
+  Jump, //to op b
+  Print, //r[a]
+  Exit //with b registers as the final stack
+};
+
+struct RegisterOp {
+  RegisterInst inst;
+  uint32_t dst;
+  uint32_t a;
+  uint32_t b; //register, count, op index or depth, see RegisterInst
+  Unit imm;
+};
+
+struct RegisterProgram {
+  vector<RegisterOp> ops;
+  size_t registers; //the verified max_depth
+};
+
+// Only for programs that passed VerifyProgram(), unreachable code is
+// left out.
+RegisterProgram TranslateToRegisters(ProgramView prog, const VerifyReport &verify);
@@ -0,0 +1,8 @@
+# Translate a .csrc or .bc program to C++ and build it natively.
+# usage: make-aot.sh <file> [machine options], writes bin/<name>.aot
+mkdir -p bin
+case "$1" in
+  *.bc) bin/bc2c "$@" ;;
+  *) bin/vm "$1" translate "${@:2}" ;;
+esac
+g++ -o bin/$(basename "$1").aot -std=c++20 "$1.cc" -O2 -I$PWD
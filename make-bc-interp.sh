@@ -1,2 +1,3 @@
 mkdir -p bin
-g++ -o bin/bcvm -std=c++20 ./bytecode.interpreter.cc ./machine.cc -O0 -g -I$PWD
+g++ -o bin/bcvm -std=c++20 ./bytecode.interpreter.cc ./bytecode.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc -O0 -g -I$PWD
+g++ -o bin/bc2c -std=c++20 ./bytecode.translator.cc ./bytecode.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./translator.cc -O0 -g -I$PWD
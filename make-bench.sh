@@ -0,0 +1,14 @@
+mkdir -p bin
+g++ -o bin/bench -std=c++20 ./machine.benchmark.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./optimizer.cc ./memory-pool.cc -O2 -I$PWD
+# same suite, counting stack units touched in memory
+g++ -o bin/bench-traffic -std=c++20 -DCANVAS_STACK_TRAFFIC ./machine.benchmark.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./optimizer.cc ./memory-pool.cc -O2 -I$PWD
+# reference counting of memory-utils.h under thread contention
+g++ -o bin/bench-refcount -std=c++20 ./memory-utils.benchmark.cc -O2 -pthread -I$PWD
+# many machines on a work-stealing pool of threads
+g++ -o bin/bench-runner -std=c++20 ./runner.benchmark.cc ./runner.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./memory-pool.cc -O2 -pthread -I$PWD
+# RunAsync() tasks interleaved on a few threads
+g++ -o bin/bench-async -std=c++20 ./machine.async.benchmark.cc ./machine.async.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./memory-pool.cc -O2 -pthread -I$PWD
+# assembler throughput in MB/s on a generated source
+g++ -o bin/bench-asm -std=c++20 ./assembler.benchmark.cc ./assembler.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc -O2 -pthread -I$PWD
+# regression suite: kernels per dispatch mode, assembler and .bc load, as JSON
+g++ -o bin/bench-suite -std=c++20 ./suite.benchmark.cc ./assembler.cc ./bytecode.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc -O2 -pthread -I$PWD
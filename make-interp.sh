@@ -1,2 +1,3 @@
 mkdir -p bin
-g++ -o bin/vm -std=c++20 ./asm.interpreter.cc ./machine.cc -O0 -g -I$PWD
+g++ -o bin/vm -std=c++20 ./asm.interpreter.cc ./assembler.cc ./machine.differential.cc ./bytecode.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./optimizer.cc ./translator.cc -O0 -g -pthread -I$PWD
+g++ -o bin/vm-profile -std=c++20 -DCANVAS_PROFILE ./asm.interpreter.cc ./assembler.cc ./machine.differential.cc ./bytecode.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./optimizer.cc ./translator.cc -O2 -pthread -I$PWD
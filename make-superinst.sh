@@ -0,0 +1,18 @@
+# Regenerate superinstruction.h from opcode pair profiles of real programs.
+# usage: make-superinst.sh <program.csrc>...
+# Every program is run once by a -DCANVAS_PROFILE_PAIRS build of vm and
+# the pairs of all of them are ranked together. Profile workloads the VM
+# actually runs, not the bench kernels, and measure any gain on programs
+# that were not part of the profile.
+if [ $# -eq 0 ]; then
+  echo "usage: make-superinst.sh <program.csrc>..."
+  exit 1
+fi
+mkdir -p bin
+g++ -o bin/vm-pairs -std=c++20 -DCANVAS_PROFILE_PAIRS ./asm.interpreter.cc ./assembler.cc ./machine.differential.cc ./bytecode.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./optimizer.cc ./translator.cc -O2 -pthread -I$PWD
+g++ -o bin/supergen -std=c++20 ./superinstruction.generator.cc -O2 -I$PWD
+rm -f bin/pairs.profile
+for program in "$@"; do
+  bin/vm-pairs "$program" run --dispatch=switch --pair-profile=bin/pairs.profile > /dev/null
+done
+bin/supergen bin/pairs.profile > bin/superinstruction.h && mv bin/superinstruction.h superinstruction.h
@@ -0,0 +1,57 @@
+# Tests, run from the source directory, exit code 1 when any failed.
+# - every program of test/ and test/fault/ on each dispatch mode, see
+#   machine.differential.h
+# - the same with the fixed superinstruction table test/superinstruction.h
+#   at -O3, whose output must also match the unoptimized run
+# - programs of test/ translated to C++, against the interpreter
+# test/fault/far-*-literal.csrc push literal words that decode as
+# "jmp 5"/"jmp 6" (659, 787) or as "add" (0) and far jump onto them.
+# A program that runs away fails after $LIMIT seconds instead of hanging.
+mkdir -p bin/test
+VM_SOURCES="./asm.interpreter.cc ./assembler.cc ./machine.differential.cc ./bytecode.cc ./machine.cc ./machine.heap.cc ./verifier.cc ./machine.jit.cc ./machine.register.cc ./optimizer.cc ./translator.cc"
+SUPER_TABLE='-DCANVAS_SUPERINST_TABLE="test/superinstruction.h"'
+LIMIT=60
+g++ -o bin/vm-test -std=c++20 $VM_SOURCES -O2 -pthread -I$PWD || exit 1
+g++ -o bin/vm-test-super -std=c++20 "$SUPER_TABLE" $VM_SOURCES -O2 -pthread -I$PWD || exit 1
+
+status=0
+fail() {
+  echo "FAILED: $*"
+  status=1
+}
+
+# check_translation <program> <vm> [<-On> <g++ flags>], against $expected
+check_translation() {
+  local name=bin/test/$(basename $1)
+  cp $1 $name
+  local message=$(bin/$2 $name translate $3 2> /dev/null)
+  case "$message" in
+    "") ;;
+    # the generated program has no collector
+    *"heap instruction"*) return ;;
+    *) fail "$1 translate on $2: $message"; return ;;
+  esac
+  if ! g++ -o $name.aot -std=c++20 $4 $name.cc -O1 -I$PWD; then
+    fail "$1 translated on $2 does not build"
+    return
+  fi
+  [ "$expected" = "$(timeout $LIMIT $name.aot)" ] || fail "$1 translated on $2"
+}
+
+for program in test/*.csrc test/fault/*.csrc; do
+  timeout $LIMIT bin/vm-test $program difftest || fail "$program difftest"
+  timeout $LIMIT bin/vm-test-super $program difftest -O3 2> /dev/null || fail "$program difftest -O3 with test/superinstruction.h"
+done
+
+for program in test/*.csrc; do
+  # never ends
+  [ "$program" = test/jump.csrc ] && continue
+  expected=$(timeout $LIMIT bin/vm-test $program run --dispatch=switch)
+  actual=$(timeout $LIMIT bin/vm-test-super $program run -O3 2> /dev/null)
+  [ "$expected" = "$actual" ] || fail "$program -O3 with test/superinstruction.h"
+  check_translation $program vm-test
+  check_translation $program vm-test-super -O3 "$SUPER_TABLE"
+done
+
+[ $status -eq 0 ] && echo "All tests passed"
+exit $status
@@ -0,0 +1,385 @@
+#include "memory-pool.h"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+inline size_t AlignBlock(size_t value) {
+  return (value + 15) & ~size_t(15);
+}
+
+// bytes for num * size plus the header, SIZE_MAX on overflow
+inline size_t GetBlockSize(size_t num, size_t size) {
+  if (size != 0 && num > (SIZE_MAX - 2 * sizeof(MemoryBlockHeader)) / size) {
+    return SIZE_MAX;
+  }
+
+  return AlignBlock(num * size + sizeof(MemoryBlockHeader));
+}
+
+inline MemoryBlockHeader *GetHeader(void *ptr) {
+  return static_cast<MemoryBlockHeader *>(ptr) - 1;
+}
+
+void MemoryCounters::OnAlloc(size_t bytes) {
+  auto live = bytes_live_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  auto peak = bytes_peak_.load(std::memory_order_relaxed);
+  while (live > peak
+    && !bytes_peak_.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+  alloc_count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MemoryCounters::OnDelete(size_t bytes) {
+  bytes_live_.fetch_sub(bytes, std::memory_order_relaxed);
+  delete_count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MemoryCounters::OnCollect() {
+  bytes_live_.store(0, std::memory_order_relaxed);
+  collect_count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+MemoryStats MemoryCounters::Get() const {
+  return MemoryStats{
+    bytes_live_.load(std::memory_order_relaxed),
+    bytes_peak_.load(std::memory_order_relaxed),
+    alloc_count_.load(std::memory_order_relaxed),
+    delete_count_.load(std::memory_order_relaxed),
+    collect_count_.load(std::memory_order_relaxed)
+  };
+}
+
+ArenaMemoryInterface::~ArenaMemoryInterface() {
+  for (auto &chunk : chunks_) {
+    free(chunk.data);
+  }
+}
+
+MemoryBlockHeader *ArenaMemoryInterface::Take(size_t num, size_t size) {
+  auto total = GetBlockSize(num, size);
+  if (total == SIZE_MAX) return nullptr;
+
+  // the next kept chunk with room, or a new one
+  while (!chunks_.empty() && offset_ + total > chunks_[current_].size) {
+    if (current_ + 1 == chunks_.size()) {
+      current_ = chunks_.size();
+      break;
+    }
+
+    current_ += 1;
+    offset_ = 0;
+  }
+
+  if (current_ >= chunks_.size()) {
+    auto chunk_size = std::max(chunk_size_, total);
+    auto data = static_cast<uint8_t *>(malloc(chunk_size));
+    if (data == nullptr) {
+      current_ = chunks_.empty() ? 0 : chunks_.size() - 1;
+      return nullptr;
+    }
+
+    chunks_.push_back(Chunk{ data, chunk_size });
+    current_ = chunks_.size() - 1;
+    offset_ = 0;
+  }
+
+  auto header = reinterpret_cast<MemoryBlockHeader *>(chunks_[current_].data + offset_);
+  offset_ += total;
+
+  header->size = num * size;
+  header->size_class = 0;
+  counters_.OnAlloc(header->size);
+  return header;
+}
+
+void *ArenaMemoryInterface::Alloc(size_t num, size_t size) {
+  auto header = Take(num, size);
+  if (header == nullptr) return nullptr;
+  memset(header + 1, 0, header->size);
+  return header + 1;
+}
+
+void *ArenaMemoryInterface::AllocRaw(size_t num, size_t size) {
+  auto header = Take(num, size);
+  return header != nullptr ? header + 1 : nullptr;
+}
+
+void ArenaMemoryInterface::Delete(void *ptr) {
+  if (ptr == nullptr) return;
+
+  auto header = GetHeader(ptr);
+  counters_.OnDelete(header->size);
+
+  // the newest block can go back to the bump pointer
+  auto total = AlignBlock(header->size + sizeof(MemoryBlockHeader));
+  auto chunk = current_ < chunks_.size() ? chunks_[current_].data : nullptr;
+  if (chunk != nullptr && reinterpret_cast<uint8_t *>(header) + total == chunk + offset_) {
+    offset_ -= total;
+  }
+}
+
+void ArenaMemoryInterface::Collect() {
+  current_ = 0;
+  offset_ = 0;
+  counters_.OnCollect();
+}
+
+// Free blocks a thread holds for one pool.
+struct PoolThreadCache {
+  uint64_t owner = 0; //pool id, 0 for none
+  uint64_t epoch = 0;
+  void *heads[kPoolClassCount] = {};
+  size_t counts[kPoolClassCount] = {};
+
+  ~PoolThreadCache() { Detach(); }
+
+  void Drop() {
+    for (size_t idx = 0; idx < kPoolClassCount; idx += 1) {
+      heads[idx] = nullptr;
+      counts[idx] = 0;
+    }
+  }
+
+  // hand everything back, if the owner still exists
+  void Detach();
+};
+
+// Live pools by id, so a cache never touches a destroyed pool.
+struct PoolRegistry {
+  std::mutex lock;
+  std::unordered_map<uint64_t, PoolMemoryInterface *> pools;
+  uint64_t next_id = 1;
+};
+
+static PoolRegistry &GetPoolRegistry() {
+  // never destroyed, thread caches may outlive static destructors
+  static auto registry = new PoolRegistry;
+  return *registry;
+}
+
+thread_local PoolThreadCache tls_pool_cache;
+
+void PoolThreadCache::Detach() {
+  if (owner != 0) {
+    auto &registry = GetPoolRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    auto it = registry.pools.find(owner);
+    if (it != registry.pools.end()) {
+      auto pool = it->second;
+      if (pool->epoch_.load(std::memory_order_acquire) == epoch) {
+        for (size_t idx = 0; idx < kPoolClassCount; idx += 1) {
+          if (counts[idx] != 0) pool->Release(*this, idx, counts[idx]);
+        }
+      }
+    }
+  }
+
+  Drop();
+  owner = 0;
+}
+
+inline size_t GetClassBlockSize(size_t size_class) {
+  return size_t(1) << (size_class + kPoolMinShift);
+}
+
+inline uint32_t GetSizeClass(size_t total) {
+  for (size_t idx = 0; idx < kPoolClassCount; idx += 1) {
+    if (total <= GetClassBlockSize(idx)) return uint32_t(idx);
+  }
+
+  return kPoolLargeClass;
+}
+
+inline size_t GetBatchCount(size_t size_class) {
+  return std::max<size_t>(1, kPoolBatchBytes / GetClassBlockSize(size_class));
+}
+
+PoolMemoryInterface::PoolMemoryInterface() : epoch_(1) {
+  for (auto &state : classes_) {
+    state = ClassState{ nullptr, {}, 0, nullptr, 0 };
+  }
+
+  auto &registry = GetPoolRegistry();
+  std::lock_guard<std::mutex> guard(registry.lock);
+  id_ = registry.next_id;
+  registry.next_id += 1;
+  registry.pools[id_] = this;
+}
+
+PoolMemoryInterface::~PoolMemoryInterface() {
+  {
+    auto &registry = GetPoolRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    registry.pools.erase(id_);
+  }
+
+  if (tls_pool_cache.owner == id_) {
+    tls_pool_cache.Drop();
+    tls_pool_cache.owner = 0;
+  }
+
+  for (auto &state : classes_) {
+    for (auto chunk : state.chunks) {
+      free(chunk);
+    }
+  }
+  for (auto header : large_) {
+    free(header);
+  }
+}
+
+PoolThreadCache &PoolMemoryInterface::GetCache() {
+  auto &cache = tls_pool_cache;
+  auto epoch = epoch_.load(std::memory_order_acquire);
+  if (cache.owner != id_) {
+    cache.Detach();
+    cache.owner = id_;
+    cache.epoch = epoch;
+  }
+  else if (cache.epoch != epoch) {
+    // Collect() took these back already
+    cache.Drop();
+    cache.epoch = epoch;
+  }
+
+  return cache;
+}
+
+void *PoolMemoryInterface::TakeBlock(size_t size_class) {
+  auto &state = classes_[size_class];
+  auto block_size = GetClassBlockSize(size_class);
+
+  if (state.free_list != nullptr) {
+    auto block = state.free_list;
+    state.free_list = *static_cast<void **>(block);
+    return block;
+  }
+
+  if (state.bump_left < block_size) {
+    auto chunk_size = std::max(kPoolChunkSize, block_size);
+    if (state.next_chunk == state.chunks.size()) {
+      auto chunk = static_cast<uint8_t *>(malloc(chunk_size));
+      if (chunk == nullptr) return nullptr;
+      state.chunks.push_back(chunk);
+    }
+
+    state.bump = state.chunks[state.next_chunk];
+    state.bump_left = chunk_size;
+    state.next_chunk += 1;
+  }
+
+  auto block = state.bump;
+  state.bump += block_size;
+  state.bump_left -= block_size;
+  return block;
+}
+
+void PoolMemoryInterface::Refill(PoolThreadCache &cache, size_t size_class) {
+  std::lock_guard<std::mutex> guard(lock_);
+  auto count = GetBatchCount(size_class);
+  for (size_t idx = 0; idx < count; idx += 1) {
+    auto block = TakeBlock(size_class);
+    if (block == nullptr) break;
+    *static_cast<void **>(block) = cache.heads[size_class];
+    cache.heads[size_class] = block;
+    cache.counts[size_class] += 1;
+  }
+}
+
+void PoolMemoryInterface::Release(PoolThreadCache &cache, size_t size_class, size_t count) {
+  std::lock_guard<std::mutex> guard(lock_);
+  auto &state = classes_[size_class];
+  for (size_t idx = 0; idx < count && cache.heads[size_class] != nullptr; idx += 1) {
+    auto block = cache.heads[size_class];
+    cache.heads[size_class] = *static_cast<void **>(block);
+    cache.counts[size_class] -= 1;
+    *static_cast<void **>(block) = state.free_list;
+    state.free_list = block;
+  }
+}
+
+MemoryBlockHeader *PoolMemoryInterface::Take(size_t num, size_t size) {
+  auto total = GetBlockSize(num, size);
+  if (total == SIZE_MAX) return nullptr;
+
+  MemoryBlockHeader *header;
+  auto size_class = GetSizeClass(total);
+  if (size_class == kPoolLargeClass) {
+    header = static_cast<MemoryBlockHeader *>(malloc(total));
+    if (header == nullptr) return nullptr;
+    std::lock_guard<std::mutex> guard(lock_);
+    large_.insert(header);
+  }
+  else {
+    auto &cache = GetCache();
+    if (cache.heads[size_class] == nullptr) {
+      Refill(cache, size_class);
+      if (cache.heads[size_class] == nullptr) return nullptr;
+    }
+
+    header = static_cast<MemoryBlockHeader *>(cache.heads[size_class]);
+    cache.heads[size_class] = *reinterpret_cast<void **>(header);
+    cache.counts[size_class] -= 1;
+  }
+
+  header->size = num * size;
+  header->size_class = size_class;
+  counters_.OnAlloc(header->size);
+  return header;
+}
+
+void *PoolMemoryInterface::Alloc(size_t num, size_t size) {
+  auto header = Take(num, size);
+  if (header == nullptr) return nullptr;
+  memset(header + 1, 0, header->size);
+  return header + 1;
+}
+
+void *PoolMemoryInterface::AllocRaw(size_t num, size_t size) {
+  auto header = Take(num, size);
+  return header != nullptr ? header + 1 : nullptr;
+}
+
+void PoolMemoryInterface::Delete(void *ptr) {
+  if (ptr == nullptr) return;
+
+  auto header = GetHeader(ptr);
+  auto size_class = header->size_class;
+  counters_.OnDelete(header->size);
+
+  if (size_class == kPoolLargeClass) {
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      large_.erase(header);
+    }
+    free(header);
+    return;
+  }
+
+  auto &cache = GetCache();
+  *reinterpret_cast<void **>(header) = cache.heads[size_class];
+  cache.heads[size_class] = header;
+  cache.counts[size_class] += 1;
+
+  // keep at most two batches per class around
+  auto batch = GetBatchCount(size_class);
+  if (cache.counts[size_class] > 2 * batch) {
+    Release(cache, size_class, batch);
+  }
+}
+
+void PoolMemoryInterface::Collect() {
+  std::lock_guard<std::mutex> guard(lock_);
+  for (auto &state : classes_) {
+    state.free_list = nullptr;
+    state.next_chunk = 0;
+    state.bump = nullptr;
+    state.bump_left = 0;
+  }
+  for (auto header : large_) {
+    free(header);
+  }
+  large_.clear();
+
+  epoch_.fetch_add(1, std::memory_order_acq_rel);
+  counters_.OnCollect();
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include "machine.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+
+// MemoryInterface implementations for running many short-lived programs
+// without going back to malloc.
+// Every block starts with a 16 byte MemoryBlockHeader so Delete knows
+// its size, the pointer handed out stays 16-byte aligned.
+
+struct MemoryBlockHeader {
+  uint64_t size; //requested bytes
+  uint32_t size_class; //pool class, kPoolLargeClass for malloc'd blocks
+  uint32_t reserved;
+};
+
+static_assert(sizeof(MemoryBlockHeader) == 16, "keeps blocks 16-byte aligned");
+
+// Lock-free counters behind MemoryStats.
+class MemoryCounters {
+  protected:
+  std::atomic<size_t> bytes_live_{ 0 };
+  std::atomic<size_t> bytes_peak_{ 0 };
+  std::atomic<size_t> alloc_count_{ 0 };
+  std::atomic<size_t> delete_count_{ 0 };
+  std::atomic<size_t> collect_count_{ 0 };
+
+  public:
+  void OnAlloc(size_t bytes);
+  void OnDelete(size_t bytes);
+  void OnCollect();
+  MemoryStats Get() const;
+};
+
+constexpr size_t kDefaultArenaChunk = size_t(1) << 20;
+
+// Bump allocator over large chunks.
+// Delete gives back the newest block only, so stack-like use such as a
+// machine per program stays in place. Other blocks are freed when
+// Collect() frees everything at once and keeps the chunks for the next
+// round. Blocks bigger than a
+// chunk get a chunk of their own. Not thread-safe, give every thread
+// its own arena.
+class ArenaMemoryInterface : virtual public MemoryInterface {
+  protected:
+  struct Chunk {
+    uint8_t *data;
+    size_t size;
+  };
+
+  vector<Chunk> chunks_;
+  size_t current_; //chunk being carved
+  size_t offset_; //into the current chunk
+  size_t chunk_size_;
+  MemoryCounters counters_;
+
+  MemoryBlockHeader *Take(size_t num, size_t size);
+
+  public:
+  ArenaMemoryInterface(size_t chunk_size = kDefaultArenaChunk) :
+    current_(0), offset_(0), chunk_size_(chunk_size) {}
+  ~ArenaMemoryInterface();
+  ArenaMemoryInterface(const ArenaMemoryInterface &) = delete;
+  ArenaMemoryInterface &operator=(const ArenaMemoryInterface &) = delete;
+
+  void *Alloc(size_t num, size_t size) override;
+  void *AllocRaw(size_t num, size_t size) override;
+  void Delete(void *ptr) override;
+  void Collect() override;
+  MemoryStats GetStats() const override { return counters_.Get(); }
+};
+
+// 16 bytes to 2 MiB in powers of two, bigger blocks go to malloc. The
+// top classes cover a default-sized operand stack.
+constexpr size_t kPoolMinShift = 4;
+constexpr size_t kPoolClassCount = 18;
+constexpr uint32_t kPoolLargeClass = UINT32_MAX;
+constexpr size_t kPoolChunkSize = size_t(1) << 20;
+// blocks moved between a thread cache and the pool at once
+constexpr size_t kPoolBatchBytes = size_t(1) << 16;
+
+struct PoolThreadCache;
+
+// Size-class pool allocator, safe to share between threads.
+// Each thread keeps a cache of free blocks per class and only takes the
+// pool lock to move a batch of them in or out. Collect() frees every
+// block at once: chunks are kept for reuse, large blocks are released,
+// and thread caches notice the new epoch and drop what they hold. It
+// must not race with Alloc/Delete, blocks in use are gone afterwards.
+class PoolMemoryInterface : virtual public MemoryInterface {
+  protected:
+  struct ClassState {
+    void *free_list; //linked through the first word of each block
+    vector<uint8_t *> chunks; //kPoolChunkSize each, or one block if bigger
+    size_t next_chunk; //chunks before it are carved up
+    uint8_t *bump; //unused space in the current chunk
+    size_t bump_left;
+  };
+
+  uint64_t id_; //unique per pool, thread caches refer to it
+  std::atomic<uint64_t> epoch_;
+  std::mutex lock_;
+  ClassState classes_[kPoolClassCount];
+  std::unordered_set<void *> large_; //headers of malloc'd blocks
+  MemoryCounters counters_;
+
+  PoolThreadCache &GetCache();
+  MemoryBlockHeader *Take(size_t num, size_t size);
+  void *TakeBlock(size_t size_class); //lock held
+  void Refill(PoolThreadCache &cache, size_t size_class);
+  void Release(PoolThreadCache &cache, size_t size_class, size_t count);
+
+  friend struct PoolThreadCache;
+
+  public:
+  PoolMemoryInterface();
+  ~PoolMemoryInterface();
+  PoolMemoryInterface(const PoolMemoryInterface &) = delete;
+  PoolMemoryInterface &operator=(const PoolMemoryInterface &) = delete;
+
+  void *Alloc(size_t num, size_t size) override;
+  void *AllocRaw(size_t num, size_t size) override;
+  void Delete(void *ptr) override;
+  void Collect() override;
+  MemoryStats GetStats() const override { return counters_.Get(); }
+};
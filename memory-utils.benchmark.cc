@@ -0,0 +1,128 @@
+#include "memory-utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using std::vector;
+
+// Reference counting under contention.
+// Every thread copies and drops a pointer to one shared object in a
+// tight loop, so all of them hit the same counter cache line. One op is
+// one copy plus one drop.
+
+constexpr size_t kOpsPerThread = 2000000;
+// rounds of the last-release race
+constexpr size_t kReleaseRounds = 20000;
+
+std::atomic<size_t> deletes{ 0 };
+
+struct Shared : public utils::IntrusiveCounter<Shared> {
+  uint64_t payload = 0;
+  ~Shared() { deletes.fetch_add(1, std::memory_order_relaxed); }
+};
+
+struct Guarded : public utils::LifeCycleGuard<Guarded> {
+  uint64_t payload = 0;
+};
+
+// Runs body(thread index) on count threads released at once, returns
+// the wall time in seconds.
+template <typename Body>
+double RunThreads(size_t count, Body body) {
+  std::atomic<bool> go{ false };
+  vector<std::thread> threads;
+  for (size_t idx = 0; idx < count; idx += 1) {
+    threads.emplace_back([&go, &body, idx]() {
+      while (!go.load(std::memory_order_acquire)) {}
+      body(idx);
+    });
+  }
+
+  auto begin = steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  duration<double> elapsed = steady_clock::now() - begin;
+  return elapsed.count();
+}
+
+void Report(const char *name, size_t threads, double seconds) {
+  double ops = double(threads) * kOpsPerThread;
+  printf("%-16s %2zu threads %8.2f Mops/s %7.2f ns/op per thread\n", name, threads,
+    ops / seconds / 1e6, seconds * 1e9 / kOpsPerThread);
+}
+
+// All threads drop their reference at the same time, exactly one of
+// them must delete.
+bool CheckLastRelease(size_t threads) {
+  deletes.store(0);
+  for (size_t round = 0; round < kReleaseRounds; round += 1) {
+    utils::IntrusivePointer<Shared> root(new Shared);
+    vector<utils::IntrusivePointer<Shared>> copies(threads, root);
+    root.Release();
+    RunThreads(threads, [&copies](size_t idx) { copies[idx].Release(); });
+  }
+
+  return deletes.load() == kReleaseRounds;
+}
+
+// usage: bench-refcount [max threads], one per core by default
+int main(int argc, char **argv) {
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (argc > 1) {
+    max_threads = std::max(1, atoi(argv[1]));
+  }
+  vector<size_t> thread_counts;
+  for (size_t count = 1; count <= max_threads; count *= 2) {
+    thread_counts.push_back(count);
+  }
+  if (thread_counts.back() != max_threads) thread_counts.push_back(max_threads);
+
+  bool fine = true;
+  for (auto threads : thread_counts) {
+    utils::IntrusivePointer<Shared> shared(new Shared);
+    auto seconds = RunThreads(threads, [&shared](size_t) {
+      for (size_t op = 0; op < kOpsPerThread; op += 1) {
+        utils::IntrusivePointer<Shared> copy(shared);
+        (void)copy->payload;
+      }
+    });
+    Report("intrusive", threads, seconds);
+    fine = fine && shared->_Counter_Value() == 1;
+
+    Guarded guarded;
+    utils::ProtectedPointer<Guarded> protect(&guarded);
+    seconds = RunThreads(threads, [&protect](size_t) {
+      for (size_t op = 0; op < kOpsPerThread; op += 1) {
+        utils::ProtectedPointer<Guarded> copy(protect);
+        (void)copy->payload;
+      }
+    });
+    Report("protected", threads, seconds);
+
+    auto standard = std::make_shared<uint64_t>(0);
+    seconds = RunThreads(threads, [&standard](size_t) {
+      for (size_t op = 0; op < kOpsPerThread; op += 1) {
+        auto copy = standard;
+        (void)*copy;
+      }
+    });
+    Report("std::shared_ptr", threads, seconds);
+  }
+
+  for (auto threads : thread_counts) {
+    bool released = CheckLastRelease(threads);
+    printf("last release     %2zu threads %s\n", threads, released ? "ok" : "FAIL");
+    fine = fine && released;
+  }
+
+  return fine ? 0 : 1;
+}
@@ -6,14 +6,36 @@
 #include <atomic>
 #include <memory>
 #include <unordered_set>
+#include <stdexcept>
+
+// Thread safety
+// Counters are shared between threads with atomics only. Increments are
+// relaxed, a new reference is always made from an existing one. The
+// decrement that may free is acq_rel through fetch_sub: the thread
+// seeing the count drop to zero has seen every write made through the
+// other references, so it can delete without a lock or a CAS retry.
+// A single pointer object is not meant to be written by two threads at
+// once, give every thread its own copy like with std::shared_ptr.
 
 namespace utils {
   // For life cycle manager family (LifecycleGuard and etc)
+  // count covers the guarded object itself plus every ProtectedPointer,
+  // whoever drops it to zero deletes the counter.
   struct _CounterBase {
     std::atomic_int32_t count;
-    bool dead;
+    std::atomic_bool dead;
   };
 
+  inline void _RetainCounter(_CounterBase *counter) {
+    counter->count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline void _ReleaseCounter(_CounterBase *counter) {
+    if (counter->count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete counter;
+    }
+  }
+
   // Base class for life cycle manager family
   class _LifeCycleBase {
   public:
@@ -30,23 +52,27 @@ namespace utils {
 
   public:
     virtual ~LifeCycleGuard() {
-      if (counter_->count == 0) delete counter_;
-      else counter_->dead = true;
+      // release, so a pointer seeing dead also sees the object's last writes
+      counter_->dead.store(true, std::memory_order_release);
+      _ReleaseCounter(counter_);
     }
 
-    LifeCycleGuard() : counter_(new _CounterBase{ 0, false }) {}
+    LifeCycleGuard() : counter_(new _CounterBase{ 1, false }) {}
     //Pointer copy must be wrapped by ProtectedPointer class to get protection.
     //Each object holds a unique counter. This is not a referece count manager.
     explicit
-      LifeCycleGuard(const LifeCycleGuard<T> &) : counter_(new _CounterBase{ 0, false }) {}
+      LifeCycleGuard(const LifeCycleGuard<T> &) : counter_(new _CounterBase{ 1, false }) {}
     explicit
-      LifeCycleGuard(const LifeCycleGuard<T> &&) : counter_(new _CounterBase{ 0, false }) {}
+      LifeCycleGuard(const LifeCycleGuard<T> &&) : counter_(new _CounterBase{ 1, false }) {}
 
     constexpr _CounterBase *_GetCounter() const { return counter_; }
   };
 
   // Assistant class for avoiding dangling pointer
-  // TODO: multithreading support
+  // Dead() turns true once the object's destructor has started, from any
+  // thread. It can not stop another thread from destroying the object
+  // right after the check, so Get()/Seek() are only safe while the
+  // caller knows the owner keeps the object alive.
   template <typename T>
   class ProtectedPointer : virtual public _LifeCycleBase {
     static_assert(std::is_base_of<LifeCycleGuard<T>, T>::value, "Class is not managed by LifeCycleGuard");
@@ -73,43 +99,40 @@ namespace utils {
 
   public:
     ~ProtectedPointer() {
-      //Only myself ?
-      if (counter_->count <= 1) delete counter_;
-      //Reduce count number
-      else counter_->count -= 1;
+      if (counter_ != nullptr) _ReleaseCounter(counter_);
     }
 
     // Is instance alive
-    bool Alive() const override { return !counter_->dead || counter_ != nullptr; }
-    bool Dead() const { return counter_->dead || counter_ == nullptr; }
+    bool Alive() const override { 
+      return counter_ != nullptr && !counter_->dead.load(std::memory_order_acquire); 
+    }
+    bool Dead() const { return !Alive(); }
 
     ProtectedPointer() = delete;
 
-    explicit ProtectedPointer(const typename ProtectedPointer<T> &rhs) :
+    explicit ProtectedPointer(const ProtectedPointer<T> &rhs) :
       counter_(rhs.counter_), ptr_(rhs.ptr_) {
-      if (counter_ != nullptr) {
-        counter_.count += 1;
-      }
+      if (counter_ != nullptr) _RetainCounter(counter_);
     }
 
-    explicit ProtectedPointer(const typename ProtectedPointer<T> &&rhs) :
+    // takes over the reference, no counter traffic
+    ProtectedPointer(ProtectedPointer<T> &&rhs) :
       counter_(rhs.counter_), ptr_(rhs.ptr_) {
-      if (counter_ != nullptr) {
-        counter_.count += 1;
-      }
+      rhs.counter_ = nullptr;
+      rhs.ptr_ = nullptr;
     }
 
     ProtectedPointer(PointerType ptr) : counter_(ptr->_GetCounter()), ptr_(ptr) {
-      counter_->count += 1;
+      _RetainCounter(counter_);
     }
 
     ObjectType &Seek() { 
-      if (counter_->dead) throw std::exception("Destination is dead");
+      if (Dead()) throw std::runtime_error("Destination is dead");
       return *ptr_; 
     }
 
     PointerType Get() { 
-      if (counter_->dead) throw std::exception("Destination is dead");
+      if (Dead()) throw std::runtime_error("Destination is dead");
       return ptr_; 
     }
 
@@ -118,27 +141,22 @@ namespace utils {
 
     //assign operator
     void operator=(const ProtectedPointer<T> &rhs) {
-      if (counter_ != nullptr) {
-        if (counter_.count <= 1) delete counter_;
-        else counter_->count -= 1;
-      }
+      // retain first, rhs may share our counter
+      if (rhs.counter_ != nullptr) _RetainCounter(rhs.counter_);
+      if (counter_ != nullptr) _ReleaseCounter(counter_);
 
       counter_ = rhs.counter_;
       ptr_ = rhs.ptr_;
-      if (counter_ != nullptr) {
-        counter_->count += 1;
-      }
     }
 
-    void operator=(const ProtectedPointer<T> &&rhs) { this->operator=(rhs); }
+    void operator=(ProtectedPointer<T> &&rhs) { Swap(rhs); }
 
     void operator=(const PointerType rhs) {
-      if (counter_ != nullptr) {
-        if (counter_.count <= 1) delete counter_;
-        else counter_->count -= 1;
-      }
+      auto counter = rhs->_GetCounter();
+      _RetainCounter(counter);
+      if (counter_ != nullptr) _ReleaseCounter(counter_);
 
-      counter_ = rhs->_GetCounter();
+      counter_ = counter;
       ptr_ = rhs;
     }
 
@@ -149,6 +167,8 @@ namespace utils {
   };
 
   // Intrusive counter for IntrusivePointer.
+  // A new object starts with one reference, adopted by the first
+  // IntrusivePointer made from the raw pointer.
   template <typename T>
   class IntrusiveCounter {
   private:
@@ -158,9 +178,12 @@ namespace utils {
     IntrusiveCounter(const IntrusiveCounter<T> &rhs) : count_(1) {}
     IntrusiveCounter(const IntrusiveCounter<T> &&rhs) : count_(1) {}
 
-    void _Counter_Increase() { count_ += 1; }
-    void _Counter_Decrease() { count_ -= 1; }
-    auto _Counter_Value() const { return count_.operator int(); }
+    void _Counter_Increase() { count_.fetch_add(1, std::memory_order_relaxed); }
+    // true for the call dropping the last reference, which must delete
+    bool _Counter_Decrease() { 
+      return count_.fetch_sub(1, std::memory_order_acq_rel) == 1; 
+    }
+    auto _Counter_Value() const { return count_.load(std::memory_order_relaxed); }
   };
 
   //Intrusive RC Pointer class
@@ -176,8 +199,8 @@ namespace utils {
 
   public:
     void Release() {
-      if (ptr_ != nullptr && ptr_->_Counter_Value() == 1) delete ptr_;
-      else if (ptr_ != nullptr) ptr_->_Counter_Decrease();
+      // decide and delete in one step, a separate load could race
+      if (ptr_ != nullptr && ptr_->_Counter_Decrease()) delete ptr_;
 
       ptr_ = nullptr;
     }
@@ -192,19 +215,17 @@ namespace utils {
 
   public:
     ~IntrusivePointer() {
-      // Only myself?
-      if (ptr_->_Counter_Value() == 1) delete ptr_;
-      // Decrease count
-      else ptr_->_Counter_Decrease();
+      Release();
     }
 
     IntrusivePointer() : ptr_(nullptr) {}
     IntrusivePointer(const IntrusivePointer<T> &rhs) : ptr_(rhs.ptr_) {
-      ptr_->_Counter_Increase();
+      if (ptr_ != nullptr) ptr_->_Counter_Increase();
     }
 
-    IntrusivePointer(const IntrusivePointer<T> &&rhs) : ptr_(rhs.ptr_) {
-      ptr_->_Counter_Increase();
+    // takes over the reference, no counter traffic
+    IntrusivePointer(IntrusivePointer<T> &&rhs) : ptr_(rhs.ptr_) {
+      rhs.ptr_ = nullptr;
     }
 
     IntrusivePointer(const PointerType ptr) : ptr_(ptr) {}
@@ -217,24 +238,18 @@ namespace utils {
     //TODO:operator override
     //assign operator
     void operator=(const IntrusivePointer<T> &rhs) {
-      //Preprocessing for current wrapped pointer
+      // retain first, rhs may hold the last other reference to ours
+      if (rhs.ptr_ != nullptr) rhs.ptr_->_Counter_Increase();
       Release();
-
-      // Wrap new pointer
       ptr_ = rhs.ptr_;
-      // Check reference count
-      if (ptr_ != nullptr) ptr_->_Counter_Increase();
     }
 
-    void operator=(const IntrusivePointer<T> &&rhs) { this->operator=(rhs); }
+    void operator=(IntrusivePointer<T> &&rhs) { Swap(rhs); }
 
+    // adopts the reference a new object starts with
     void operator=(const PointerType rhs) {
       Release();
-      // no need to increase count?
-      bool empty = ptr_ == nullptr;
       ptr_ = rhs;
-      // Check reference count
-      if (ptr_ != nullptr && !empty) ptr_->_Counter_Increase();
     }
 
     constexpr bool operator==(const IntrusivePointer<T> &rhs) { return ptr_ == rhs.ptr_; }
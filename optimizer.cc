@@ -0,0 +1,467 @@
+#include "optimizer.h"
+#include "verifier.h"
+#include <cstdio>
+#include <algorithm>
+
+// Decoded instruction with its trailing literal words.
+struct Insn {
+  Code code;
+  Code literal[2];
+  size_t origin; //pc before optimization
+  bool target; //Jump/Branch/FarJump/FarBranch may land here
+  bool pinned; //literal address consumed by the next far jump
+  bool removed;
+};
+
+inline Inst GetInsnInst(const Insn &insn) {
+  return static_cast<Inst>(GET_INST(insn.code));
+}
+
+// Jump/Branch, alone or as the last part of a superinstruction.
+inline bool IsDirectJumpInst(Inst inst) {
+  for (auto &super : kSuperInsts) {
+    if (super.inst == inst) {
+      inst = super.parts[super.count - 1];
+      break;
+    }
+  }
+
+  return inst == Inst::Jump || inst == Inst::Branch;
+}
+
+inline bool IsCommutativeInst(Inst inst) {
+  return inst == Inst::Add
+    || inst == Inst::Mul
+    || inst == Inst::AddU
+    || inst == Inst::MulU
+    || inst == Inst::AddF
+    || inst == Inst::MulF
+    || inst == Inst::And
+    || inst == Inst::Or
+    || inst == Inst::XOr
+    || inst == Inst::LogicAnd
+    || inst == Inst::LogicOr;
+}
+
+// Number of constant operands a pure instruction consumes, 0 if not foldable.
+inline size_t GetFoldArity(Inst inst) {
+  switch (inst) {
+  case Inst::Add: case Inst::Sub: case Inst::Mul: case Inst::Div: case Inst::Mod:
+  case Inst::AddU: case Inst::SubU: case Inst::MulU: case Inst::DivU: case Inst::ModU:
+  case Inst::AddF: case Inst::SubF: case Inst::MulF: case Inst::DivF:
+  case Inst::AddSL32:
+  case Inst::ShiftLeft: case Inst::LogicShiftRight: case Inst::ArithShiftRight:
+  case Inst::And: case Inst::Or: case Inst::XOr:
+  case Inst::LogicAnd: case Inst::LogicOr:
+  case Inst::RotateLeft: case Inst::RotateRight:
+    return 2;
+  case Inst::SpawnFP: case Inst::SpawnSignedInt:
+  case Inst::ShiftLeftImm: case Inst::LogicShiftRightImm: case Inst::ArithShiftRightImm:
+  case Inst::Not: case Inst::LogicNot:
+  case Inst::RotateLeftImm: case Inst::RotateRightImm:
+    return 1;
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+// Folding must not hide a fault or UB the program would hit at runtime.
+bool IsSafeToFold(const Insn &op, const Unit *operands) {
+  auto inst = GetInsnInst(op);
+  const Unit &rhs = operands[1];
+
+  switch (inst) {
+  case Inst::Div:
+  case Inst::Mod:
+    return INTVAL(rhs) != 0
+      && !(INTVAL(operands[0]) == INT64_MIN && INTVAL(rhs) == -1);
+  case Inst::DivU:
+  case Inst::ModU:
+    return UINTVAL(rhs) != 0;
+  case Inst::ShiftLeft:
+  case Inst::LogicShiftRight:
+  case Inst::ArithShiftRight:
+    return UINTVAL(rhs) < 64;
+  case Inst::ShiftLeftImm:
+  case Inst::LogicShiftRightImm:
+  case Inst::ArithShiftRightImm:
+    return GET_ARGS(op.code) < 64;
+  default:
+    break;
+  }
+
+  return true;
+}
+
+bool ReadConstant(const Insn &insn, Unit &dest) {
+  bool result = true;
+
+  switch (GetInsnInst(insn)) {
+  case Inst::PushHalfWordImm:
+    dest = Unit{ GET_ARGS(insn.code), UnitType::UInt };
+    break;
+  case Inst::PushHalfWordImmSL16:
+    dest = Unit{ uint64_t(GET_ARGS(insn.code)) << 16, UnitType::UInt };
+    break;
+  case Inst::PushWordImm:
+    dest.type = static_cast<UnitType>(GET_ARGS(insn.code));
+    UINTVAL(dest) = dest.type == UnitType::Int ?
+      static_cast<uint64_t>(static_cast<int32_t>(insn.literal[0])) : insn.literal[0];
+    break;
+  case Inst::PushDoubleWordImm:
+    dest.type = static_cast<UnitType>(GET_ARGS(insn.code));
+    UINTVAL(dest) = (uint64_t(insn.literal[1]) << 32) | insn.literal[0];
+    break;
+  default:
+    result = false;
+    break;
+  }
+
+  return result;
+}
+
+void WriteConstant(Insn &insn, const Unit &value) {
+  Program words;
+  EmitImmediate(words, UINTVAL(value), value.type);
+  insn.code = words[0];
+  for (size_t idx = 1; idx < words.size(); idx += 1) {
+    insn.literal[idx - 1] = words[idx];
+  }
+}
+
+// Runs operations on a scratch machine so folding is bit-exact.
+// One is made per OptimizeProgram() call and reused for every fold.
+class ConstantEvaluator {
+  protected:
+  Machine machine_;
+  Program snippet_;
+
+  static MachineOptions GetOptions() {
+    MachineOptions options;
+    options.stack_capacity = 4;
+    options.stack_check = StackCheck::Explicit;
+    return options;
+  }
+
+  public:
+  ConstantEvaluator() : machine_(GetOptions()) {}
+
+  bool Evaluate(const Unit *operands, size_t arity, Code op, Unit &dest) {
+    snippet_.clear();
+    for (size_t idx = 0; idx < arity; idx += 1) {
+      EmitImmediate(snippet_, UINTVAL(operands[idx]), operands[idx].type);
+    }
+    snippet_.push_back(op);
+
+    if (!machine_.Run(snippet_) || machine_.GetStack().Depth() != 1) {
+      return false;
+    }
+
+    dest = machine_.GetStack().Top()[-1];
+    return true;
+  }
+};
+
+bool DecodeProgram(Program &prog, vector<Insn> &insns) {
+  vector<size_t> index_of(prog.size(), SIZE_MAX);
+
+  for (size_t pc = 0; pc < prog.size();) {
+    Insn insn{ prog[pc], { 0, 0 }, pc, false, false, false };
+    auto length = GetInstLength(GetInsnInst(insn));
+    if (pc + length > prog.size()) {
+      return false;
+    }
+
+    for (size_t idx = 1; idx < length; idx += 1) {
+      insn.literal[idx - 1] = prog[pc + idx];
+    }
+
+    index_of[pc] = insns.size();
+    insns.push_back(insn);
+    pc += length;
+  }
+
+  auto mark_target = [&](uint64_t target) -> bool {
+    if (target >= prog.size()) return true;
+    if (index_of[target] == SIZE_MAX) return false;
+    insns[index_of[target]].target = true;
+    return true;
+  };
+
+  for (auto &insn : insns) {
+    auto inst = GetInsnInst(insn);
+    if (IsDirectJumpInst(inst) && !mark_target(GET_ARGS(insn.code))) {
+      return false;
+    }
+  }
+
+  // Far jumps are only relocatable if their address is the literal
+  // pushed right before them.
+  for (size_t idx = 0; idx < insns.size(); idx += 1) {
+    auto inst = GetInsnInst(insns[idx]);
+    if (inst != Inst::FarJump && inst != Inst::FarBranch) {
+      continue;
+    }
+
+    Unit address;
+    if (idx == 0 || insns[idx].target
+      || GetInsnInst(insns[idx - 1]) == Inst::PushHalfWordImmSL16
+      || !ReadConstant(insns[idx - 1], address)
+      || address.type != UnitType::UInt
+      || !mark_target(UINTVAL(address))) {
+      return false;
+    }
+
+    insns[idx - 1].pinned = true;
+  }
+
+  return true;
+}
+
+vector<size_t> GetLiveInsns(vector<Insn> &insns) {
+  vector<size_t> live;
+  for (size_t idx = 0; idx < insns.size(); idx += 1) {
+    if (!insns[idx].removed) live.push_back(idx);
+  }
+  return live;
+}
+
+// depths from VerifyProgram(), empty when it failed
+bool RemoveNoOps(vector<Insn> &insns, const vector<size_t> &depths) {
+  bool changed = false;
+  auto live = GetLiveInsns(insns);
+
+  for (size_t idx = 0; idx < live.size(); idx += 1) {
+    auto &insn = insns[live[idx]];
+    auto inst = GetInsnInst(insn);
+    Insn *next = idx + 1 < live.size() ? &insns[live[idx + 1]] : nullptr;
+
+    // Dup underflows on an empty stack, the pair only goes where the
+    // stack is known to hold a unit
+    if (inst == Inst::Dup && next != nullptr
+      && GetInsnInst(*next) == Inst::Pop && !next->target
+      && insn.origin < depths.size() && depths[insn.origin] != kUnreachable
+      && depths[insn.origin] >= 1) {
+      insn.removed = true;
+      next->removed = true;
+      changed = true;
+      idx += 1;
+    }
+    else if (inst == Inst::SwapTop && next != nullptr
+      && IsCommutativeInst(GetInsnInst(*next)) && !next->target) {
+      insn.removed = true;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+bool FoldConstants(vector<Insn> &insns, ConstantEvaluator &evaluator) {
+  bool changed = false;
+  auto live = GetLiveInsns(insns);
+  // constant pushes directly below the current instruction
+  vector<size_t> consts;
+
+  for (auto idx : live) {
+    auto &insn = insns[idx];
+    Unit value;
+
+    if (insn.target) {
+      consts.clear();
+    }
+
+    if (!insn.pinned && ReadConstant(insn, value)) {
+      consts.push_back(idx);
+      continue;
+    }
+
+    auto arity = GetFoldArity(GetInsnInst(insn));
+    if (arity == 0 || insn.target || consts.size() < arity) {
+      consts.clear();
+      continue;
+    }
+
+    Unit operands[2];
+    auto first = consts.size() - arity;
+    for (size_t op_idx = 0; op_idx < arity; op_idx += 1) {
+      ReadConstant(insns[consts[first + op_idx]], operands[op_idx]);
+    }
+
+    if (!IsSafeToFold(insn, operands)
+      || !evaluator.Evaluate(operands, arity, insn.code, value)) {
+      consts.clear();
+      continue;
+    }
+
+    WriteConstant(insns[consts[first]], value);
+    for (size_t op_idx = 1; op_idx < arity; op_idx += 1) {
+      insns[consts[first + op_idx]].removed = true;
+    }
+    insn.removed = true;
+    consts.resize(first + 1);
+    changed = true;
+  }
+
+  return changed;
+}
+
+// Replace runs matching kSuperInsts, longest first.
+bool FuseSuperInsts(vector<Insn> &insns) {
+  bool changed = false;
+  auto live = GetLiveInsns(insns);
+
+  auto try_fuse = [&](size_t idx, const SuperInst &super) -> bool {
+    if (idx + super.count > live.size()) return false;
+
+    Code args = 0;
+    for (size_t part = 0; part < super.count; part += 1) {
+      auto &insn = insns[live[idx + part]];
+      if (GetInsnInst(insn) != super.parts[part]) return false;
+      if (part > 0 && insn.target) return false;
+      // the address of a far jump is relocated as a plain push
+      if (insn.pinned) return false;
+      if (InstUsesArgs(super.parts[part])) args = GET_ARGS(insn.code);
+      else if (GET_ARGS(insn.code) != 0) return false;
+    }
+
+    insns[live[idx]].code = (args << 7) + Code(super.inst);
+    for (size_t part = 1; part < super.count; part += 1) {
+      insns[live[idx + part]].removed = true;
+    }
+    return true;
+  };
+
+  for (size_t idx = 0; idx < live.size(); idx += 1) {
+    for (size_t count = 3; count >= 2; count -= 1) {
+      bool fused = false;
+      for (auto &super : kSuperInsts) {
+        if (super.count == count && try_fuse(idx, super)) {
+          idx += count - 1;
+          changed = true;
+          fused = true;
+          break;
+        }
+      }
+
+      if (fused) break;
+    }
+  }
+
+  return changed;
+}
+
+OptimizeReport OptimizeProgram(Program &prog, int level) {
+  OptimizeReport report{ 0, 0, prog.size(), prog.size(), false };
+  vector<Insn> insns;
+
+  if (!DecodeProgram(prog, insns)) {
+    report.skipped = true;
+    return report;
+  }
+
+  report.insts_before = insns.size();
+  report.insts_after = insns.size();
+  if (level <= 0) {
+    return report;
+  }
+
+  // depth at each original pc, removals and folds leave it unchanged
+  // for every instruction that stays
+  vector<size_t> depths;
+  auto verify = VerifyProgram(prog, SIZE_MAX);
+  if (verify.fine) {
+    depths.swap(verify.depths);
+  }
+
+  ConstantEvaluator evaluator;
+  bool changed = true;
+  while (changed) {
+    changed = RemoveNoOps(insns, depths);
+    if (level >= 2) {
+      changed = FoldConstants(insns, evaluator) || changed;
+    }
+  }
+
+  if (level >= 3) {
+    FuseSuperInsts(insns);
+  }
+
+  // new offsets, removed instructions map to their next survivor
+  auto old_size = prog.size();
+  vector<size_t> new_pc(old_size + 1, 0);
+  vector<size_t> insn_pc(insns.size(), 0);
+  size_t pc = 0;
+  for (size_t idx = 0; idx < insns.size(); idx += 1) {
+    if (insns[idx].removed) continue;
+    insn_pc[idx] = pc;
+    pc += GetInstLength(GetInsnInst(insns[idx]));
+  }
+
+  size_t next = pc;
+  new_pc[old_size] = pc;
+  for (size_t idx = insns.size(); idx-- > 0;) {
+    if (!insns[idx].removed) next = insn_pc[idx];
+    new_pc[insns[idx].origin] = next;
+  }
+
+  // targets past the end stay past the end
+  auto relocate = [&](uint64_t target) -> uint64_t {
+    return target < old_size ? new_pc[target] : std::max<uint64_t>(target, pc);
+  };
+
+  Program output;
+  output.reserve(pc);
+  report.insts_after = 0;
+  bool fits = true;
+  for (auto &insn : insns) {
+    if (insn.removed) continue;
+
+    auto inst = GetInsnInst(insn);
+    if (IsDirectJumpInst(inst)) {
+      auto target = relocate(GET_ARGS(insn.code));
+      fits = fits && target <= kMaxArgs;
+      insn.code = (Code(target) << 7) + Code(inst);
+    }
+    else if (insn.pinned) {
+      // Folds may have widened code in front of the target, so the new
+      // address can be larger than the old one. The literal keeps its
+      // encoding width, an address it can not hold gives up.
+      Unit address;
+      ReadConstant(insn, address);
+      auto target = relocate(UINTVAL(address));
+      if (inst == Inst::PushHalfWordImm) {
+        fits = fits && target <= kMaxArgs;
+        insn.code = (Code(target) << 7) + Code(inst);
+      }
+      else if (inst == Inst::PushWordImm) {
+        fits = fits && target <= UINT32_MAX;
+        insn.literal[0] = Code(target);
+      }
+      else {
+        insn.literal[0] = Code(target & UINT32_MAX);
+        insn.literal[1] = Code(target >> 32);
+      }
+    }
+
+    output.push_back(insn.code);
+    for (size_t idx = 1; idx < GetInstLength(inst); idx += 1) {
+      output.push_back(insn.literal[idx - 1]);
+    }
+    report.insts_after += 1;
+  }
+
+  // a target out of reach, the program stays as it was
+  if (!fits) {
+    report.insts_after = report.insts_before;
+    report.skipped = true;
+    return report;
+  }
+
+  prog.swap(output);
+  report.words_after = prog.size();
+
+  return report;
+}
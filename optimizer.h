@@ -0,0 +1,27 @@
+#pragma once
+#include "machine.h"
+
+// Peephole optimizer running between assembly and execution.
+// Level 0 leaves the program alone.
+// Level 1 removes Dup/Pop pairs on a stack known to be non-empty and
+// SwapTop before commutative ops. Doze is kept at every level, it is the
+// yield point of Machine::Start() and a Runner.
+// Level 2 also folds pure operations on constant operands into a single
+// literal push.
+// Level 3 also fuses runs listed in superinstruction.h.
+// Jump/Branch targets and literal addresses feeding FarJump/FarBranch
+// are moved to the new offsets. Programs with far jumps through computed
+// addresses are left untouched, so are programs where folding pushed a
+// target past what its Jump/Branch argument or address literal holds.
+
+constexpr int kMaxOptimizeLevel = 3;
+
+struct OptimizeReport {
+  size_t insts_before;
+  size_t insts_after;
+  size_t words_before;
+  size_t words_after;
+  bool skipped; //program could not be analysed or relocated safely
+};
+
+OptimizeReport OptimizeProgram(Program &prog, int level);
@@ -0,0 +1,106 @@
+#include "runner.h"
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+// Runner scaling from 1 to N workers.
+// Every job is a nested countdown with a Doze in the outer loop, and
+// job lengths differ by up to 8x so workers run dry at different times
+// and have to steal. The job index goes in as input and must come back
+// at the bottom of the final stack.
+
+constexpr size_t kJobCount = 128;
+constexpr uint32_t kInnerCount = 10000;
+// outer iterations of the shortest job
+constexpr uint32_t kOuterUnit = 16;
+
+inline Code Encode(Inst inst, uint32_t args = 0) {
+  return (args << 7) + Code(inst);
+}
+
+// input; pushhwi outer
+// loop: pushhwi inner; inner: pushhwi 1; subu; branch inner; pop; doze
+//       pushhwi 1; subu; branch loop
+Program MakeJob(uint32_t outer) {
+  Program prog;
+  prog.push_back(Encode(Inst::PushHalfWordImm, outer));
+  prog.push_back(Encode(Inst::PushHalfWordImm, kInnerCount));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  prog.push_back(Encode(Inst::SubU));
+  prog.push_back(Encode(Inst::Branch, 2));
+  prog.push_back(Encode(Inst::Pop));
+  prog.push_back(Encode(Inst::Doze));
+  prog.push_back(Encode(Inst::PushHalfWordImm, 1));
+  prog.push_back(Encode(Inst::SubU));
+  prog.push_back(Encode(Inst::Branch, 1));
+  return prog;
+}
+
+inline uint32_t GetOuterCount(size_t job) {
+  return kOuterUnit * uint32_t(1 + job % 8);
+}
+
+bool CheckResults(const vector<JobResult> &results) {
+  bool result = results.size() == kJobCount;
+  for (size_t idx = 0; result && idx < results.size(); idx += 1) {
+    auto &job = results[idx];
+    result = job.fine && job.stack.size() == 2
+      && UINTVAL(job.stack[0]) == idx && UINTVAL(job.stack[1]) == 0
+      && job.slices == GetOuterCount(idx) + 1;
+  }
+
+  return result;
+}
+
+// usage: bench-runner [max workers], one per hardware thread by default
+int main(int argc, char **argv) {
+  size_t max_workers = std::max(1u, std::thread::hardware_concurrency());
+  if (argc > 1) {
+    max_workers = std::max(1, atoi(argv[1]));
+  }
+
+  vector<Program> jobs;
+  uint64_t executed = 0;
+  for (size_t idx = 0; idx < kJobCount; idx += 1) {
+    jobs.push_back(MakeJob(GetOuterCount(idx)));
+    executed += 1 + uint64_t(GetOuterCount(idx)) * (6 + 3ull * kInnerCount);
+  }
+
+  // one machine on this thread, Doze does nothing in Run()
+  auto begin = steady_clock::now();
+  Machine machine;
+  for (auto &prog : jobs) {
+    machine.Run(prog);
+  }
+  duration<double> serial = steady_clock::now() - begin;
+  printf("%-10s %8.3f s %8.1f Minst/s\n", "serial", serial.count(),
+    executed / serial.count() / 1e6);
+
+  vector<size_t> worker_counts;
+  for (size_t count = 1; count <= max_workers; count *= 2) {
+    worker_counts.push_back(count);
+  }
+  if (worker_counts.back() != max_workers) worker_counts.push_back(max_workers);
+
+  bool fine = true;
+  for (auto workers : worker_counts) {
+    Runner runner(workers);
+    begin = steady_clock::now();
+    for (size_t idx = 0; idx < kJobCount; idx += 1) {
+      runner.Submit(jobs[idx], { Unit{ { .uinteger = idx }, UnitType::UInt } });
+    }
+    auto results = runner.Wait();
+    duration<double> elapsed = steady_clock::now() - begin;
+
+    bool checked = CheckResults(results);
+    printf("%2zu workers %8.3f s %8.1f Minst/s %5.2fx %6zu steals %s\n", workers,
+      elapsed.count(), executed / elapsed.count() / 1e6,
+      serial.count() / elapsed.count(), runner.GetSteals(), checked ? "" : "MISMATCH");
+    fine = fine && checked;
+  }
+
+  return fine ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+#include "runner.h"
+#include <algorithm>
+
+Runner::Runner(size_t workers, const MachineOptions &options, uint64_t slice) :
+  options_(options), slice_(slice), queued_(0), steals_(0), stop_(false), next_worker_(0),
+  sleeping_(0), outstanding_(0) {
+  if (workers == 0) {
+    workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (size_t idx = 0; idx < workers; idx += 1) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  // every deque exists before any thread looks for work to steal
+  for (size_t idx = 0; idx < workers; idx += 1) {
+    workers_[idx]->thread = std::thread(&Runner::Work, this, idx);
+  }
+}
+
+Runner::~Runner() {
+  {
+    std::lock_guard<std::mutex> guard(idle_lock_);
+    stop_.store(true);
+  }
+  idle_cv_.notify_all();
+
+  for (auto &worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+size_t Runner::Submit(Program prog, vector<Unit> input) {
+  size_t id;
+  {
+    std::lock_guard<std::mutex> guard(done_lock_);
+    id = results_.size();
+    results_.emplace_back();
+    outstanding_ += 1;
+  }
+
+  auto job = std::make_unique<Job>();
+  job->id = id;
+  job->prog = std::move(prog);
+  job->input = std::move(input);
+  job->slices = 0;
+
+  Push(next_worker_, std::move(job), false);
+  next_worker_ = (next_worker_ + 1) % workers_.size();
+  return id;
+}
+
+vector<JobResult> Runner::Wait() {
+  std::unique_lock<std::mutex> guard(done_lock_);
+  done_cv_.wait(guard, [this]() { return outstanding_ == 0; });
+
+  vector<JobResult> results;
+  results.swap(results_);
+  return results;
+}
+
+void Runner::Push(size_t worker, std::unique_ptr<Job> job, bool front) {
+  {
+    auto &dest = *workers_[worker];
+    std::lock_guard<std::mutex> guard(dest.lock);
+    if (front) {
+      dest.jobs.push_front(std::move(job));
+    }
+    else {
+      dest.jobs.push_back(std::move(job));
+    }
+  }
+  queued_.fetch_add(1);
+
+  // A worker counts itself sleeping before it checks queued_, so one
+  // of the two sides always sees the other.
+  if (sleeping_.load() != 0) {
+    std::lock_guard<std::mutex> guard(idle_lock_);
+    idle_cv_.notify_one();
+  }
+}
+
+std::unique_ptr<Runner::Job> Runner::Take(size_t self) {
+  std::unique_ptr<Job> job;
+
+  {
+    auto &own = *workers_[self];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.jobs.empty()) {
+      job = std::move(own.jobs.back());
+      own.jobs.pop_back();
+    }
+  }
+
+  // the others, starting with the next one so thieves spread out
+  for (size_t step = 1; job == nullptr && step < workers_.size(); step += 1) {
+    auto &victim = *workers_[(self + step) % workers_.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.jobs.empty()) {
+      job = std::move(victim.jobs.front());
+      victim.jobs.pop_front();
+      steals_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  if (job != nullptr) {
+    queued_.fetch_sub(1);
+  }
+  return job;
+}
+
+void Runner::Work(size_t self) {
+  while (!stop_.load()) {
+    auto job = Take(self);
+    if (job != nullptr) {
+      RunSlice(self, std::move(job));
+      continue;
+    }
+
+    std::unique_lock<std::mutex> guard(idle_lock_);
+    sleeping_ += 1;
+    idle_cv_.wait(guard, [this]() { return stop_.load() || queued_.load() != 0; });
+    sleeping_ -= 1;
+  }
+}
+
+void Runner::RunSlice(size_t self, std::unique_ptr<Job> job) {
+  RunStatus status;
+  if (job->machine == nullptr) {
+    job->machine = std::make_unique<Machine>(options_, &memory_);
+    status = job->machine->Start(job->prog, job->input, slice_);
+  }
+  else {
+    status = job->machine->Resume(slice_);
+  }
+  job->slices += 1;
+
+  if (status == RunStatus::Yielded || status == RunStatus::Exhausted) {
+    Push(self, std::move(job), true);
+    return;
+  }
+
+  auto &stack = job->machine->GetStack();
+  JobResult result{ status == RunStatus::Finished,
+    vector<Unit>(stack.Base(), stack.Top()), job->slices };
+  auto id = job->id;
+  // the machine goes back to the pool on this thread
+  job.reset();
+
+  std::lock_guard<std::mutex> guard(done_lock_);
+  results_[id] = std::move(result);
+  outstanding_ -= 1;
+  if (outstanding_ == 0) {
+    done_cv_.notify_all();
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "machine.h"
+#include "memory-pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Runs many independent programs on a fixed set of worker threads.
+// Every job gets a Machine of its own, run with Machine::Start() and
+// Resume(), so a program gives its worker up at every Doze it reaches
+// and after every time slice of instructions.
+// Each worker keeps a deque of jobs. It takes work from the back and
+// puts a job that yielded in front, behind everything else it holds.
+// Idle workers steal from the front of the others. All machines share
+// one PoolMemoryInterface, so a job moving between threads is fine.
+// Submit() and Wait() are meant for one thread.
+
+struct JobResult {
+  bool fine; //finished without a stack or heap fault
+  vector<Unit> stack; //final stack, bottom first
+  size_t slices; //times the job was run, one more than it was put back
+};
+
+class Runner {
+  protected:
+  struct Job {
+    size_t id;
+    Program prog;
+    vector<Unit> input;
+    std::unique_ptr<Machine> machine; //from the first slice on
+    size_t slices;
+  };
+
+  struct Worker {
+    std::mutex lock;
+    std::deque<std::unique_ptr<Job>> jobs;
+    std::thread thread;
+  };
+
+  // declared first, the machines of unfinished jobs go before it
+  PoolMemoryInterface memory_;
+  MachineOptions options_;
+  uint64_t slice_;
+  vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> queued_; //jobs sitting in some deque
+  std::atomic<size_t> steals_;
+  std::atomic<bool> stop_;
+  size_t next_worker_; //round robin for Submit()
+
+  // sleeping workers
+  std::mutex idle_lock_;
+  std::condition_variable idle_cv_;
+  std::atomic<size_t> sleeping_;
+
+  // results of this batch, by job id
+  std::mutex done_lock_;
+  std::condition_variable done_cv_;
+  vector<JobResult> results_;
+  size_t outstanding_;
+
+  void Work(size_t self);
+  std::unique_ptr<Job> Take(size_t self);
+  void Push(size_t worker, std::unique_ptr<Job> job, bool front);
+  void RunSlice(size_t self, std::unique_ptr<Job> job);
+
+  public:
+  // workers == 0 means one per hardware thread, slice kNoBudget lets
+  // a job run until its next Doze
+  Runner(size_t workers = 0, const MachineOptions &options = MachineOptions(),
+    uint64_t slice = kDefaultSlice);
+  // Unfinished jobs are dropped.
+  ~Runner();
+  Runner(const Runner &) = delete;
+  Runner &operator=(const Runner &) = delete;
+
+  // Returns the index of the result in the next Wait().
+  size_t Submit(Program prog, vector<Unit> input = {});
+  // Blocks until every submitted job is done and starts a new batch.
+  vector<JobResult> Wait();
+
+  size_t GetWorkerCount() const { return workers_.size(); }
+  // jobs taken from another worker's deque since construction
+  size_t GetSteals() const { return steals_.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,452 @@
+#include "machine.h"
+#include "assembler.h"
+#include "bytecode.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <bit>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using std::string;
+
+// Regression suite: a fixed set of kernels on every dispatch mode of
+// the build, assembler throughput and .bc load time, printed as JSON so
+// runs of different releases can be compared field by field.
+// The layout is stable: keys come in the order written here, numbers
+// use fixed precision and new entries are only ever appended, bump
+// kSuiteFormat when that is not enough. Every figure is the best of
+// kRounds runs. Each kernel has to leave the same stack on every mode,
+// the exit code is 1 when one did not or a load came back different.
+//
+// usage: bench-suite [scratch file prefix], bin/bench-suite by default
+
+constexpr int kSuiteFormat = 1;
+constexpr int kRounds = 3;
+constexpr uint32_t kLoopCount = 2000000;
+constexpr size_t kSourceBlocks = 50000; //9 lines each
+constexpr int kLoads = 20;
+
+inline Code Encode(Inst inst, uint32_t args = 0) {
+  return (args << 7) + Code(inst);
+}
+
+template <typename Fn>
+double Best(Fn fn) {
+  double best = 1e30;
+  for (int round = 0; round < kRounds; round += 1) {
+    auto begin = steady_clock::now();
+    fn();
+    duration<double> elapsed = steady_clock::now() - begin;
+    best = std::min(best, elapsed.count());
+  }
+
+  return best;
+}
+
+struct Kernel {
+  const char *name;
+  Program prog;
+  uint64_t executed;
+};
+
+// Writes a kernel: the setup, then body() as a countdown loop on a UInt
+// counter on top, so every kernel ends with the same three dispatches.
+// Instructions are counted as they are emitted, an EmitImmediate() is a
+// single dispatch whatever its length.
+class KernelBuilder {
+  protected:
+  Kernel kernel_;
+  uint64_t setup_;
+  uint64_t body_;
+  uint64_t *count_;
+
+  public:
+  KernelBuilder(const char *name) :
+    kernel_{ name, {}, 0 }, setup_(0), body_(0), count_(&setup_) {}
+
+  void Emit(Inst inst, uint32_t args = 0) {
+    kernel_.prog.push_back(Encode(inst, args));
+    *count_ += 1;
+  }
+
+  void EmitImm(uint64_t value, UnitType type) {
+    EmitImmediate(kernel_.prog, value, type);
+    *count_ += 1;
+  }
+
+  size_t Here() const { return kernel_.prog.size(); }
+
+  // patches the target of a Jump/Branch emitted at pos
+  void Target(size_t pos, size_t target) {
+    kernel_.prog[pos] = Encode(static_cast<Inst>(GET_INST(kernel_.prog[pos])), uint32_t(target));
+  }
+
+  // iterations times body, skipped is how many of the emitted body
+  // instructions an iteration jumps over on average
+  template <typename Fn>
+  Kernel Loop(uint32_t iterations, Fn body, double skipped = 0) {
+    Emit(Inst::PushHalfWordImm, iterations);
+    count_ = &body_;
+    size_t loop = Here();
+    body();
+    Emit(Inst::PushHalfWordImm, 1);
+    Emit(Inst::SubU);
+    Emit(Inst::Branch, uint32_t(loop));
+    kernel_.executed = setup_ + uint64_t((double(body_) - skipped) * iterations);
+    return kernel_;
+  }
+};
+
+// nothing but cheap dispatches
+Kernel MakeDispatchKernel() {
+  KernelBuilder builder("dispatch");
+  return builder.Loop(kLoopCount, [&]() {
+    for (int idx = 0; idx < 4; idx += 1) {
+      builder.Emit(Inst::Dup);
+      builder.Emit(Inst::Pop);
+    }
+  });
+}
+
+// acc = (acc * 3 + 7) % 0x7fff - 5 / 2, on signed units
+Kernel MakeIntKernel() {
+  KernelBuilder builder("int");
+  builder.EmitImm(uint64_t(-12345), UnitType::Int);
+  return builder.Loop(kLoopCount, [&]() {
+    builder.Emit(Inst::SwapTop);
+    builder.Emit(Inst::PushHalfWordImm, 3);
+    builder.Emit(Inst::Mul);
+    builder.Emit(Inst::PushHalfWordImm, 7);
+    builder.Emit(Inst::Add);
+    builder.Emit(Inst::PushHalfWordImm, 0x7fff);
+    builder.Emit(Inst::Mod);
+    builder.Emit(Inst::PushHalfWordImm, 5);
+    builder.Emit(Inst::Sub);
+    builder.Emit(Inst::PushHalfWordImm, 2);
+    builder.Emit(Inst::Div);
+    builder.Emit(Inst::SwapTop);
+  });
+}
+
+// the same chain on unsigned units
+Kernel MakeUIntKernel() {
+  KernelBuilder builder("uint");
+  builder.EmitImm(12345, UnitType::UInt);
+  return builder.Loop(kLoopCount, [&]() {
+    builder.Emit(Inst::SwapTop);
+    builder.Emit(Inst::PushHalfWordImm, 3);
+    builder.Emit(Inst::MulU);
+    builder.Emit(Inst::PushHalfWordImm, 7);
+    builder.Emit(Inst::AddU);
+    builder.Emit(Inst::PushHalfWordImm, 0x7fff);
+    builder.Emit(Inst::ModU);
+    builder.Emit(Inst::PushHalfWordImm, 5);
+    builder.Emit(Inst::SubU);
+    builder.Emit(Inst::PushHalfWordImm, 2);
+    builder.Emit(Inst::DivU);
+    builder.Emit(Inst::SwapTop);
+  });
+}
+
+// acc = (acc * 1.0000001 + 0.5) / 1.5 - 0.25, converges, never overflows
+Kernel MakeFPKernel() {
+  KernelBuilder builder("fp");
+  builder.EmitImm(std::bit_cast<uint64_t>(1.0), UnitType::FP);
+  return builder.Loop(kLoopCount, [&]() {
+    builder.Emit(Inst::SwapTop);
+    builder.EmitImm(std::bit_cast<uint64_t>(1.0000001), UnitType::FP);
+    builder.Emit(Inst::MulF);
+    builder.EmitImm(std::bit_cast<uint64_t>(0.5), UnitType::FP);
+    builder.Emit(Inst::AddF);
+    builder.EmitImm(std::bit_cast<uint64_t>(1.5), UnitType::FP);
+    builder.Emit(Inst::DivF);
+    builder.EmitImm(std::bit_cast<uint64_t>(0.25), UnitType::FP);
+    builder.Emit(Inst::SubF);
+    builder.Emit(Inst::SwapTop);
+  });
+}
+
+// every shift and rotate, by immediate and from the stack
+Kernel MakeShiftKernel() {
+  KernelBuilder builder("shift");
+  builder.EmitImm(0x9E3779B97F4A7C15, UnitType::UInt);
+  return builder.Loop(kLoopCount, [&]() {
+    builder.Emit(Inst::SwapTop);
+    builder.Emit(Inst::RotateLeftImm, 5);
+    builder.Emit(Inst::PushHalfWordImm, 3);
+    builder.Emit(Inst::RotateRight);
+    builder.Emit(Inst::Dup);
+    builder.Emit(Inst::ShiftLeftImm, 7);
+    builder.Emit(Inst::XOr);
+    builder.Emit(Inst::Dup);
+    builder.Emit(Inst::LogicShiftRightImm, 9);
+    builder.Emit(Inst::XOr);
+    builder.Emit(Inst::PushHalfWordImm, 2);
+    builder.Emit(Inst::ShiftLeft);
+    builder.Emit(Inst::PushHalfWordImm, 1);
+    builder.Emit(Inst::LogicShiftRight);
+    builder.Emit(Inst::ArithShiftRightImm, 1);
+    builder.Emit(Inst::PushHalfWordImm, 11);
+    builder.Emit(Inst::RotateLeft);
+    builder.Emit(Inst::RotateRightImm, 13);
+    builder.Emit(Inst::SwapTop);
+  });
+}
+
+// 32 copies of the counter pushed at once and folded back with xor,
+// 33 copies of a value xor to the value itself
+Kernel MakeDupNKernel() {
+  KernelBuilder builder("dupn");
+  return builder.Loop(kLoopCount / 4, [&]() {
+    builder.Emit(Inst::DupN, 32);
+    for (int idx = 0; idx < 32; idx += 1) {
+      builder.Emit(Inst::XOr);
+    }
+  });
+}
+
+// branches on the low counter bits, taken 1/2, 1/4 and 3/4 of the time
+Kernel MakeBranchKernel() {
+  KernelBuilder builder("branch");
+  // dup; pushhwi mask; and; [lnot]; branch skip; pop; jmp next;
+  // skip: pop; next:
+  // skips one pop when the branch falls through, a pop and the jmp when
+  // it is taken
+  auto test = [&](uint32_t mask, bool taken_if_set) {
+    builder.Emit(Inst::Dup);
+    builder.Emit(Inst::PushHalfWordImm, mask);
+    builder.Emit(Inst::And);
+    if (!taken_if_set) builder.Emit(Inst::LogicNot);
+    size_t branch = builder.Here();
+    builder.Emit(Inst::Branch);
+    builder.Emit(Inst::Pop);
+    size_t jump = builder.Here();
+    builder.Emit(Inst::Jump);
+    builder.Target(branch, builder.Here());
+    builder.Emit(Inst::Pop);
+    builder.Target(jump, builder.Here());
+  };
+
+  // the counter runs over every low bit pattern equally often, so 3 pops
+  // and 1/2 + 3/4 + 1/4 jmps are skipped per iteration
+  static_assert(kLoopCount % 4 == 0);
+  return builder.Loop(kLoopCount, [&]() {
+    test(1, true);
+    test(3, true);
+    test(3, false);
+  }, 4.5);
+}
+
+struct Mode {
+  const char *name;
+  DispatchMode dispatch;
+  bool cache_top;
+};
+
+// Final stack of the first mode of a kernel, later modes must match it.
+vector<Unit> reference;
+
+bool SameUnits(const Unit *units, size_t count) {
+  if (count != reference.size()) return false;
+  for (size_t idx = 0; idx < count; idx += 1) {
+    if (units[idx].type != reference[idx].type
+      || UINTVAL(units[idx]) != UINTVAL(reference[idx])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// the JSON object of a kernel on a mode, false when its stack differs
+bool MeasureKernel(FILE *fp, const Kernel &kernel, const Mode &mode, bool first) {
+  MachineOptions options;
+  options.dispatch = mode.dispatch;
+  options.cache_top = mode.cache_top;
+  bool checked = true;
+
+  double seconds = Best([&]() {
+    Machine machine(options);
+    machine.Run(kernel.prog);
+    auto &stack = machine.GetStack();
+    if (first && reference.empty()) {
+      reference.assign(stack.Base(), stack.Top());
+    }
+    else if (!SameUnits(stack.Base(), stack.Depth())) {
+      checked = false;
+    }
+  });
+
+  fprintf(fp, "    {\"kernel\": \"%s\", \"mode\": \"%s\", \"instructions\": %llu, "
+    "\"ns_per_inst\": %.3f, \"minst_per_s\": %.2f, \"checked\": %s}",
+    kernel.name, mode.name, (unsigned long long)kernel.executed,
+    seconds * 1e9 / kernel.executed, kernel.executed / seconds / 1e6,
+    checked ? "true" : "false");
+  return checked;
+}
+
+// labels, every macro and most plain mnemonics, jumps back and forth
+string MakeSource() {
+  string source;
+  uint64_t seed = 0x2545F4914F6CDD1D;
+  auto next = [&seed]() {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+  };
+
+  vector<const char *> plain;
+  for (size_t idx = 0; idx < kInstStrings.size(); idx += 1) {
+    auto inst = static_cast<Inst>(idx);
+    if (GetInstLength(inst) == 1 && inst != Inst::Jump && inst != Inst::Branch
+      && inst != Inst::FarJump && inst != Inst::FarBranch) {
+      plain.push_back(kInstStrings[idx]);
+    }
+  }
+
+  char line[96];
+  for (size_t idx = 0; idx < kSourceBlocks; idx += 1) {
+    snprintf(line, sizeof(line), "block%zu:\npushimm %lld\npushuimm %llu\npushfp %.6f\n", idx,
+      (long long)(next() >> 20) - (1ll << 43), (unsigned long long)next(),
+      double(next() % 1000000) / 64.0);
+    source += line;
+    snprintf(line, sizeof(line), "\t%s\n  %s\npushhwi %u\n", plain[next() % plain.size()],
+      plain[next() % plain.size()], unsigned(next() % 100000));
+    source += line;
+    snprintf(line, sizeof(line), "branch block%zu\njmp block%zu\n",
+      idx, size_t(next() % kSourceBlocks));
+    source += line;
+  }
+
+  return source;
+}
+
+void PrintThroughput(FILE *fp, const char *name, size_t bytes, double seconds, bool checked) {
+  fprintf(fp, "    {\"name\": \"%s\", \"bytes\": %zu, \"us\": %.1f, \"mb_per_s\": %.2f, "
+    "\"checked\": %s}", name, bytes, seconds * 1e6, bytes / seconds / 1e6,
+    checked ? "true" : "false");
+}
+
+int main(int argc, char **argv) {
+  string prefix = argc > 1 ? argv[1] : "bin/bench-suite";
+  bool fine = true;
+  auto out = stdout;
+
+  vector<Kernel> kernels = {
+    MakeDispatchKernel(), MakeIntKernel(), MakeUIntKernel(), MakeFPKernel(),
+    MakeShiftKernel(), MakeDupNKernel(), MakeBranchKernel()
+  };
+  vector<Mode> modes = {
+    { "switch", DispatchMode::Switch, false },
+    { "switch+tos", DispatchMode::Switch, true },
+#ifdef CANVAS_THREADED_DISPATCH
+    { "threaded+tos", DispatchMode::Threaded, true },
+    { "register", DispatchMode::Register, false },
+#endif
+#ifdef CANVAS_JIT
+    { "jit", DispatchMode::Jit, false },
+#endif
+  };
+
+  fprintf(out, "{\n  \"format\": %d,\n  \"isa\": \"%08x\",\n  \"vm\": [\n",
+    kSuiteFormat, GetIsaFingerprint());
+  const char *separator = "";
+  for (auto &kernel : kernels) {
+    reference.clear();
+    for (auto &mode : modes) {
+      fputs(separator, out);
+      fine = MeasureKernel(out, kernel, mode, &mode == &modes.front()) && fine;
+      separator = ",\n";
+    }
+  }
+  fputs("\n  ],\n", out);
+
+  // the assembler on memory, on the written file, and the .bc of the
+  // result loaded back
+  auto source = MakeSource();
+  auto csrc_path = prefix + ".csrc";
+  auto bc_path = prefix + ".bc";
+  auto fp = fopen(csrc_path.data(), "wb");
+  if (fp == nullptr) {
+    fprintf(stderr, "Cannot write %s\n", csrc_path.data());
+    return 1;
+  }
+  fwrite(source.data(), 1, source.size(), fp);
+  fclose(fp);
+
+  Program prog;
+  double seconds = Best([&]() {
+    prog.clear();
+    Assembler assembler(prog);
+    assembler.Feed(source);
+    assembler.Finish();
+  });
+  fputs("  \"assembler\": [\n", out);
+  PrintThroughput(out, "assemble", source.size(), seconds, !prog.empty());
+  fine = fine && !prog.empty();
+
+  Program from_file;
+  Labels labels;
+  seconds = Best([&]() {
+    from_file.clear();
+    AssembleFile(csrc_path.data(), from_file, labels);
+  });
+  bool checked = from_file == prog && labels.size() == kSourceBlocks;
+  fputs(",\n", out);
+  PrintThroughput(out, "file", source.size(), seconds, checked);
+  fine = fine && checked;
+  fputs("\n  ],\n", out);
+
+  BytecodeSections sections;
+  for (auto &label : labels) {
+    sections.symbols.push_back(BytecodeSymbol{ label.first, label.second });
+  }
+  std::sort(sections.symbols.begin(), sections.symbols.end(),
+    [](const BytecodeSymbol &lhs, const BytecodeSymbol &rhs) { return lhs.value < rhs.value; });
+  if (!WriteBytecodeFile(bc_path.data(), prog, sections)) {
+    remove(csrc_path.data());
+    return 1;
+  }
+
+  // Open() checksums the whole file, so the time scales with its size,
+  // unchecked loads only read the header and the sections
+  size_t bc_size = 0;
+  auto time_load = [&](bool checksum, bool &checked) {
+    checked = true;
+    auto result = Best([&]() {
+      for (int idx = 0; idx < kLoads; idx += 1) {
+        BytecodeFile file;
+        checked = file.Open(bc_path.data(), false, checksum) && checked;
+      }
+    }) / kLoads;
+    // the code is compared once, outside the timed loads
+    BytecodeFile file;
+    checked = checked && file.Open(bc_path.data(), false, checksum)
+      && file.View().size() == prog.size()
+      && std::equal(prog.begin(), prog.end(), file.View().begin());
+    return result;
+  };
+  seconds = time_load(true, checked);
+  bool unchecked_fine;
+  double unchecked_seconds = time_load(false, unchecked_fine);
+  auto bc_fp = fopen(bc_path.data(), "rb");
+  if (bc_fp != nullptr) {
+    fseek(bc_fp, 0, SEEK_END);
+    bc_size = size_t(std::max(0l, ftell(bc_fp)));
+    fclose(bc_fp);
+  }
+  fputs("  \"bytecode\": [\n", out);
+  PrintThroughput(out, "load", bc_size, seconds, checked);
+  fputs(",\n", out);
+  PrintThroughput(out, "load-unchecked", bc_size, unchecked_seconds, unchecked_fine);
+  fine = fine && checked && unchecked_fine;
+  fputs("\n  ]\n}\n", out);
+
+  remove(csrc_path.data());
+  remove(bc_path.data());
+  return fine ? 0 : 1;
+}
@@ -0,0 +1,163 @@
+#include "machine.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <algorithm>
+
+// Reads "<count> <inst> <inst> [<inst>]" profiles written by 
+// Machine::DumpPairProfile and prints a new superinstruction.h.
+// usage: supergen [-n<max>] [profile]... > superinstruction.h
+// Without profiles the table comes out empty.
+
+using std::map;
+using std::string;
+
+constexpr size_t kDefaultMaxSuperInsts = 8;
+
+// enum names, superinstructions from the current table excluded
+#define DEF_INST(_id, _str) #_id,
+#define DEF_SUPER_INST2(_id, _str, _a, _b)
+#define DEF_SUPER_INST3(_id, _str, _a, _b, _c)
+const vector<const char *> kBaseInstNames = {
+#include "instruction.h"
+};
+
+bool FindBaseInst(size_t &dest, const char *str) {
+  for (size_t idx = 0; idx < kBaseInstNames.size(); idx += 1) {
+    if (strcmp(kInstStrings[idx], str) == 0) {
+      dest = idx;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Components must be single-word, only one may read args and only the
+// last may transfer control. Far jumps and Doze are never fused so the
+// optimizer and the schedulers can still find them, heap instructions
+// neither so the JIT and register tier can tell heap programs apart.
+bool IsFusable(const vector<size_t> &parts) {
+  size_t arg_users = 0;
+
+  for (size_t idx = 0; idx < parts.size(); idx += 1) {
+    auto inst = static_cast<Inst>(parts[idx]);
+    bool last = idx + 1 == parts.size();
+
+    if (GetInstLength(inst) != 1 || inst == Inst::FarJump 
+      || inst == Inst::FarBranch || inst == Inst::Doze || IsHeapInst(inst)) {
+      return false;
+    }
+
+    if (!last && (inst == Inst::Jump || inst == Inst::Branch)) {
+      return false;
+    }
+
+    if (InstUsesArgs(inst)) {
+      arg_users += 1;
+    }
+  }
+
+  return arg_users <= 1;
+}
+
+int main(int argc, char **argv) {
+  size_t max_count = kDefaultMaxSuperInsts;
+  map<vector<size_t>, uint64_t> counts;
+  uint64_t total = 0;
+
+  for (int idx = 1; idx < argc; idx += 1) {
+    if (strncmp(argv[idx], "-n", 2) == 0) {
+      max_count = strtoull(argv[idx] + 2, nullptr, 10);
+      continue;
+    }
+
+    auto fp = fopen(argv[idx], "r");
+    if (fp == nullptr) {
+      fprintf(stderr, "Invalid profile: %s\n", argv[idx]);
+      return 1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != nullptr) {
+      unsigned long long count = 0;
+      char names[3][64];
+      int fields = sscanf(line, "%llu %63s %63s %63s", &count, names[0], names[1], names[2]);
+      if (fields < 3) continue;
+
+      vector<size_t> parts;
+      bool known = true;
+      for (int part = 0; part < fields - 1; part += 1) {
+        size_t inst = 0;
+        known = known && FindBaseInst(inst, names[part]);
+        parts.push_back(inst);
+      }
+
+      if (known && IsFusable(parts)) {
+        counts[parts] += count;
+        total += parts.size() == 2 ? count : 0;
+      }
+    }
+
+    fclose(fp);
+  }
+
+  // rank by dispatches saved
+  vector<pair<uint64_t, vector<size_t>>> ranked;
+  for (auto &entry : counts) {
+    ranked.push_back({ entry.second * (entry.first.size() - 1), entry.first });
+  }
+  std::sort(ranked.begin(), ranked.end(), 
+    [](auto &lhs, auto &rhs) { return lhs.first > rhs.first; });
+
+  size_t room = 0x80 - kBaseInstNames.size();
+  if (max_count > room) max_count = room;
+
+  // a run inside a picked longer one is only worth it if it also
+  // executes on its own
+  vector<pair<uint64_t, vector<size_t>>> picked;
+  for (auto &entry : ranked) {
+    if (picked.size() >= max_count) break;
+
+    bool covered = false;
+    for (auto &chosen : picked) {
+      auto &outer = chosen.second;
+      auto &inner = entry.second;
+      if (outer.size() > inner.size() 
+        && counts[inner] <= counts[outer]
+        && std::search(outer.begin(), outer.end(), inner.begin(), inner.end()) != outer.end()) {
+        covered = true;
+        break;
+      }
+    }
+
+    if (!covered) picked.push_back(entry);
+  }
+  ranked.swap(picked);
+
+  puts("// Canvas Fused Superinstructions.");
+  puts("// Generated by bin/supergen from opcode pair profiles, see make-superinst.sh.");
+  puts("// Included at the end of instruction.h, do not include directly.");
+  printf("// %llu adjacent pairs profiled\n", (unsigned long long)total);
+  if (ranked.empty()) {
+    puts("// No superinstructions.");
+  }
+
+  for (auto &entry : ranked) {
+    auto &parts = entry.second;
+    string id, str;
+    for (size_t idx = 0; idx < parts.size(); idx += 1) {
+      id += (idx == 0 ? "" : "_") + string(kBaseInstNames[parts[idx]]);
+      str += (idx == 0 ? "" : ".") + string(kInstStrings[parts[idx]]);
+    }
+
+    printf("\n// saves %llu dispatches\n", (unsigned long long)entry.first);
+    printf("DEF_SUPER_INST%zu(%s, \"%s\"", parts.size(), id.data(), str.data());
+    for (auto part : parts) {
+      printf(", %s", kBaseInstNames[part]);
+    }
+    puts(")");
+  }
+
+  return 0;
+}
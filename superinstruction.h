@@ -0,0 +1,5 @@
+// Canvas Fused Superinstructions.
+// Generated by bin/supergen from opcode pair profiles, see make-superinst.sh.
+// Included at the end of instruction.h, do not include directly.
+// 0 adjacent pairs profiled
+// No superinstructions.
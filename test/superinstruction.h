@@ -0,0 +1,15 @@
+// Canvas Fused Superinstructions.
+// Fixed table for make-test.sh, in the format bin/supergen writes.
+// Built in with -DCANVAS_SUPERINST_TABLE='"test/superinstruction.h"' so
+// every fused handler runs on the test programs at -O3, including a
+// push that feeds a far branch.
+
+DEF_SUPER_INST2(Dup_PushHalfWordImm, "dup.pushhwi", Dup, PushHalfWordImm)
+
+DEF_SUPER_INST3(SwapTop_PushHalfWordImm_AddU, "swaptop.pushhwi.addu", SwapTop, PushHalfWordImm, AddU)
+
+DEF_SUPER_INST2(PushHalfWordImm_SubU, "pushhwi.subu", PushHalfWordImm, SubU)
+
+DEF_SUPER_INST2(SubU_Branch, "subu.branch", SubU, Branch)
+
+DEF_SUPER_INST2(Print_PushHalfWordImm, "print.pushhwi", PrintStackTop, PushHalfWordImm)
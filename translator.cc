@@ -0,0 +1,220 @@
+#include "translator.h"
+#include "verifier.h"
+#include <cstdio>
+#include <cstring>
+
+// enum names, superinstructions included
+#define DEF_INST(_id, _str) #_id,
+const vector<const char *> kInstNames = {
+#include "instruction.h"
+};
+
+inline bool IsStaticJumpInst(Inst inst) {
+  return inst == Inst::Jump || inst == Inst::Branch;
+}
+
+inline bool IsFarJumpInst(Inst inst) {
+  return inst == Inst::FarJump || inst == Inst::FarBranch;
+}
+
+const char *const kUnitTypeNames[] = { "Int", "UInt", "FP", "Ptr" };
+
+// far jumps go through the switch at L_Dispatch
+#define FAR_JUMP_TO_DEFINITION "#define JUMP_TO(_target) { pc = (_target); goto L_Dispatch; }\n"
+
+TranslateReport TranslateProgram(FILE *fp, ProgramView prog,
+  const MachineOptions &options, const char *source_name) {
+  TranslateReport report{ true, 0, nullptr };
+  auto prog_size = prog.size();
+
+  vector<const SuperInst *> supers(0x80, nullptr);
+  for (auto &super : kSuperInsts) {
+    supers[size_t(super.inst)] = &super;
+  }
+
+  // parts of the instruction at pc, one entry for plain instructions
+  auto get_parts = [&](size_t pc, vector<Inst> &dest) {
+    auto inst = static_cast<Inst>(GET_INST(prog[pc]));
+    dest.clear();
+    if (supers[size_t(inst)] != nullptr) {
+      auto super = supers[size_t(inst)];
+      dest.assign(super->parts, super->parts + super->count);
+    }
+    else {
+      dest.push_back(inst);
+    }
+  };
+
+  // instruction starts, static jump targets and far jump use
+  vector<bool> starts(prog_size, false);
+  vector<bool> targets(prog_size, false);
+  vector<Inst> parts;
+  bool far_jumps = false;
+  for (size_t pc = 0; pc < prog_size; pc += GetInstLength(static_cast<Inst>(GET_INST(prog[pc])))) {
+    starts[pc] = true;
+    get_parts(pc, parts);
+    for (auto part : parts) {
+      far_jumps = far_jumps || IsFarJumpInst(part);
+      // no collector in the generated program
+      if (IsHeapInst(part)) {
+        report.fine = false;
+        report.bad_target = pc;
+        report.error = "a heap instruction";
+        return report;
+      }
+    }
+  }
+
+  for (size_t pc = 0; pc < prog_size; pc += 1) {
+    if (!starts[pc]) continue;
+    get_parts(pc, parts);
+    if (!IsStaticJumpInst(parts.back())) continue;
+
+    auto target = GET_ARGS(prog[pc]);
+    if (target >= prog_size) continue;
+    if (!starts[target]) {
+      report.fine = false;
+      report.bad_target = target;
+      report.error = "a jump into the literal word";
+      return report;
+    }
+
+    targets[target] = true;
+  }
+
+  bool checked = options.stack_check != StackCheck::None;
+  bool verified = false;
+  size_t stack_capacity = options.stack_capacity;
+  TypeReport types{ false, {}, {} };
+  // verified programs leave out what never runs, PRINT_TYPE is only
+  // known for reachable prints
+  vector<bool> reachable(prog_size, true);
+  if (options.verify) {
+    auto verify_report = VerifyProgram(prog, options.stack_capacity);
+    if (verify_report.fine) {
+      verified = true;
+      checked = false;
+      stack_capacity = verify_report.max_depth;
+      for (size_t pc = 0; pc < prog_size; pc += 1) {
+        reachable[pc] = verify_report.depths[pc] != kUnreachable;
+      }
+    }
+    if (verified && options.typed) {
+      types = InferTypes(prog, verify_report);
+    }
+  }
+
+  fprintf(fp, "// Generated from %s by TranslateProgram(), do not edit.\n", source_name);
+  fprintf(fp, "// Build: g++ -std=c++20 -O2 -I<canvas source dir> <this file>\n");
+  fprintf(fp, "#include \"machine.handler.h\"\n\n");
+  fprintf(fp, "constexpr EngineConfig kConfig{ %s, %s, %s, %s };\n",
+    checked ? "true" : "false", options.cache_top ? "true" : "false",
+    verified ? "true" : "false", types.fine ? "true" : "false");
+  fprintf(fp, "using Slot = %s;\n", types.fine ? "RawUnit" : "Unit");
+  fprintf(fp, "constexpr size_t kStackCapacity = %zu;\n\n", stack_capacity);
+
+  fprintf(fp, "static const Code kProgram[] = {");
+  for (size_t idx = 0; idx < prog_size; idx += 1) {
+    fprintf(fp, "%s0x%08x,", idx % 8 == 0 ? "\n  " : " ", prog[idx]);
+  }
+  fprintf(fp, "\n};\n\n");
+
+  // one spare unit below base, like OperandStack
+  fprintf(fp, "static Slot stack_units[kStackCapacity + 1];\n");
+  fprintf(fp, "static OutputSink output;\n\n");
+
+  fprintf(fp, "int main() {\n");
+  fprintf(fp, "  bool result = true;\n");
+  fprintf(fp, "  constexpr uint64_t prog_size = %zu;\n", prog_size);
+  fprintf(fp, "  uint64_t pc = 0;\n");
+  fprintf(fp, "  Slot *base = stack_units + 1;\n");
+  fprintf(fp, "  Slot *limit = base + kStackCapacity;\n");
+  fprintf(fp, "  Slot *sp = kConfig.cache_top ? base - 1 : base;\n");
+  fprintf(fp, "  Slot tos{}, tmp0, tmp1;\n");
+  fprintf(fp, "  (void)limit; (void)tos; (void)tmp0; (void)tmp1;\n\n");
+  fprintf(fp, "#define ARG GET_ARGS(kProgram[pc])\n");
+  fprintf(fp, "#define WORD(_n) kProgram[pc + (_n)]\n");
+  fprintf(fp, "#define YIELD()\n");
+  fprintf(fp, "#define OUTPUT output\n");
+  if (!types.fine) {
+    fprintf(fp, "#define PRINT_TYPE (TOP.type)\n");
+  }
+  fprintf(fp, FAR_JUMP_TO_DEFINITION "\n");
+
+  for (size_t pc = 0; pc < prog_size; pc += 1) {
+    if (!starts[pc] || !reachable[pc]) continue;
+    get_parts(pc, parts);
+
+    if (targets[pc] || far_jumps) {
+      fprintf(fp, "L_%zu:\n", pc);
+    }
+
+    // static jumps name their label directly
+    bool static_jump = IsStaticJumpInst(parts.back());
+    if (static_jump) {
+      auto target = GET_ARGS(prog[pc]);
+      fprintf(fp, "#undef JUMP_TO\n");
+      if (target >= prog_size) {
+        fprintf(fp, "#define JUMP_TO(_target) goto L_Exit;\n");
+      }
+      else {
+        fprintf(fp, "#define JUMP_TO(_target) goto L_%u;\n", target);
+      }
+    }
+
+    // typed programs print with the proven type
+    auto print = types.print.find(pc);
+    if (types.fine && print != types.print.end()) {
+      fprintf(fp, "#undef PRINT_TYPE\n#define PRINT_TYPE UnitType::%s\n",
+        kUnitTypeNames[size_t(print->second)]);
+    }
+
+    fprintf(fp, "  pc = %zu; {", pc);
+    for (auto part : parts) {
+      auto inst = size_t(part);
+      if (inst < kInstNames.size()) {
+        fprintf(fp, " OP_%s", kInstNames[inst]);
+      }
+    }
+    fprintf(fp, " }\n");
+
+    if (static_jump) {
+      fprintf(fp, "#undef JUMP_TO\n" FAR_JUMP_TO_DEFINITION);
+    }
+  }
+
+  fprintf(fp, "  goto L_Exit;\n\n");
+
+  fprintf(fp, "L_Dispatch:\n");
+  fprintf(fp, "  switch (pc) {\n");
+  if (far_jumps) {
+    for (size_t pc = 0; pc < prog_size; pc += 1) {
+      if (starts[pc] && reachable[pc]) {
+        fprintf(fp, "  case %zu: goto L_%zu;\n", pc, pc);
+      }
+    }
+  }
+  fprintf(fp, "  default: break;\n");
+  fprintf(fp, "  }\n\n");
+  fprintf(fp, "  if (pc < prog_size) {\n");
+  fprintf(fp, "    output.Message(\"(!)Far jump into a literal word\");\n");
+  fprintf(fp, "    result = false;\n");
+  fprintf(fp, "  }\n");
+  fprintf(fp, "  goto L_Exit;\n\n");
+
+  // referenced from discarded checks too
+  fprintf(fp, "L_Underflow:\n");
+  fprintf(fp, "  output.Message(\"(!)Stack underflow\");\n");
+  fprintf(fp, "  result = false;\n");
+  fprintf(fp, "  goto L_Exit;\n\n");
+  fprintf(fp, "L_Overflow:\n");
+  fprintf(fp, "  output.Message(\"(!)Stack overflow\");\n");
+  fprintf(fp, "  result = false;\n\n");
+
+  fprintf(fp, "L_Exit:\n");
+  fprintf(fp, "  output.Flush();\n");
+  fprintf(fp, "  return result ? 0 : 1;\n");
+  fprintf(fp, "}\n");
+
+  return report;
+}
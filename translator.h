@@ -0,0 +1,24 @@
+#pragma once
+#include "machine.h"
+
+// Ahead-of-time translation of a Program into a C++ source file.
+// Every instruction becomes a labelled block expanding the same OP_<Inst>
+// handler as the interpreter (machine.handler.h), so results are bit-exact.
+// Jump/Branch become gotos, FarJump/FarBranch go through a switch over
+// every instruction start, emitted only if the program uses them.
+// The operand stack is a static array of options.stack_capacity units,
+// explicit checks are emitted unless options.stack_check is None.
+// Programs passing VerifyProgram() get no checks at all, and a stack of
+// exactly the verified maximum, untagged if InferTypes() proves them.
+// Programs using the heap are refused, the output has no collector.
+// Build the output with:
+//   g++ -std=c++20 -O2 -I<canvas source dir> <file>.cc
+
+struct TranslateReport {
+  bool fine;
+  size_t bad_target; //where translation failed, if !fine
+  const char *error; //why, if !fine
+};
+
+TranslateReport TranslateProgram(FILE *fp, ProgramView prog,
+  const MachineOptions &options, const char *source_name);
@@ -0,0 +1,423 @@
+#include "verifier.h"
+#include <algorithm>
+
+// Abstract stack: exact depth, plus the top value while it is a known
+// literal so far jump addresses can be followed.
+struct AbstractState {
+  size_t depth;
+  bool top_known;
+  uint64_t top;
+};
+
+// operands an instruction needs and how it changes the depth
+struct StackEffect {
+  size_t require;
+  int64_t delta;
+};
+
+static StackEffect GetStackEffect(Inst inst, uint32_t args) {
+  switch (inst) {
+  case Inst::Add: case Inst::Sub: case Inst::Mul: case Inst::Div: case Inst::Mod:
+  case Inst::AddU: case Inst::SubU: case Inst::MulU: case Inst::DivU: case Inst::ModU:
+  case Inst::AddF: case Inst::SubF: case Inst::MulF: case Inst::DivF:
+  case Inst::AddSL32:
+  case Inst::And: case Inst::Or: case Inst::XOr:
+  case Inst::LogicAnd: case Inst::LogicOr:
+  case Inst::ShiftLeft: case Inst::LogicShiftRight: case Inst::ArithShiftRight:
+  case Inst::RotateLeft: case Inst::RotateRight:
+    return { 2, -1 };
+  case Inst::PushHalfWordImm: case Inst::PushHalfWordImmSL16:
+  case Inst::PushWordImm: case Inst::PushDoubleWordImm:
+    return { 0, 1 };
+  case Inst::SpawnFP: case Inst::SpawnSignedInt:
+  case Inst::ShiftLeftImm: case Inst::LogicShiftRightImm: case Inst::ArithShiftRightImm:
+  case Inst::RotateLeftImm: case Inst::RotateRightImm:
+  case Inst::Not: case Inst::LogicNot:
+  case Inst::Branch: case Inst::PrintStackTop:
+    return { 1, 0 };
+  case Inst::Pop: case Inst::FarJump:
+    return { 1, -1 };
+  case Inst::FarBranch:
+    return { 2, -2 };
+  case Inst::SwapTop:
+    return { 2, 0 };
+  case Inst::Dup:
+    return { 1, 1 };
+  case Inst::DupN:
+    return { 1, int64_t(args) };
+  case Inst::New:
+    return { 1, 0 };
+  case Inst::Load:
+    return { 2, -1 };
+  case Inst::Store:
+    return { 3, -3 };
+  default:
+    break;
+  }
+
+  return { 0, 0 };
+}
+
+VerifyReport VerifyProgram(ProgramView prog, size_t capacity, size_t initial_depth) {
+  auto prog_size = prog.size();
+  VerifyReport report{ true, initial_depth, vector<size_t>(prog_size, kUnreachable), 0, nullptr, {}, false };
+
+  vector<const SuperInst *> supers(0x80, nullptr);
+  for (auto &super : kSuperInsts) {
+    supers[size_t(super.inst)] = &super;
+  }
+
+  // instruction starts, so targets inside literals are caught
+  vector<bool> starts(prog_size, false);
+  for (size_t pc = 0; pc < prog_size; pc += GetInstLength(static_cast<Inst>(GET_INST(prog[pc])))) {
+    starts[pc] = true;
+  }
+
+  vector<AbstractState> states(prog_size);
+  vector<size_t> worklist;
+
+#define FAIL(_pc, _error)       \
+  {                             \
+    report.fine = false;        \
+    report.error_pc = (_pc);    \
+    report.error = (_error);    \
+    return report;              \
+  }
+
+  // merge a state into a successor, the end of the program needs none
+  auto flow_to = [&](size_t target, const AbstractState &state) -> const char * {
+    if (target == prog_size) return nullptr;
+    if (target > prog_size) return "jump target out of range";
+    if (!starts[target]) return "jump into a literal word";
+
+    auto &dest = states[target];
+    if (report.depths[target] == kUnreachable) {
+      report.depths[target] = state.depth;
+      dest = state;
+      worklist.push_back(target);
+    }
+    else if (dest.depth != state.depth) {
+      return "stack depth differs between paths";
+    }
+    else if (dest.top_known && (!state.top_known || dest.top != state.top)) {
+      // known literal -> unknown, so each pc is revisited at most once
+      dest.top_known = false;
+      worklist.push_back(target);
+    }
+
+    return nullptr;
+  };
+
+  if (initial_depth > capacity) FAIL(0, "stack overflow");
+
+  if (prog_size != 0) {
+    report.depths[0] = initial_depth;
+    states[0] = AbstractState{ initial_depth, false, 0 };
+    worklist.push_back(0);
+  }
+
+  while (!worklist.empty()) {
+    size_t pc = worklist.back();
+    worklist.pop_back();
+
+    auto state = states[pc];
+    auto inst = static_cast<Inst>(GET_INST(prog[pc]));
+    auto args = GET_ARGS(prog[pc]);
+    auto length = GetInstLength(inst);
+
+    if (size_t(inst) >= kInstStrings.size()) FAIL(pc, "unknown instruction");
+    if (pc + length > prog_size) FAIL(pc, "literal cut off by the end of the program");
+
+    Inst parts[3] = { inst, inst, inst };
+    size_t part_count = 1;
+    if (supers[size_t(inst)] != nullptr) {
+      std::copy_n(supers[size_t(inst)]->parts, 3, parts);
+      part_count = supers[size_t(inst)]->count;
+    }
+
+    bool falls_through = true;
+    for (size_t idx = 0; idx < part_count; idx += 1) {
+      auto part = parts[idx];
+      auto effect = GetStackEffect(part, args);
+      report.uses_heap = report.uses_heap || IsHeapInst(part);
+
+      if (state.depth < effect.require) FAIL(pc, "stack underflow");
+      if (effect.delta > 0 && capacity - state.depth < size_t(effect.delta)) {
+        FAIL(pc, "stack overflow");
+      }
+
+      // successors taken before the depth changes
+      const char *error = nullptr;
+      switch (part) {
+      case Inst::Jump:
+        error = flow_to(args, state);
+        falls_through = false;
+        break;
+      case Inst::Branch:
+        error = flow_to(args, state);
+        break;
+      case Inst::FarJump:
+      case Inst::FarBranch: {
+        if (!state.top_known) FAIL(pc, "far jump through a computed address");
+        auto target = state.top;
+        report.far_targets[pc] = size_t(target);
+        auto next = state;
+        next.depth = state.depth + effect.delta;
+        next.top_known = false;
+        error = flow_to(target > prog_size ? prog_size + 1 : size_t(target), next);
+        falls_through = part == Inst::FarBranch;
+        break;
+      }
+      default:
+        break;
+      }
+
+      if (error != nullptr) FAIL(pc, error);
+
+      state.depth = size_t(int64_t(state.depth) + effect.delta);
+      report.max_depth = std::max(report.max_depth, state.depth);
+
+      // track literal pushes for far jumps
+      switch (part) {
+      case Inst::PushHalfWordImm:
+        state.top_known = true;
+        state.top = args;
+        break;
+      case Inst::PushHalfWordImmSL16:
+        state.top_known = true;
+        state.top = uint64_t(args) << 16;
+        break;
+      case Inst::PushWordImm:
+        state.top_known = true;
+        state.top = static_cast<UnitType>(args) == UnitType::Int ?
+          static_cast<uint64_t>(static_cast<int32_t>(prog[pc + 1])) : prog[pc + 1];
+        break;
+      case Inst::PushDoubleWordImm:
+        state.top_known = true;
+        state.top = (uint64_t(prog[pc + 2]) << 32) | prog[pc + 1];
+        break;
+      case Inst::Dup:
+      case Inst::DupN:
+      case Inst::Branch:
+      case Inst::PrintStackTop:
+      case Inst::Doze:
+      case Inst::SpawnFP:
+      case Inst::SpawnSignedInt:
+        break;
+      default:
+        state.top_known = false;
+        break;
+      }
+    }
+
+    if (falls_through) {
+      auto error = flow_to(pc + length, state);
+      if (error != nullptr) FAIL(pc, error);
+    }
+  }
+#undef FAIL
+
+  return report;
+}
+
+// slot types while inferring, UnitType values plus one for conflicts
+constexpr uint8_t kUnknownType = uint8_t(UnitType::Ptr) + 1;
+
+// Apply one instruction to the slot types, bottom first.
+static void ApplyTypes(vector<uint8_t> &slots, Inst inst, uint32_t args) {
+  auto set_top = [&slots](UnitType type) { slots.back() = uint8_t(type); };
+
+  switch (inst) {
+  case Inst::Add: case Inst::Sub: case Inst::Mul: case Inst::Div: case Inst::Mod:
+    slots.pop_back();
+    set_top(UnitType::Int);
+    break;
+  case Inst::AddU: case Inst::SubU: case Inst::MulU: case Inst::DivU: case Inst::ModU:
+  case Inst::AddSL32:
+  case Inst::And: case Inst::Or: case Inst::XOr:
+  case Inst::LogicAnd: case Inst::LogicOr:
+  case Inst::RotateLeft: case Inst::RotateRight:
+    slots.pop_back();
+    set_top(UnitType::UInt);
+    break;
+  case Inst::AddF: case Inst::SubF: case Inst::MulF: case Inst::DivF:
+    slots.pop_back();
+    set_top(UnitType::FP);
+    break;
+  case Inst::Not: case Inst::LogicNot:
+  case Inst::RotateLeftImm: case Inst::RotateRightImm:
+    set_top(UnitType::UInt);
+    break;
+  case Inst::PushHalfWordImm: case Inst::PushHalfWordImmSL16:
+    slots.push_back(uint8_t(UnitType::UInt));
+    break;
+  case Inst::PushWordImm: case Inst::PushDoubleWordImm:
+    // a bad tag prints nothing, leave it to the tagged engines
+    slots.push_back(args <= uint32_t(UnitType::FP) ? uint8_t(args) : kUnknownType);
+    break;
+  case Inst::SpawnFP:
+    set_top(UnitType::FP);
+    break;
+  case Inst::SpawnSignedInt:
+    set_top(UnitType::Int);
+    break;
+  // shifts keep the tag of the shifted unit
+  case Inst::ShiftLeft: case Inst::LogicShiftRight: case Inst::ArithShiftRight:
+  case Inst::Pop: case Inst::FarJump:
+    slots.pop_back();
+    break;
+  case Inst::FarBranch:
+    slots.resize(slots.size() - 2);
+    break;
+  case Inst::SwapTop:
+    std::swap(slots[slots.size() - 1], slots[slots.size() - 2]);
+    break;
+  case Inst::Dup:
+    slots.push_back(slots.back());
+    break;
+  case Inst::DupN:
+    slots.resize(slots.size() + args, slots.back());
+    break;
+  default:
+    break;
+  }
+}
+
+TypeReport InferTypes(ProgramView prog, const VerifyReport &verify) {
+  auto prog_size = prog.size();
+  TypeReport report{ false, {}, {} };
+  if (!verify.fine || verify.uses_heap) return report;
+
+  // slot types of each reachable pc live at offsets[pc] in cells
+  vector<size_t> offsets(prog_size, 0);
+  size_t cell_count = 0;
+  for (size_t pc = 0; pc < prog_size; pc += 1) {
+    if (verify.depths[pc] == kUnreachable) continue;
+    offsets[pc] = cell_count;
+    cell_count += verify.depths[pc];
+    if (cell_count > kMaxTypeCells) return report;
+  }
+
+  vector<uint8_t> cells(cell_count, kUnknownType);
+  vector<bool> reached(prog_size, false);
+  vector<uint8_t> exit_slots;
+  bool exit_reached = false;
+  bool exit_fine = true;
+  vector<size_t> worklist;
+
+  vector<const SuperInst *> supers(0x80, nullptr);
+  for (auto &super : kSuperInsts) {
+    supers[size_t(super.inst)] = &super;
+  }
+
+  // merge into a successor, conflicting slots become unknown
+  auto flow_to = [&](size_t target, const vector<uint8_t> &slots) {
+    if (target >= prog_size) {
+      if (!exit_reached) {
+        exit_slots = slots;
+        exit_reached = true;
+      }
+      else if (exit_slots.size() != slots.size()) {
+        exit_fine = false;
+      }
+      else {
+        for (size_t idx = 0; idx < slots.size(); idx += 1) {
+          if (exit_slots[idx] != slots[idx]) exit_slots[idx] = kUnknownType;
+        }
+      }
+      return;
+    }
+
+    auto dest = cells.begin() + offsets[target];
+    if (!reached[target]) {
+      std::copy(slots.begin(), slots.end(), dest);
+      reached[target] = true;
+      worklist.push_back(target);
+      return;
+    }
+
+    bool changed = false;
+    for (size_t idx = 0; idx < slots.size(); idx += 1) {
+      if (dest[idx] != slots[idx] && dest[idx] != kUnknownType) {
+        dest[idx] = kUnknownType;
+        changed = true;
+      }
+    }
+    if (changed) worklist.push_back(target);
+  };
+
+  if (prog_size != 0) {
+    reached[0] = true;
+    worklist.push_back(0);
+  }
+
+  // printed types, conflicting prints at one pc become unknown
+  std::unordered_map<size_t, uint8_t> prints;
+  vector<uint8_t> slots;
+  while (!worklist.empty()) {
+    size_t pc = worklist.back();
+    worklist.pop_back();
+
+    auto begin = cells.begin() + offsets[pc];
+    slots.assign(begin, begin + verify.depths[pc]);
+
+    auto inst = static_cast<Inst>(GET_INST(prog[pc]));
+    auto args = GET_ARGS(prog[pc]);
+    Inst parts[3] = { inst, inst, inst };
+    size_t part_count = 1;
+    if (supers[size_t(inst)] != nullptr) {
+      std::copy_n(supers[size_t(inst)]->parts, 3, parts);
+      part_count = supers[size_t(inst)]->count;
+    }
+
+    bool falls_through = true;
+    for (size_t idx = 0; idx < part_count; idx += 1) {
+      auto part = parts[idx];
+      if (part == Inst::PrintStackTop) {
+        auto it = prints.find(pc);
+        if (it == prints.end()) {
+          prints[pc] = slots.back();
+        }
+        else if (it->second != slots.back()) {
+          it->second = kUnknownType;
+        }
+      }
+
+      ApplyTypes(slots, part, args);
+
+      // the verifier already proved every target
+      switch (part) {
+      case Inst::Jump:
+        flow_to(args, slots);
+        falls_through = false;
+        break;
+      case Inst::Branch:
+        flow_to(args, slots);
+        break;
+      case Inst::FarJump:
+      case Inst::FarBranch:
+        flow_to(verify.far_targets.at(pc), slots);
+        falls_through = part == Inst::FarBranch;
+        break;
+      default:
+        break;
+      }
+    }
+
+    if (falls_through) {
+      flow_to(pc + GetInstLength(inst), slots);
+    }
+  }
+
+  report.fine = exit_fine;
+  for (auto &[pc, type] : prints) {
+    report.fine = report.fine && type != kUnknownType;
+    report.print[pc] = static_cast<UnitType>(type);
+  }
+  for (auto type : exit_slots) {
+    report.fine = report.fine && type != kUnknownType;
+    report.exit.push_back(static_cast<UnitType>(type));
+  }
+
+  return report;
+}
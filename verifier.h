@@ -0,0 +1,50 @@
+#pragma once
+#include "machine.h"
+#include <unordered_map>
+
+// Static verifier.
+// Abstract interpretation over every reachable instruction finds the
+// exact stack depth at each pc. A program passes when
+// - every instruction finds the operands it needs, including
+//   Branch/Pop/PrintStackTop which never run on an empty stack,
+// - the depth at a pc is the same along every path to it,
+// - Jump/Branch targets and the literal address right before a
+//   FarJump/FarBranch land on an instruction start or the end,
+// - the stack never grows past the capacity, DupN counts included,
+// - no literal is cut off by the end of the program.
+// Verified programs run without any stack checks on a stack of exactly
+// max_depth units. initial_depth units are on the stack before the
+// first instruction, see Machine::Start().
+
+constexpr size_t kUnreachable = SIZE_MAX;
+
+struct VerifyReport {
+  bool fine;
+  size_t max_depth;
+  vector<size_t> depths; //at entry of each word, kUnreachable if never executed
+  size_t error_pc; //if !fine
+  const char *error; //if !fine
+  std::unordered_map<size_t, size_t> far_targets; //pc of a FarJump/FarBranch -> target
+  bool uses_heap; //reaches New/Load/Store
+};
+
+VerifyReport VerifyProgram(ProgramView prog, size_t capacity, size_t initial_depth = 0);
+
+// Static type inference over a verified program.
+// The same walk as VerifyProgram() tracks the UnitType of every stack
+// slot, slots reached with different types on different paths become
+// unknown. A program is fine when every unit PrintStackTop prints and
+// every unit left on the final stack has a single type, which is all an
+// untagged stack can not tell at run time (EngineConfig::typed).
+// Programs using the heap never are, the collector needs the tags.
+// States are kept per pc, programs needing more than kMaxTypeCells
+// slots in total are given up on.
+constexpr size_t kMaxTypeCells = size_t(1) << 24;
+
+struct TypeReport {
+  bool fine;
+  std::unordered_map<size_t, UnitType> print; //pc -> type PrintStackTop prints there
+  vector<UnitType> exit; //final stack, bottom first
+};
+
+TypeReport InferTypes(ProgramView prog, const VerifyReport &verify);